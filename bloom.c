@@ -0,0 +1,94 @@
+/**
+ * @brief: blocked Bloom filter, see bloom.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "bloom.h"
+
+/* odd multipliers, one per word, spread the low hash bits (as in the
+ * split block Bloom filter of Parquet/Impala) */
+static const U32 salt[BLOOM_WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+static U64 *block_of(const BLOOM *b, U64 h)
+{
+    return b->bits + ((h >> 32) * b->n_block >> 32) * BLOOM_WORDS;
+}
+
+/* bit of word i a key sets, from the low 32 bits of its hash */
+static U64 bit_of(U64 h, int i)
+{
+    return 1UL << (((U32) h * salt[i]) >> 26);
+}
+
+/**
+ * @brief: an empty filter for n_expect keys
+ * @param: bits_per_key int filter bits per expected key, more bits fewer
+ *         false positives; BLOOM_BITS_PER_KEY if <= 0
+ * @return 0 on success, 1 if out of memory
+ */
+int bloom_init(BLOOM *b, U64 n_expect, int bits_per_key)
+{
+    size_t size;
+
+    if (bits_per_key <= 0) {
+        bits_per_key = BLOOM_BITS_PER_KEY;
+    }
+    b->n_block = (n_expect * bits_per_key + BLOOM_WORDS * 64 - 1) /
+                 (BLOOM_WORDS * 64);
+    if (b->n_block == 0) {
+        b->n_block = 1;
+    }
+    if (b->n_block > 0xffffffffUL) {
+        b->n_block = 0xffffffffUL;
+    }
+    size = b->n_block * BLOOM_WORDS * sizeof(U64);
+    if (posix_memalign((void **) &b->bits, 64, size) != 0) {
+        b->bits = NULL;
+        return 1;
+    }
+    memset(b->bits, 0, size);
+    return 0;
+}
+
+void bloom_cleanup(BLOOM *b)
+{
+    free(b->bits);
+    b->bits = NULL;
+    b->n_block = 0;
+}
+
+void bloom_add(BLOOM *b, U64 h)
+{
+    U64 *w = block_of(b, h);
+    int i;
+
+    for (i = 0; i < BLOOM_WORDS; i++) {
+        __atomic_fetch_or(&w[i], bit_of(h, i), __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief: 0 if h was never added, 1 if it may have been
+ */
+int bloom_maybe(const BLOOM *b, U64 h)
+{
+    const U64 *w = block_of(b, h);
+    int i;
+
+    for (i = 0; i < BLOOM_WORDS; i++) {
+        U64 bit = bit_of(h, i);
+        if ((__atomic_load_n(&w[i], __ATOMIC_RELAXED) & bit) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+size_t bloom_size(const BLOOM *b)
+{
+    return b->n_block * BLOOM_WORDS * sizeof(U64);
+}
@@ -0,0 +1,30 @@
+/**
+ * @brief: blocked Bloom filter over 64-bit hashes
+ *
+ * The filter is an array of 64 byte blocks, one cache line each. A key
+ * picks one block with the high half of its hash and sets one bit in each
+ * of the block's eight 64-bit words with the low half, so both adding and
+ * testing touch a single cache line. Bits are set with atomic OR, so any
+ * number of threads may add and test at once without a lock.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+typedef unsigned int U32;
+typedef unsigned long int U64;
+
+#define BLOOM_WORDS 8                     /* words per block, 512 bits */
+#define BLOOM_BITS_PER_KEY 12             /* about 0.5% false positive */
+
+typedef struct bloom {
+    U64 *bits;           /* n_block * BLOOM_WORDS words, cache aligned */
+    U64 n_block;
+} BLOOM;
+
+int bloom_init(BLOOM *b, U64 n_expect, int bits_per_key);
+void bloom_cleanup(BLOOM *b);
+void bloom_add(BLOOM *b, U64 h);
+int bloom_maybe(const BLOOM *b, U64 h);
+size_t bloom_size(const BLOOM *b);
@@ -11,10 +11,12 @@
 #include <stdlib.h>  /* for malloc()                */
 #include "lab_png.h" /* simple PNG data structures  */
 #include "zutil.h"   /* simple PNG data structures  */
+#include "fmap.h"    /* mmap'd input files          */
 
 #include <dirent.h>
 #include <string.h> /* for strcat().  man strcat   */
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -35,16 +37,21 @@
  * @brief initialize memory with 256 chars 0 - 255 cyclically
  */
 
-int main(int argc, char **argv) {
-    if (argc == 1) {
-        printf("No png file, do nothing \n");
-        return 1;
-    }
-    if (argc == 2) {
-        printf("Just one png file, do nothing \n");
-        return 1;
-    }
-
+/**
+ * @brief concatenate PNG images vertically and write all.png
+ * @param n number of images
+ * @param bufs whole PNG files, already accepted by is_png()
+ * @param lens file lengths
+ * @param names names for messages
+ * @param maps the mappings behind bufs, closed here as soon as each one is
+ *        no longer needed; NULL if the caller owns the buffers
+ * @param stitch join the IDAT streams instead of inflating and deflating
+ * @param n_threads deflate threads, see mem_def_mt()
+ * @param level deflate level
+ * @return 0 on success
+ */
+int catpng_run(int n, U8 **bufs, size_t *lens, char **names, FILE_MAP *maps,
+               int stitch, int n_threads, int level) {
     int ret = 0;
 
     // all.png: chunk IHDR, IDAT, IEND (host)
@@ -56,143 +63,160 @@ int main(int argc, char **argv) {
     // temp IHDR.data (host)
     struct data_IHDR *ihdr_data_now = malloc(sizeof(struct data_IHDR));
 
-    // check is png
-    for (int i = 1; i < argc; ++i) {
-        U8 *p_buffer = NULL;
-        char *file_path = argv[i];
-        printf("%s \n", file_path);
-        FILE *f = fopen(file_path, "rb");
-        if (f == NULL) {
-            printf("File not found \n");
-            return 1;
-        }
-        fseek(f, 0, SEEK_END);
-        long fln = ftell(f);  // length
-
-        p_buffer = (U8 *)malloc(fln + 1);
-        if (p_buffer == NULL) {
-            perror("malloc");
-            return errno;
-        }
-
-        rewind(f);
-        fread(p_buffer, fln, 1, f);
-        // is png
-        int k = is_png(p_buffer, fln);
-        if (k == 1) {
-            printf("%s: Not a PNG file \n", argv[i]);
-            return 1;
-        }
-        fclose(f);
-        free(p_buffer);
-    }
     // unzipped buffer keeper
-    U8 **a_buf_unzip = (U8 **)malloc((argc - 1) * sizeof(U8 *));
-    U32 *a_len_unzip = (U32 *)malloc((argc - 1) * sizeof(U32 *));
+    U8 **a_buf_unzip = (U8 **)malloc(n * sizeof(U8 *));
+    U32 *a_len_unzip = (U32 *)malloc(n * sizeof(U32 *));
+    // stitch mode: compressed IDAT.data of every input, kept in its file
+    U8 **a_buf_zip = (U8 **)malloc(n * sizeof(U8 *));
+    U64 *a_len_zip = (U64 *)malloc(n * sizeof(U64));
+    U8 **a_zip_copy = (U8 **)malloc(n * sizeof(U8 *));
+    // one inflate state for all inputs, reset between files
+    ZS_STREAM zs_inf;
+    if (!stitch && (ret = zs_inf_init(&zs_inf))) {
+        zerr(ret);
+        return ret;
+    }
     // read multi pngs
-    for (int i = 1; i < argc; ++i) {
-        U8 *p_buffer = NULL;
-        char *file_path = argv[i];
-        FILE *f = fopen(file_path, "rb");
-        if (f == NULL) {
+    for (int i = 0; i < n; ++i) {
+        char *file_path = names[i];
+        U8 *p_buffer = bufs[i];
+        size_t fln = lens[i];
+        // walk the chunks in place: IHDR, any number of IDATs, others skipped
+        PNG_VIEW pv;
+        if (png_view_parse(&pv, p_buffer, fln, 0, NULL) != PNG_OK ||
+            pv.n_idat == 0) {
+            printf("%s: bad PNG layout \n", file_path);
             return 1;
         }
-        fseek(f, 0, SEEK_END);
-        long fln = ftell(f);  // length
-
-        p_buffer = (U8 *)malloc(fln + 1);
-        if (p_buffer == NULL) {
-            perror("malloc");
-            return errno;
-        }
-
-        rewind(f);
-        fread(p_buffer, fln, 1, f);
-        fclose(f);
-        // only use buffer to avoid file IO, so close f
-        U32 cur = 8;   // cur at IHDR.length
-        if (i == 1) {  // copy IHDR.length, IHDR.type once
-            ck_ihdr_all->length = get_8_to_32(p_buffer + cur);
-            cur += 4;
-            memcpy(ck_ihdr_all->type, p_buffer + cur, 4);
-            cur += 4;
-        } else {
-            cur += 8;
+        if (i == 0) {  // copy IHDR.length, IHDR.type once
+            ck_ihdr_all->length = DATA_IHDR_SIZE;
+            memcpy(ck_ihdr_all->type, "IHDR", 4);
         }
-        // cur at IHDR.data
         // get IHDR.data
-        if ((ret = get_png_IHDR_data(ihdr_data_now, p_buffer + cur))) {
+        if ((ret = get_png_IHDR_data(ihdr_data_now, pv.ihdr))) {
             printf("%s: get IHDR.data failed \n", file_path);
             return ret;
         }
-        if (i == 1) {  // copy IHDR.data once
+        if (i == 0) {  // copy IHDR.data once
             *ihdr_data_all = *ihdr_data_now;
+        } else if (stitch && (ihdr_data_now->width != ihdr_data_all->width ||
+                              ihdr_data_now->bit_depth !=
+                                      ihdr_data_all->bit_depth ||
+                              ihdr_data_now->color_type !=
+                                      ihdr_data_all->color_type ||
+                              ihdr_data_now->interlace)) {
+            printf("%s: width/format differs, cannot stitch \n", file_path);
+            return 1;
         } else {  // update height
             ihdr_data_all->height += ihdr_data_now->height;
         }
 
-        cur = 33;  // cur at IDAT.length
-
-        U32 len_idat_now = get_8_to_32(p_buffer + cur);  // get IDAT.length
-        if (i == 1) {                                    // copy IDAT.type once
-            cur += 4;
-            memcpy(ck_idat_all->type, p_buffer + cur, 4);
-            cur += 4;
-        } else {
-            cur += 8;
+        if (i == 0) {  // copy IDAT.type once
+            memcpy(ck_idat_all->type, "IDAT", 4);
         }
-        // cur at IDAT.data
         U64 len_unzip_idat_data_now_64;
-        a_len_unzip[i - 1] = (ihdr_data_now->width * 4 + 1) *
+        a_len_unzip[i] = (ihdr_data_now->width * 4 + 1) *
                              ihdr_data_now->height;  // bit-depth must be 8
-        a_buf_unzip[i - 1] = (U8 *)malloc(a_len_unzip[i - 1]);
-        // unzip IDAT.data
-        if ((ret = mem_inf(a_buf_unzip[i - 1], &len_unzip_idat_data_now_64,
-                           p_buffer + cur, len_idat_now))) {
-            printf("unzip %s's IDAT failed \n", file_path);
-            return ret;
+        a_buf_unzip[i] = NULL;
+        a_zip_copy[i] = NULL;
+        if (stitch) {  // keep the zlib stream as is, join after the loop
+            a_len_zip[i] = pv.idat_len;
+            if (pv.n_idat == 1) {
+                a_buf_zip[i] = (U8 *)pv.idat[0].p_data;
+            } else {  // mem_join() wants the stream in one piece
+                a_zip_copy[i] = (U8 *)malloc(pv.idat_len);
+                a_buf_zip[i] = a_zip_copy[i];
+                U64 off = 0;
+                for (int j = 0; j < pv.n_idat; j++) {
+                    memcpy(a_zip_copy[i] + off, pv.idat[j].p_data,
+                           pv.idat[j].length);
+                    off += pv.idat[j].length;
+                }
+            }
+        } else {
+            a_buf_unzip[i] = (U8 *)malloc(a_len_unzip[i]);
+            // unzip all IDAT.data as one stream straight into its slot
+            ret = png_view_inflate(&pv, &zs_inf, a_buf_unzip[i],
+                                   a_len_unzip[i],
+                                   &len_unzip_idat_data_now_64);
+            if (ret != Z_OK) {
+                printf("unzip %s's IDAT failed \n", file_path);
+                return ret;
+            }
         }
-        cur += len_idat_now;
+        png_view_cleanup(&pv);
 
-        // jump IDAT.crc, calc it later out of loop
-        cur += 4;  // cur at IEND.length
-
-        // according to manual, IEND has an empty data field, it has 12 bytes
-        if (i == 1) {  // copy IEND once
+        if (i == 0) {  // IEND has an empty data field, it has 12 bytes
             ck_iend_all->length = 0;
-            cur += 4;
-            memcpy(ck_iend_all->type, p_buffer + cur, 4);
-            cur += 4;
+            memcpy(ck_iend_all->type, "IEND", 4);
             ck_iend_all->p_data = NULL;
-            ck_iend_all->crc = get_8_to_32(p_buffer + cur);
         }
-        free(p_buffer);
+        if (!stitch && maps != NULL) {  // inflated, mapping not needed
+            fmap_close(&maps[i]);
+        }
+    }
+    if (!stitch) {
+        zs_end(&zs_inf);
     }
     U32 len_unzip_idat_data_all = 0;
-    for (int i = 1; i < argc; i++) {
-        len_unzip_idat_data_all += a_len_unzip[i - 1];
+    U8 *buf_unzip_idat_data_all = NULL;
+    for (int i = 0; !stitch && i < n; i++) {
+        len_unzip_idat_data_all += a_len_unzip[i];
+    }
+    if (!stitch) {
+        buf_unzip_idat_data_all = (U8 *)malloc(len_unzip_idat_data_all);
     }
-    U8 *buf_unzip_idat_data_all = (U8 *)malloc(len_unzip_idat_data_all);
     len_unzip_idat_data_all = 0;
-    for (int i = 1; i < argc; i++) {
+    for (int i = 0; !stitch && i < n; i++) {
         memcpy(buf_unzip_idat_data_all + len_unzip_idat_data_all,
-               a_buf_unzip[i - 1], a_len_unzip[i - 1]);
-        len_unzip_idat_data_all += a_len_unzip[i - 1];
-        free(a_buf_unzip[i - 1]);
+               a_buf_unzip[i], a_len_unzip[i]);
+        len_unzip_idat_data_all += a_len_unzip[i];
+        free(a_buf_unzip[i]);
     }
     // prepare IHDR: ihdr_data_all save to ck_ihdr_all
     if ((ret = data_IHDR_to_chunk(ck_ihdr_all, ihdr_data_all))) {
         return ret;
     }
     // prepare IDAT: zip data
-    U8 *buf_zip_idat_data_all = (U8 *)malloc(len_unzip_idat_data_all);
+    U8 *buf_zip_idat_data_all = NULL;
     U64 len_zip_idat_data_all;
-    U8 gp_buff[len_zip_idat_data_all];
-    if ((ret = mem_def(buf_zip_idat_data_all, &len_zip_idat_data_all,
-                       buf_unzip_idat_data_all, len_unzip_idat_data_all,
-                       Z_BEST_COMPRESSION))) {
+    double times[2];
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    times[0] = (tv.tv_sec) + tv.tv_usec / 1000000.;
+    if (stitch) {  // join the input zlib streams, nothing is re-deflated
+        U64 len_join = 6;
+        for (int i = 0; i < n; i++) {
+            len_join += a_len_zip[i] + 8;
+        }
+        buf_zip_idat_data_all = (U8 *)malloc(len_join);
+        ret = mem_join(buf_zip_idat_data_all, &len_zip_idat_data_all,
+                       a_buf_zip, a_len_zip, n);
+        for (int i = 0; i < n; i++) {
+            if (maps != NULL) {
+                fmap_close(&maps[i]);
+            }
+            free(a_zip_copy[i]);
+        }
+    } else {
+        buf_zip_idat_data_all =
+                (U8 *)malloc(mem_def_mt_bound(len_unzip_idat_data_all));
+        ret = mem_def_mt(buf_zip_idat_data_all, &len_zip_idat_data_all,
+                         buf_unzip_idat_data_all, len_unzip_idat_data_all,
+                         level, n_threads);
+    }
+    if (ret) {
+        zerr(ret);
         return ret;
     }
+    gettimeofday(&tv, NULL);
+    times[1] = (tv.tv_sec) + tv.tv_usec / 1000000.;
+    if (stitch) {
+        printf("catpng stitch time: %lf seconds \n", times[1] - times[0]);
+    } else {
+        printf("catpng deflate time: %lf seconds, %d thread(s), level %d \n",
+               times[1] - times[0], n_threads, level);
+    }
     ck_idat_all->length = (U32)len_zip_idat_data_all;
     ck_idat_all->p_data = buf_zip_idat_data_all;
 
@@ -243,8 +267,87 @@ int main(int argc, char **argv) {
     free(ihdr_data_now);
     free(a_buf_unzip);
     free(a_len_unzip);
+    free(a_buf_zip);
+    free(a_len_zip);
+    free(a_zip_copy);
     free(buf_unzip_idat_data_all);
     free(buf_zip_idat_data_all);
     free(buf_file_all);
     return 0;
 }
+
+// ./catpng [-s] [-t threads] [-l level] a.png b.png ...
+int main(int argc, char **argv) {
+    int n_threads = 1;                   // 1: single threaded mem_def()
+    int level = Z_BEST_COMPRESSION;
+    int stitch = 0;                      // 1: join IDAT streams, no re-deflate
+    int c;
+    while ((c = getopt(argc, argv, "st:l:")) != -1) {
+        switch (c) {
+            case 's':
+                stitch = 1;
+                break;
+            case 't':
+                n_threads = atoi(optarg);
+                if (n_threads <= 0) {
+                    printf("-t needs a positive thread count \n");
+                    return 1;
+                }
+                break;
+            case 'l':
+                level = atoi(optarg);
+                if (level < Z_NO_COMPRESSION || level > Z_BEST_COMPRESSION) {
+                    printf("-l needs a level between 0 and 9 \n");
+                    return 1;
+                }
+                break;
+            default:
+                printf("usage: %s [-s] [-t threads] [-l level] a.png b.png ... \n",
+                       argv[0]);
+                return 1;
+        }
+    }
+    // shift so argv[1..argc-1] are the png files
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc == 1) {
+        printf("No png file, do nothing \n");
+        return 1;
+    }
+    if (argc == 2) {
+        printf("Just one png file, do nothing \n");
+        return 1;
+    }
+
+    int ret = 0;
+
+    // map every input once, check is png, parse from the same mapping
+    FILE_MAP *a_map = (FILE_MAP *)malloc((argc - 1) * sizeof(FILE_MAP));
+    for (int i = 1; i < argc; ++i) {
+        char *file_path = argv[i];
+        printf("%s \n", file_path);
+        if ((ret = fmap_open(&a_map[i - 1], file_path))) {
+            printf("File not found \n");
+            return 1;
+        }
+        // is png
+        int k = is_png(a_map[i - 1].buf, a_map[i - 1].len);
+        if (k == 1) {
+            printf("%s: Not a PNG file \n", argv[i]);
+            return 1;
+        }
+    }
+    U8 **a_buf = (U8 **)malloc((argc - 1) * sizeof(U8 *));
+    size_t *a_len = (size_t *)malloc((argc - 1) * sizeof(size_t));
+    for (int i = 1; i < argc; ++i) {
+        a_buf[i - 1] = a_map[i - 1].buf;
+        a_len[i - 1] = a_map[i - 1].len;
+    }
+    ret = catpng_run(argc - 1, a_buf, a_len, argv + 1, a_map, stitch,
+                     n_threads, level);
+    free(a_buf);
+    free(a_len);
+    free(a_map);
+    return ret;
+}
@@ -2,31 +2,221 @@
  * @file: crc.c
  * @brief: PNG crc calculation
  * Reference: https://www.w3.org/TR/PNG-CRCAppendix.html
+ *
+ * Three engines compute the same CRC:
+ *   - byte:    the reference one-byte-at-a-time table loop
+ *   - slice8:  slicing-by-8, eight table lookups per 8 input bytes
+ *   - pclmul:  carry-less multiply folding (x86 PCLMULQDQ + SSE4.1),
+ *              see Intel "Fast CRC Computation for Generic Polynomials
+ *              Using PCLMULQDQ Instruction" (Gopal et al., 2009)
+ * update_crc() picks the fastest one the running CPU supports.
  */
 
-/* Table of CRCs of all 8-bit messages. */
-unsigned long crc_table[256];
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "crc.h"
 
-/* Flag: has the table been computed? Initially false. */
-int crc_table_computed = 0;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define CRC_HAVE_PCLMUL 1
+#  include <wmmintrin.h> /* _mm_clmulepi64_si128 */
+#  include <smmintrin.h> /* _mm_extract_epi32    */
+#endif
 
-/* Make the table for a fast CRC. */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#  define CRC_LITTLE_ENDIAN 1
+#endif
+
+/* Slicing tables: crc_table_slice[k][n] is the CRC of byte n followed by
+   k zero bytes, crc_table_slice[0] is the classic 256 entry table.
+   Generated at build time by crc_gen.c, read-only so safe to share
+   between threads and forked processes. */
+#include "crc_table.h"
+
+#define CRC_POLY 0xedb88320UL
+
+/* Engine used by update_crc(), picked once before main() runs. */
+static unsigned long (*crc_engine)(unsigned long, const unsigned char *,
+                                   size_t) = update_crc_slice8;
+
+__attribute__((constructor))
+static void crc_select_engine(void)
+{
+#ifdef CRC_HAVE_PCLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+        crc_engine = update_crc_pclmul;
+#endif
+}
+
+/* Kept for old callers: the tables are const and the engine is chosen
+   at load time, so there is nothing left to do here. */
 void make_crc_table(void)
 {
-    unsigned long c;
-    int n, k;
+}
 
-    for (n = 0; n < 256; n++) {
-        c = (unsigned long) n;
-        for (k = 0; k < 8; k++) {
-            if (c & 1)
-                c = 0xedb88320L ^ (c >> 1);
-            else
-                c = c >> 1;
-        }
-        crc_table[n] = c;
+/* Reference engine: one table lookup per byte. */
+unsigned long update_crc_byte(unsigned long crc, const unsigned char *buf,
+                              size_t len)
+{
+    unsigned long c = crc;
+    size_t n;
+
+    for (n = 0; n < len; n++) {
+        c = crc_table_slice[0][(c ^ buf[n]) & 0xff] ^ (c >> 8);
+    }
+    return c;
+}
+
+/* Slicing-by-8 engine: folds 8 bytes per iteration through 8 tables.
+   Falls back to the byte loop on big-endian hosts. */
+unsigned long update_crc_slice8(unsigned long crc, const unsigned char *buf,
+                                size_t len)
+{
+#ifdef CRC_LITTLE_ENDIAN
+    uint32_t c = (uint32_t) crc;
+    uint32_t lo, hi;
+
+    /* align to 4 bytes so the word loads below are cheap */
+    while (len && ((uintptr_t) buf & 3)) {
+        c = crc_table_slice[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        memcpy(&lo, buf, 4);
+        memcpy(&hi, buf + 4, 4);
+        lo ^= c;
+        c = crc_table_slice[7][lo & 0xff] ^
+            crc_table_slice[6][(lo >> 8) & 0xff] ^
+            crc_table_slice[5][(lo >> 16) & 0xff] ^
+            crc_table_slice[4][lo >> 24] ^
+            crc_table_slice[3][hi & 0xff] ^
+            crc_table_slice[2][(hi >> 8) & 0xff] ^
+            crc_table_slice[1][(hi >> 16) & 0xff] ^
+            crc_table_slice[0][hi >> 24];
+        buf += 8;
+        len -= 8;
+    }
+    while (len--) {
+        c = crc_table_slice[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+    }
+    return c;
+#else
+    return update_crc_byte(crc, buf, len);
+#endif
+}
+
+#ifdef CRC_HAVE_PCLMUL
+/* Fold len bytes (len >= 64, len % 16 == 0) into the running crc.
+   Constants are x^(k) mod P(x) in the bit-reflected domain for the
+   PNG/zlib polynomial 0x04c11db7, plus the Barrett constants. */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc_fold_pclmul(uint32_t crc, const unsigned char *buf,
+                                size_t len)
+{
+    static const uint64_t __attribute__((aligned(16)))
+        k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t __attribute__((aligned(16)))
+        k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t __attribute__((aligned(16)))
+        k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t __attribute__((aligned(16)))
+        poly[] = { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+    x0 = _mm_load_si128((const __m128i *) k1k2);
+    buf += 64;
+    len -= 64;
+
+    /* fold 4 x 128 bits in parallel */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the 4 lanes into one */
+    x0 = _mm_load_si128((const __m128i *) k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* remaining 16 byte blocks */
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *) buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
     }
-    crc_table_computed = 1;
+
+    /* 128 -> 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *) k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction 64 -> 32 bits */
+    x0 = _mm_load_si128((const __m128i *) poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (uint32_t) _mm_extract_epi32(x1, 1);
+}
+#endif /* CRC_HAVE_PCLMUL */
+
+/* Carry-less multiply engine. Short buffers and the tail that does not
+   fill a 16 byte block go through slicing-by-8. Only call it when the
+   CPU has PCLMULQDQ and SSE4.1; update_crc() checks that for you. */
+unsigned long update_crc_pclmul(unsigned long crc, const unsigned char *buf,
+                                size_t len)
+{
+#ifdef CRC_HAVE_PCLMUL
+    size_t n;
+
+    if (len >= 64) {
+        n = len & ~(size_t) 15;
+        crc = crc_fold_pclmul((uint32_t) crc, buf, n);
+        buf += n;
+        len -= n;
+    }
+#endif
+    return update_crc_slice8(crc, buf, len);
 }
 
 /* Update a running CRC with the bytes buf[0..len-1]--the CRC
@@ -36,15 +226,9 @@ void make_crc_table(void)
 
 unsigned long update_crc(unsigned long crc, unsigned char *buf, int len)
 {
-    unsigned long c = crc;
-    int n;
-
-    if (!crc_table_computed)
-        make_crc_table();
-    for (n = 0; n < len; n++) {
-        c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
-    }
-    return c;
+    if (len <= 0)
+        return crc;
+    return crc_engine(crc, buf, (size_t) len);
 }
 
 /* Return the CRC of the bytes buf[0..len-1]. */
@@ -52,3 +236,45 @@ unsigned long crc(unsigned char *buf, int len)
 {
     return update_crc(0xffffffffL, buf, len) ^ 0xffffffffL;
 }
+
+/* a(x) * b(x) mod P(x), bit-reflected, a and b reduced */
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = (uint32_t) 1 << 31;
+    uint32_t p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC_POLY : b >> 1;
+    }
+    return p;
+}
+
+/* x^(n * 2^k) mod P(x) */
+static uint32_t x2nmodp(size_t n, unsigned k)
+{
+    uint32_t p = (uint32_t) 1 << 31; /* x^0 == 1 */
+
+    while (n) {
+        if (n & 1)
+            p = multmodp(crc_x2n_table[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+/* Return the CRC of A followed by B given crc1 = crc(A), crc2 = crc(B)
+   and len2 = length of B, without touching the bytes again. Lets
+   workers CRC slices of one chunk independently and merge the results
+   in order. O(log len2). */
+unsigned long crc_combine(unsigned long crc1, unsigned long crc2, size_t len2)
+{
+    return multmodp(x2nmodp(len2, 3), (uint32_t) crc1) ^
+           (uint32_t) crc2;
+}
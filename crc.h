@@ -5,6 +5,17 @@
 
 #pragma once
 
+#include <stddef.h>
+
 void make_crc_table(void);
 unsigned long update_crc(unsigned long crc, unsigned char *buf, int len);
 unsigned long crc(unsigned char *buf, int len);
+unsigned long crc_combine(unsigned long crc1, unsigned long crc2, size_t len2);
+
+/* individual engines behind update_crc(), same contract as update_crc() */
+unsigned long update_crc_byte(unsigned long crc, const unsigned char *buf,
+                              size_t len);
+unsigned long update_crc_slice8(unsigned long crc, const unsigned char *buf,
+                                size_t len);
+unsigned long update_crc_pclmul(unsigned long crc, const unsigned char *buf,
+                                size_t len);
@@ -0,0 +1,83 @@
+/********************************************************************
+ * @file: crc_gen.c
+ * @brief: build time generator for crc_table.h
+ *
+ * Prints the slicing-by-8 tables and the x^(2^n) mod P(x) table used by
+ * crc.c as const arrays, so nothing has to be computed (or raced on)
+ * at run time. Run by the Makefile: ./crc_gen > crc_table.h
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define CRC_POLY 0xedb88320UL /* bit-reflected 0x04c11db7 */
+
+static uint32_t table[8][256];
+static uint32_t x2n_table[32];
+
+/* a(x) * b(x) mod P(x), bit-reflected, a and b reduced */
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = (uint32_t) 1 << 31;
+    uint32_t p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC_POLY : b >> 1;
+    }
+    return p;
+}
+
+static void print_row(const uint32_t *row, int len, const char *indent)
+{
+    int n;
+
+    for (n = 0; n < len; n++) {
+        printf("%s0x%08lx%s", n % 6 == 0 ? indent : "",
+               (unsigned long) row[n],
+               n == len - 1 ? "\n" : (n % 6 == 5 ? ",\n" : ", "));
+    }
+}
+
+int main(void)
+{
+    uint32_t c;
+    int n, k;
+
+    for (n = 0; n < 256; n++) {
+        c = (uint32_t) n;
+        for (k = 0; k < 8; k++)
+            c = c & 1 ? CRC_POLY ^ (c >> 1) : c >> 1;
+        table[0][n] = c;
+    }
+    for (n = 0; n < 256; n++) {
+        c = table[0][n];
+        for (k = 1; k < 8; k++) {
+            c = table[0][c & 0xff] ^ (c >> 8);
+            table[k][n] = c;
+        }
+    }
+    /* x2n_table[n] = x^(2^n) mod P(x) */
+    x2n_table[0] = (uint32_t) 1 << 30; /* x^1 */
+    for (n = 1; n < 32; n++)
+        x2n_table[n] = multmodp(x2n_table[n - 1], x2n_table[n - 1]);
+
+    printf("/* crc_table.h -- generated by crc_gen, do not edit */\n\n");
+    printf("#pragma once\n\n#include <stdint.h>\n\n");
+    printf("static const uint32_t crc_table_slice[8][256] = {\n");
+    for (k = 0; k < 8; k++) {
+        printf("    {\n");
+        print_row(table[k], 256, "        ");
+        printf("    }%s\n", k == 7 ? "" : ",");
+    }
+    printf("};\n\n");
+    printf("static const uint32_t crc_x2n_table[32] = {\n");
+    print_row(x2n_table, 32, "    ");
+    printf("};\n");
+    return 0;
+}
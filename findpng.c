@@ -11,23 +11,63 @@
 #include <stdlib.h> /* for malloc()                */
 //#include "crc.h"      /* for crc()                   */
 #include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/inotify.h>
 #include <string.h> /* for strcat().  man strcat   */
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include "lab_png.h" /* simple PNG data structures  */
+#include "fwalk.h"   /* fwalk_parallel() for -j      */
+#include "png_uring.h" /* batched probing for --uring */
+#include "png_index.h" /* --index cache               */
 
 /******************************************************************************
  * DEFINED MACROS
  *****************************************************************************/
 #define BUF_LEN (256 * 16)
 #define BUF_LEN2 (256 * 32)
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | \
+                    IN_DELETE | IN_CREATE | IN_ONLYDIR)
+#define WATCH_BUF (64 * 1024)
 
 /******************************************************************************
  * GLOBALS
  *****************************************************************************/
 U8 gp_buf_def[BUF_LEN2]; /* output buffer for mem_def() */
 U8 gp_buf_inf[BUF_LEN2]; /* output buffer for mem_inf() */
+int g_verify = 0;        /* --verify: CRC check every chunk, streamed */
+
+/* PNG paths found by the -j workers */
+typedef struct find_result {
+    pthread_mutex_t lock;
+    char **paths;        /* only kept with -s, printed at the end       */
+    int n_paths;
+    int max_paths;
+    int n_found;
+    int sort;
+    int uring;           /* --uring: probe through io_uring batches     */
+    PNG_URING **rings;   /* one per worker thread, freed at the end     */
+    int n_rings;
+    PNG_INDEX *index_old;        /* --index: previous run, may be empty */
+    PNG_INDEX_BUILD *index_new;  /* --index: this run's records         */
+    long n_hits;         /* files answered from index_old               */
+    long n_misses;       /* files that had to be probed                 */
+} FIND_RESULT;
+
+/* --watch: directory path of every inotify watch descriptor */
+typedef struct watch_dirs {
+    char **paths;        /* indexed by wd, NULL when not watched        */
+    int max_paths;
+} WATCH_DIRS;
+
+volatile sig_atomic_t g_stop = 0;      /* --watch: SIGINT/SIGTERM seen */
+
+static __thread PNG_URING *t_ring;      /* this worker's ring           */
+static __thread int t_ring_failed;      /* io_uring unavailable, sync   */
 
 /******************************************************************************
  * FUNCTION PROTOTYPES
@@ -36,6 +76,14 @@ U8 gp_buf_inf[BUF_LEN2]; /* output buffer for mem_inf() */
 void init_data(U8 *buf, int len);
 int ls_ftype(char *argv);
 int ls_fname(char *argv);
+int probe_png(const char *path);
+int probe_png_fd(int fd);
+int probe_png_check(int k, PNG_HEAD *head, int fd);
+int find_png_cb(int dirfd, const char *name, const char *path, void *arg);
+void find_png_dir_end(int dirfd, void *arg);
+int ls_fname_parallel(char *dir, int n_workers, FIND_RESULT *res);
+int watch_add_tree(int ifd, WATCH_DIRS *wd, const char *dir);
+int watch_tree(char *dir, FIND_RESULT *res, const char *index_path);
 
 /******************************************************************************
  * FUNCTIONS
@@ -52,40 +100,464 @@ void init_data(U8 *buf, int len) {
 }
 
 int ls_ftype(char *argv) {
-    char *ptr;
     struct stat buf;
-    // printf(" 333333 %s \n", argv );
     if (lstat(argv, &buf) < 0) {
         perror("lstat error");
         return 0;
     }
 
     if (S_ISREG(buf.st_mode)) {
-        ptr = "regular";
-        // printf(" 333333 %s \n", ptr );
         return 1;
     } else if (S_ISDIR(buf.st_mode)) {
-        ptr = "directory";
-        // printf(" 333333 %s \n", ptr );
         return 2;
-    } else if (S_ISCHR(buf.st_mode))
-        ptr = "character special";
-    else if (S_ISBLK(buf.st_mode))
-        ptr = "block special";
-    else if (S_ISFIFO(buf.st_mode))
-        ptr = "fifo";
-#ifdef S_ISLNK
-    else if (S_ISLNK(buf.st_mode))
-        ptr = "symbolic link";
-#endif
-#ifdef S_ISSOCK
-    else if (S_ISSOCK(buf.st_mode))
-        ptr = "socket";
-#endif
-    else
-        ptr = "**unknown mode**";
-    // printf(" 333333 %s \n", ptr );
-    return 3;
+    }
+    return 3;  // anything else: device, fifo, link, socket
+}
+
+/**
+ * @brief same answer as is_png() without reading the file into memory:
+ *        one pread of signature + IHDR, and with --verify the remaining
+ *        chunks streamed through a small buffer for their CRCs
+ * @param fd open file, left open
+ * @return 0 png, 1 not a png
+ */
+int probe_png_fd(int fd) {
+    PNG_HEAD head;
+    int k = png_probe_fd(fd, &head);
+    return probe_png_check(k, &head, fd);
+}
+
+/**
+ * @brief the rest of probe_png_fd() once the header has been read, shared
+ *        with the io_uring path
+ * @param k png_head_parse() result
+ * @param fd the open file, only read with --verify
+ * @return 0 png, 1 not a png
+ */
+int probe_png_check(int k, PNG_HEAD *head, int fd) {
+    U8 bad_type[4];
+    U32 bad_crc, bad_calc;
+    if (k == PNG_NOT_PNG) {
+        return 1;
+    }
+    if (k == PNG_BAD_CRC) {
+        printf("IHDR chunk CRC error: computed %x, expected %x\n",
+               head->crc_calc, head->crc);
+    } else if (g_verify) {
+        k = png_verify_fd(fd, bad_type, &bad_crc, &bad_calc);
+        if (k == PNG_BAD_CRC) {
+            printf("%.4s chunk CRC error: computed %x, expected %x\n",
+                   (char *)bad_type, bad_calc, bad_crc);
+        } else if (k == PNG_TRUNC) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief probe_png_fd() on a path
+ * @return 0 png, 1 not a png
+ */
+int probe_png(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+    int k = probe_png_fd(fd);
+    close(fd);
+    return k;
+}
+
+/**
+ * @brief print or, with -s, keep one PNG path; called from the workers
+ */
+static void find_png_found(FIND_RESULT *res, const char *path) {
+    pthread_mutex_lock(&res->lock);
+    res->n_found++;
+    if (!res->sort) {
+        printf(" %s \n", path);  // print png path
+    } else {
+        if (res->n_paths == res->max_paths) {
+            int n = res->max_paths ? res->max_paths * 2 : 256;
+            char **q = realloc(res->paths, n * sizeof(char *));
+            if (q != NULL) {
+                res->paths = q;
+                res->max_paths = n;
+            }
+        }
+        if (res->n_paths < res->max_paths) {
+            res->paths[res->n_paths] = strdup(path);
+            if (res->paths[res->n_paths] != NULL) {
+                res->n_paths++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&res->lock);
+}
+
+/**
+ * @brief synchronous probe relative to the directory fd
+ * @return 0 png, 1 not a png
+ */
+static int probe_png_at(int dirfd, const char *name) {
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+        return 1;
+    }
+    int k = probe_png_fd(fd);
+    close(fd);
+    return k;
+}
+
+/**
+ * @brief check the headers an io_uring batch brought back; items the ring
+ *        could not read are probed synchronously instead
+ */
+static void find_png_flush(FIND_RESULT *res, PNG_URING *ur) {
+    int i, n = ur->n_items;
+    int k;
+
+    png_uring_flush(ur);  /* on failure every item keeps len < 0 */
+    for (i = 0; i < n; i++) {
+        PNG_URING_ITEM *it = &ur->items[i];
+        char *path = it->user;
+
+        if (it->len < 0) {
+            k = probe_png_at(it->dirfd, it->name);
+        } else {
+            PNG_HEAD head;
+            k = png_head_parse(&head, it->head, it->len);
+            if (k == PNG_OK && g_verify) {
+                int fd = openat(it->dirfd, it->name, O_RDONLY | O_NOFOLLOW);
+                k = fd < 0 ? 1 : probe_png_check(k, &head, fd);
+                if (fd >= 0) {
+                    close(fd);
+                }
+            } else {
+                k = probe_png_check(k, &head, -1);
+            }
+        }
+        if (k == 0) {
+            find_png_found(res, path);
+        }
+        free(path);
+    }
+}
+
+/**
+ * @brief this thread's ring, set up on first use; NULL once io_uring has
+ *        turned out to be unavailable
+ */
+static PNG_URING *find_png_ring(FIND_RESULT *res) {
+    if (t_ring != NULL || t_ring_failed) {
+        return t_ring;
+    }
+    PNG_URING *ur = malloc(sizeof(PNG_URING));
+    if (ur == NULL || png_uring_init(ur) != 0) {
+        free(ur);
+        t_ring_failed = 1;
+        return NULL;
+    }
+    pthread_mutex_lock(&res->lock);
+    PNG_URING **q = realloc(res->rings, (res->n_rings + 1) * sizeof(*q));
+    if (q != NULL) {
+        res->rings = q;
+        res->rings[res->n_rings++] = ur;
+    }
+    pthread_mutex_unlock(&res->lock);
+    if (q == NULL) {
+        png_uring_cleanup(ur);
+        free(ur);
+        t_ring_failed = 1;
+        return NULL;
+    }
+    t_ring = ur;
+    return ur;
+}
+
+/**
+ * @brief --index: answer from the previous run when the file's inode, size
+ *        and mtime are unchanged, otherwise probe it; either way the result
+ *        goes into the new index. Files with a bad IHDR CRC are not
+ *        recorded, so their error is reported on every run.
+ * @return 0 png, 1 not a png
+ */
+static int probe_png_indexed(FIND_RESULT *res, int dirfd, const char *name,
+                             const char *path) {
+    const PNG_INDEX_REC *old;
+    PNG_INDEX_REC rec;
+    PNG_HEAD head;
+    struct stat st;
+    int fd, kh, k;
+
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+        !S_ISREG(st.st_mode)) {
+        return 1;
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.ino = st.st_ino;
+    rec.size = st.st_size;
+    rec.mtime_ns = st.st_mtim.tv_sec * 1000000000UL + st.st_mtim.tv_nsec;
+
+    old = png_index_find(res->index_old, path);
+    if (old != NULL && old->ino == rec.ino && old->size == rec.size &&
+        old->mtime_ns == rec.mtime_ns &&
+        !(g_verify && (old->flags & PNG_INDEX_IS_PNG))) {
+        __sync_add_and_fetch(&res->n_hits, 1);
+        png_index_put(res->index_new, path, old);
+        return (old->flags & PNG_INDEX_IS_PNG) ? 0 : 1;
+    }
+
+    __sync_add_and_fetch(&res->n_misses, 1);
+    fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+        return 1;
+    }
+    kh = png_probe_fd(fd, &head);
+    k = probe_png_check(kh, &head, fd);
+    close(fd);
+    if (kh == PNG_OK) {
+        rec.flags = PNG_INDEX_IS_PNG;
+        rec.width = head.width;
+        rec.height = head.height;
+    }
+    if (kh != PNG_BAD_CRC) {
+        png_index_put(res->index_new, path, &rec);
+    }
+    return k;
+}
+
+/**
+ * @brief fwalk callback, runs on the -j worker threads: open the file
+ *        relative to its directory fd and probe it, or with --uring queue
+ *        it for the next batch
+ */
+int find_png_cb(int dirfd, const char *name, const char *path, void *arg) {
+    FIND_RESULT *res = arg;
+    PNG_URING *ur = res->uring ? find_png_ring(res) : NULL;
+
+    if (res->index_new != NULL) {
+        if (probe_png_indexed(res, dirfd, name, path) != 0) {
+            return 1;
+        }
+        find_png_found(res, path);
+        return 0;
+    }
+    if (ur != NULL) {
+        char *dup = strdup(path);
+        if (dup != NULL) {
+            if (ur->n_items == PNG_URING_BATCH) {
+                find_png_flush(res, ur);
+            }
+            if (png_uring_add(ur, dirfd, name, dup) != NULL) {
+                return 0;
+            }
+            free(dup);
+        }
+    }
+    if (probe_png_at(dirfd, name) != 0) {
+        return 1;
+    }
+    find_png_found(res, path);
+    return 0;
+}
+
+/**
+ * @brief fwalk directory hook: the queued names are relative to dirfd,
+ *        so the batch has to go before fwalk closes it
+ */
+void find_png_dir_end(int dirfd, void *arg) {
+    if (t_ring != NULL && t_ring->n_items > 0) {
+        find_png_flush(arg, t_ring);
+    }
+}
+
+static int cmp_path(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * @brief -j mode: walk dir with n_workers work-stealing threads. With
+ *        res->sort the PNG paths are printed sorted once the walk is done,
+ *        instead of in the (nondeterministic) order the workers find them.
+ * @return 0 at least one png found, 1 otherwise
+ */
+int ls_fname_parallel(char *dir, int n_workers, FIND_RESULT *res) {
+    int i;
+
+    if (fwalk_parallel(dir, n_workers, find_png_cb, find_png_dir_end,
+                       res) != 0) {
+        return 1;
+    }
+    if (res->sort) {
+        qsort(res->paths, res->n_paths, sizeof(char *), cmp_path);
+        for (i = 0; i < res->n_paths; i++) {
+            printf(" %s \n", res->paths[i]);
+            free(res->paths[i]);
+        }
+        free(res->paths);
+        res->paths = NULL;
+        res->n_paths = 0;
+        res->max_paths = 0;
+    }
+    return res->n_found > 0 ? 0 : 1;
+}
+
+static void watch_stop(int sig) {
+    g_stop = 1;
+}
+
+/**
+ * @brief put an inotify watch on dir and every directory below it
+ * @return 0 on success, 1 if dir itself could not be watched
+ */
+int watch_add_tree(int ifd, WATCH_DIRS *wd, const char *dir) {
+    DIR *p_dir;
+    struct dirent *p_dirent;
+    struct stat st;
+    char path[PATH_MAX];
+
+    int w = inotify_add_watch(ifd, dir, WATCH_MASK);
+    if (w < 0) {
+        perror("inotify_add_watch");
+        return 1;
+    }
+    if (w >= wd->max_paths) {
+        int n = w < 64 ? 128 : w * 2;
+        char **q = realloc(wd->paths, n * sizeof(char *));
+        if (q == NULL) {
+            inotify_rm_watch(ifd, w);
+            return 1;
+        }
+        memset(q + wd->max_paths, 0, (n - wd->max_paths) * sizeof(char *));
+        wd->paths = q;
+        wd->max_paths = n;
+    }
+    free(wd->paths[w]);
+    wd->paths[w] = strdup(dir);
+
+    if ((p_dir = opendir(dir)) == NULL) {
+        return 0;
+    }
+    while ((p_dirent = readdir(p_dir)) != NULL) {
+        if (p_dirent->d_name[0] == '.') {
+            continue;
+        }
+        if (p_dirent->d_type == DT_UNKNOWN) {
+            if (fstatat(dirfd(p_dir), p_dirent->d_name, &st,
+                        AT_SYMLINK_NOFOLLOW) < 0 || !S_ISDIR(st.st_mode)) {
+                continue;
+            }
+        } else if (p_dirent->d_type != DT_DIR) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", dir, p_dirent->d_name) <
+            (int) sizeof(path)) {
+            watch_add_tree(ifd, wd, path);
+        }
+    }
+    closedir(p_dir);
+    return 0;
+}
+
+/**
+ * @brief --watch: after the first scan, keep the tree under inotify and
+ *        probe files as they are written or moved in. New directories are
+ *        watched and scanned, deleted files leave the index. The index is
+ *        rewritten after every batch of events. Runs until SIGINT/SIGTERM.
+ *        (fanotify would need CAP_SYS_ADMIN, inotify does not.)
+ * @return 0 on a clean stop, 1 on error
+ */
+int watch_tree(char *dir, FIND_RESULT *res, const char *index_path) {
+    WATCH_DIRS wd = {NULL, 0};
+    struct sigaction sa;
+    char *buf;
+    char path[PATH_MAX];
+    ssize_t n;
+    int ifd, i, ret = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watch_stop;  /* no SA_RESTART: read() must return */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    buf = malloc(WATCH_BUF);
+    ifd = inotify_init1(IN_CLOEXEC);
+    if (buf == NULL || ifd < 0) {
+        perror("inotify_init1");
+        free(buf);
+        return 1;
+    }
+    if (watch_add_tree(ifd, &wd, dir) != 0) {
+        close(ifd);
+        free(buf);
+        return 1;
+    }
+    fflush(stdout);
+
+    while (!g_stop) {
+        n = read(ifd, buf, WATCH_BUF);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read inotify");
+            ret = 1;
+            break;
+        }
+        for (i = 0; i < n; ) {
+            struct inotify_event *ev = (struct inotify_event *) (buf + i);
+            i += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                /* events were lost, only a full pass is safe */
+                fprintf(stderr, "findpng: inotify overflow, rescanning\n");
+                fwalk_parallel(dir, 1, find_png_cb, find_png_dir_end, res);
+                continue;
+            }
+            if (ev->wd < 0 || ev->wd >= wd.max_paths ||
+                wd.paths[ev->wd] == NULL) {
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {  /* directory went away */
+                free(wd.paths[ev->wd]);
+                wd.paths[ev->wd] = NULL;
+                continue;
+            }
+            if (ev->len == 0 || ev->name[0] == '.' ||
+                snprintf(path, sizeof(path), "%s/%s", wd.paths[ev->wd],
+                         ev->name) >= (int) sizeof(path)) {
+                continue;
+            }
+            if (ev->mask & IN_ISDIR) {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    watch_add_tree(ifd, &wd, path);
+                    fwalk_parallel(path, 1, find_png_cb, find_png_dir_end,
+                                   res);
+                }
+            } else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                find_png_cb(AT_FDCWD, path, path, res);
+                find_png_dir_end(AT_FDCWD, res);
+            } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                if (res->index_new != NULL) {
+                    png_index_del(res->index_new, path);
+                }
+            }
+        }
+        fflush(stdout);
+        if (res->index_new != NULL) {
+            png_index_write(res->index_new, index_path);
+        }
+    }
+
+    close(ifd);
+    for (i = 0; i < wd.max_paths; i++) {
+        free(wd.paths[i]);
+    }
+    free(wd.paths);
+    free(buf);
+    return ret;
 }
 
 int ls_fname(char *argv) {
@@ -104,14 +576,12 @@ int ls_fname(char *argv) {
         } else {
             char *str_path = p_dirent->d_name; /* relative path name! */
             char *abs_path =
-                    (char *)malloc(strlen(absolute_path) + strlen(str_path) + 1);
+                    (char *)malloc(strlen(absolute_path) + strlen(str_path) + 2);
             // abs_path += str_path;
             strcpy(abs_path, absolute_path);
             strcat(abs_path, "/");
             strcat(abs_path, str_path);  // path of sub
             // printf("%s 999999 \n", abs_path);
-            U8 *p_buffer =
-                    NULL; /* a buffer that contains some data to play with */
             last_path = str_path;
             if (str_path[0] == '.') {
                 continue;
@@ -124,30 +594,14 @@ int ls_fname(char *argv) {
                 ls_fname(abs_path);
 
             } else if (ftype == 1) {
-                FILE *f = fopen(abs_path, "rb");
                 // printf("%s 222222 \n", abs_path);
-                if (f == NULL) {
-                    printf("findpng: No PNG file found \n");
-                    continue;
-                }
-                fseek(f, 0, SEEK_END);
-                long fln = ftell(f);  // length
-                p_buffer = (U8 *)malloc(fln + 1);
-                if (p_buffer == NULL) {
-                    perror("malloc");
-                    return errno;
-                }
-                rewind(f);
-                fread(p_buffer, fln, 1, f);
                 // is png
-                int k = is_png(p_buffer, fln);
+                int k = probe_png(abs_path);
                 if (k == 0) {
                     printf(" %s \n", abs_path);  // print png path
                 }/*else{
                     return 1;
                 }*/
-                fclose(f);
-                free(p_buffer);
             }
         }
     }
@@ -164,25 +618,109 @@ int ls_fname(char *argv) {
     return 0;
 }
 
+// ./findpng [--verify] [--uring] [--index FILE [--watch]] [-j N [-s]] DIR
 int main(int argc, char **argv) {
-    if (argc != 2) {
+    static struct option long_opts[] = {{"verify", no_argument, NULL, 'V'},
+                                        {"uring", no_argument, NULL, 'U'},
+                                        {"index", required_argument, NULL, 'I'},
+                                        {"watch", no_argument, NULL, 'W'},
+                                        {NULL, 0, NULL, 0}};
+    int c, i;
+    int n_workers = 0;  /* 0: the original single threaded ls_fname() */
+    int sort = 0;
+    int uring = 0;
+    int watch = 0;
+    char *index_path = NULL;
+    FIND_RESULT res;
+    PNG_INDEX index_old;
+    PNG_INDEX_BUILD index_new;
+    while ((c = getopt_long(argc, argv, "j:s", long_opts, NULL)) != -1) {
+        switch (c) {
+            case 'V':
+                g_verify = 1;
+                break;
+            case 'j':
+                n_workers = atoi(optarg);
+                if (n_workers < 1) {
+                    fprintf(stderr, "findpng: -j needs a positive number\n");
+                    return 1;
+                }
+                break;
+            case 's':
+                sort = 1;
+                break;
+            case 'U':
+                uring = 1;
+                break;
+            case 'I':
+                index_path = optarg;
+                break;
+            case 'W':
+                watch = 1;
+                break;
+            default:
+                return 1;
+        }
+    }
+    if (argc - optind != 1) {
         return 1;
     }
+    if ((uring || index_path || watch) && n_workers == 0) {
+        n_workers = 1;  /* these need the fd-relative walker */
+    }
 
-    char *direct = argv[1];
+    char *direct = argv[optind];
     int k = ls_ftype(direct);
 
     // checkerror?
-    if (k == 2) {
-        int l = ls_fname(direct);
-        if (l == 0) {
+    if (k != 2) {
+        printf( "not a directory \n" );
+        return 1;
+    }
+    if (n_workers == 0) {
+        if (ls_fname(direct) == 0) {
             return 0;
-        } else {
-            printf("findpng: No PNG file found \n");
+        }
+        printf("findpng: No PNG file found \n");
+        return 1;
+    }
+
+    memset(&res, 0, sizeof(res));
+    pthread_mutex_init(&res.lock, NULL);
+    res.sort = sort;
+    res.uring = uring;
+    if (index_path != NULL) {
+        png_index_open(&index_old, index_path);  /* missing: empty index */
+        if (png_index_build_init(&index_new) != 0) {
             return 1;
         }
-    }else{
-        printf( "not a directory \n" );
+        res.index_old = &index_old;
+        res.index_new = &index_new;
+    }
+
+    int l = ls_fname_parallel(direct, n_workers, &res);
+    if (l != 0 && !watch) {
+        printf("findpng: No PNG file found \n");
+    }
+    if (watch) {
+        res.sort = 0;  /* from here on paths are printed as they appear */
+        l = watch_tree(direct, &res, index_path);
+    }
+
+    if (index_path != NULL) {
+        long total = res.n_hits + res.n_misses;
+        fprintf(stderr, "findpng index: %ld of %ld files unchanged "
+                "(%.1f%% hit rate)\n", res.n_hits, total,
+                total ? 100.0 * res.n_hits / total : 0.0);
+        png_index_write(&index_new, index_path);
+        png_index_build_cleanup(&index_new);
+        png_index_close(&index_old);
+    }
+    for (i = 0; i < res.n_rings; i++) {
+        png_uring_cleanup(res.rings[i]);
+        free(res.rings[i]);
     }
-    return 1;
+    free(res.rings);
+    pthread_mutex_destroy(&res.lock);
+    return l;
 }
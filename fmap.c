@@ -0,0 +1,120 @@
+/**
+ * @brief: read-only file ingestion, see fmap.h
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fmap.h"
+
+#define FMAP_READ_INC (64 * 1024) /* growth step when reading a pipe */
+
+/**
+ * @brief: read everything from fd into a malloc'd buffer
+ */
+static int fmap_read_all(FILE_MAP *fm, int fd)
+{
+    size_t max_size = FMAP_READ_INC;
+    U8 *p = malloc(max_size);
+    ssize_t n;
+
+    if (p == NULL) {
+        return ENOMEM;
+    }
+    fm->len = 0;
+    for (;;) {
+        if (fm->len == max_size) {
+            U8 *q = realloc(p, max_size * 2);
+            if (q == NULL) {
+                free(p);
+                return ENOMEM;
+            }
+            p = q;
+            max_size *= 2;
+        }
+        n = read(fd, p + fm->len, max_size - fm->len);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free(p);
+            return errno;
+        }
+        fm->len += n;
+    }
+    fm->buf = p;
+    fm->mapped = 0;
+    return 0;
+}
+
+/**
+ * @brief: make the contents of an open file available in memory.
+ *         fd may be closed by the caller afterwards.
+ * @return 0 on success, an errno value otherwise
+ */
+int fmap_open_fd(FILE_MAP *fm, int fd)
+{
+    struct stat st;
+    void *p;
+
+    fm->buf = NULL;
+    fm->len = 0;
+    fm->mapped = 0;
+    if (fstat(fd, &st) < 0) {
+        return errno;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            /* one front to back pass: read ahead hard, drop behind */
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            madvise(p, st.st_size, MADV_WILLNEED);
+            fm->buf = p;
+            fm->len = st.st_size;
+            fm->mapped = 1;
+            return 0;
+        }
+    }
+    /* pipes, empty files, or mmap refused */
+    return fmap_read_all(fm, fd);
+}
+
+/**
+ * @brief: open path read-only and map it, see fmap_open_fd()
+ * @return 0 on success, an errno value otherwise
+ */
+int fmap_open(FILE_MAP *fm, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    int ret;
+
+    if (fd < 0) {
+        fm->buf = NULL;
+        fm->len = 0;
+        fm->mapped = 0;
+        return errno;
+    }
+    ret = fmap_open_fd(fm, fd);
+    close(fd);
+    return ret;
+}
+
+void fmap_close(FILE_MAP *fm)
+{
+    if (fm->buf == NULL) {
+        return;
+    }
+    if (fm->mapped) {
+        munmap(fm->buf, fm->len);
+    } else {
+        free(fm->buf);
+    }
+    fm->buf = NULL;
+    fm->len = 0;
+}
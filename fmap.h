@@ -0,0 +1,23 @@
+/**
+ * @brief: read-only file ingestion for the PNG tools
+ *
+ * Regular files are mmap'd and parsed in place, so the data stays in the
+ * page cache instead of being copied into a private malloc'd buffer.
+ * Pipes, ttys and anything else mmap cannot handle are read into memory.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+typedef unsigned char U8;
+
+typedef struct file_map {
+    U8 *buf;         /* file contents, read-only                   */
+    size_t len;      /* length of buf in bytes                     */
+    int mapped;      /* 1: buf is an mmap, 0: buf is malloc'd      */
+} FILE_MAP;
+
+int fmap_open(FILE_MAP *fm, const char *path);
+int fmap_open_fd(FILE_MAP *fm, int fd);
+void fmap_close(FILE_MAP *fm);
@@ -0,0 +1,246 @@
+/**
+ * @brief: parallel directory traversal with work stealing, see fwalk.h
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fwalk.h"
+
+#define WALK_DEQUE_INIT 64
+
+/* directories waiting to be read by one worker, [head, head+size) */
+typedef struct walk_deque {
+    pthread_mutex_t lock;
+    char **items;
+    int cap;
+    int head;
+    int size;
+} WALK_DEQUE;
+
+typedef struct walk_ctx {
+    WALK_DEQUE *deques;
+    int n_workers;
+    long pending;        /* directories pushed but not yet finished */
+    fwalk_cb on_file;
+    fwalk_dir_cb on_dir_end;
+    void *arg;
+} WALK_CTX;
+
+typedef struct walk_worker {
+    WALK_CTX *ctx;
+    int id;
+} WALK_WORKER;
+
+static int deque_push_bottom(WALK_DEQUE *q, char *path)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->size == q->cap) {
+        int cap = q->cap ? q->cap * 2 : WALK_DEQUE_INIT;
+        char **items = malloc(cap * sizeof(char *));
+        int i;
+        if (items == NULL) {
+            pthread_mutex_unlock(&q->lock);
+            return 1;
+        }
+        for (i = 0; i < q->size; i++) {
+            items[i] = q->items[(q->head + i) % q->cap];
+        }
+        free(q->items);
+        q->items = items;
+        q->cap = cap;
+        q->head = 0;
+    }
+    q->items[(q->head + q->size) % q->cap] = path;
+    q->size++;
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/* owner end: newest first */
+static char *deque_pop_bottom(WALK_DEQUE *q)
+{
+    char *path = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->size > 0) {
+        q->size--;
+        path = q->items[(q->head + q->size) % q->cap];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return path;
+}
+
+/* thief end: oldest first */
+static char *deque_steal_top(WALK_DEQUE *q)
+{
+    char *path = NULL;
+
+    if (pthread_mutex_trylock(&q->lock) != 0) {
+        return NULL;  /* busy, try another victim */
+    }
+    if (q->size > 0) {
+        path = q->items[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->size--;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return path;
+}
+
+/* read one directory, queue subdirectories, report regular files */
+static void walk_dir(WALK_CTX *ctx, int id, const char *path)
+{
+    char child[PATH_MAX];
+    struct dirent *p_dirent;
+    struct stat st;
+    DIR *p_dir;
+    int fd, type;
+
+    fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return;
+    }
+    p_dir = fdopendir(fd);
+    if (p_dir == NULL) {
+        close(fd);
+        return;
+    }
+    while ((p_dirent = readdir(p_dir)) != NULL) {
+        const char *name = p_dirent->d_name;
+
+        if (name[0] == '.') {  /* ., .. and hidden entries, as findpng */
+            continue;
+        }
+        type = p_dirent->d_type;
+        if (type == DT_UNKNOWN) {
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR
+                                       : (S_ISREG(st.st_mode) ? DT_REG : 0);
+        }
+        if (type != DT_DIR && type != DT_REG) {
+            continue;  /* symlinks, devices, fifos, sockets */
+        }
+        if (snprintf(child, sizeof(child), "%s/%s", path, name) >=
+            (int) sizeof(child)) {
+            continue;
+        }
+        if (type == DT_DIR) {
+            char *dup = strdup(child);
+            if (dup == NULL) {
+                continue;
+            }
+            __sync_add_and_fetch(&ctx->pending, 1);
+            if (deque_push_bottom(&ctx->deques[id], dup) != 0) {
+                __sync_sub_and_fetch(&ctx->pending, 1);
+                free(dup);
+            }
+        } else {
+            ctx->on_file(fd, name, child, ctx->arg);
+        }
+    }
+    if (ctx->on_dir_end != NULL) {
+        ctx->on_dir_end(fd, ctx->arg);
+    }
+    closedir(p_dir);
+}
+
+static void *walk_worker(void *p)
+{
+    WALK_WORKER *w = p;
+    WALK_CTX *ctx = w->ctx;
+    char *path;
+    int k;
+
+    for (;;) {
+        path = deque_pop_bottom(&ctx->deques[w->id]);
+        for (k = 1; path == NULL && k < ctx->n_workers; k++) {
+            path = deque_steal_top(
+                    &ctx->deques[(w->id + k) % ctx->n_workers]);
+        }
+        if (path == NULL) {
+            if (__sync_add_and_fetch(&ctx->pending, 0) == 0) {
+                break;  /* nothing queued and nobody can queue more */
+            }
+            sched_yield();
+            continue;
+        }
+        walk_dir(ctx, w->id, path);
+        free(path);
+        __sync_sub_and_fetch(&ctx->pending, 1);
+    }
+    return NULL;
+}
+
+/**
+ * @brief: visit every regular file below root with n_workers threads
+ * @return 0 on success, 1 if the walk could not be started
+ */
+int fwalk_parallel(const char *root, int n_workers, fwalk_cb on_file,
+                   fwalk_dir_cb on_dir_end, void *arg)
+{
+    WALK_CTX ctx;
+    WALK_WORKER *workers;
+    pthread_t *tids;
+    char *dup;
+    int i, n;
+
+    if (n_workers < 1) {
+        n_workers = 1;
+    }
+    ctx.n_workers = n_workers;
+    ctx.pending = 1;
+    ctx.on_file = on_file;
+    ctx.on_dir_end = on_dir_end;
+    ctx.arg = arg;
+    ctx.deques = calloc(n_workers, sizeof(WALK_DEQUE));
+    workers = calloc(n_workers, sizeof(WALK_WORKER));
+    tids = calloc(n_workers, sizeof(pthread_t));
+    dup = strdup(root);
+    if (ctx.deques == NULL || workers == NULL || tids == NULL ||
+        dup == NULL) {
+        free(ctx.deques);
+        free(workers);
+        free(tids);
+        free(dup);
+        return 1;
+    }
+    for (i = 0; i < n_workers; i++) {
+        pthread_mutex_init(&ctx.deques[i].lock, NULL);
+        workers[i].ctx = &ctx;
+        workers[i].id = i;
+    }
+    deque_push_bottom(&ctx.deques[0], dup);
+
+    /* a single worker runs on the calling thread */
+    for (n = 0; n_workers > 1 && n < n_workers; n++) {
+        if (pthread_create(&tids[n], NULL, walk_worker, &workers[n]) != 0) {
+            break;
+        }
+    }
+    if (n == 0) {
+        walk_worker(&workers[0]);
+    }
+    for (i = 0; i < n; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (i = 0; i < n_workers; i++) {
+        pthread_mutex_destroy(&ctx.deques[i].lock);
+        free(ctx.deques[i].items);
+    }
+    free(ctx.deques);
+    free(workers);
+    free(tids);
+    return 0;
+}
@@ -0,0 +1,30 @@
+/**
+ * @brief: parallel directory traversal with work stealing
+ *
+ * Every worker owns a deque of directories still to be read. A worker
+ * pushes the subdirectories it finds onto the bottom of its own deque and
+ * pops from the bottom (depth first, warm dentry cache); an idle worker
+ * steals from the top of another worker's deque (the oldest, usually
+ * largest subtree). Entries are classified from d_type, falling back to
+ * fstatat() only when the file system reports DT_UNKNOWN, and files are
+ * handed to the callback relative to an open directory fd so it can use
+ * openat()/fstatat() without re-resolving the full path.
+ */
+
+#pragma once
+
+/* called for every regular file, possibly from several threads at once
+   @param dirfd open directory containing the file
+   @param name  file name relative to dirfd
+   @param path  full path, for printing
+   @param arg   user data given to fwalk_parallel() */
+typedef int (*fwalk_cb)(int dirfd, const char *name, const char *path,
+                        void *arg);
+
+/* optional, called on the same thread once every entry of a directory
+   has been passed to fwalk_cb and before dirfd is closed, so a callback
+   that queues work against dirfd can flush it */
+typedef void (*fwalk_dir_cb)(int dirfd, void *arg);
+
+int fwalk_parallel(const char *root, int n_workers, fwalk_cb on_file,
+                   fwalk_dir_cb on_dir_end, void *arg);
@@ -10,9 +10,11 @@
 /******************************************************************************
  * INCLUDE HEADER FILES
  *****************************************************************************/
+#include <arpa/inet.h> /* for ntohl(), htonl() */
 #include <stdio.h>
 #include <string.h>
 #include "crc.h" /* for crc()                   */
+#include "png_chunk.h" /* chunk iterator          */
 /******************************************************************************
  * DEFINED MACROS
  *****************************************************************************/
@@ -71,49 +73,33 @@ int chunk_to_buffer(struct chunk *st_chunk, U8 *buf_result, U32 *len_result,
                     int calc_crc);
 /* declare your own functions prototypes here */
 int is_png(U8 *buf, size_t n) {
-    if (n == 0) {
+    // 1: not a png; 0: png (CRC errors are reported but still a png)
+    CHUNK_ITER it;
+    CHUNK_VIEW ck;
+    int ret;
+    int n_chunks = 0;
+
+    if (chunk_iter_init(&it, buf, n) != PNG_OK) {
         return 1;
     }
-
-    U8 png_header[8] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
-
-    for (int i = 0; i < 8; i++) {
-        if (buf[i] != png_header[i]) {
+    // walk every chunk, any number of IDATs and ancillary chunks
+    while ((ret = chunk_iter_next(&it, &ck)) == PNG_OK) {
+        if (n_chunks++ == 0 && !chunk_is(&ck, "IHDR")) {
             return 1;
         }
+        U32 cal_crc = chunk_calc_crc(&ck);
+        if (cal_crc != ck.crc) {
+            printf("%.4s chunk CRC error: computed %x, expected %x\n",
+                   (const char *)ck.type, cal_crc, ck.crc);
+            return 0;
+        }
+        if (chunk_is(&ck, "IEND")) {
+            break;
+        }
     }
-    // struct simple_PNG myPng;
-    // IHDR
-    U8 *start_p = buf + 12;
-    U32 ihdr_cal_crc = crc(start_p, 17);  // type4+data13
-    U32 ihdr_exp_crc = get_8_to_32(buf + 12 + 17);
-    if (ihdr_cal_crc != ihdr_exp_crc) {
-        printf("IHDR chunk CRC error: computed %x, expected %x\n", ihdr_cal_crc,
-               ihdr_exp_crc);
-        return 0;
-    }
-
-    // IDAT
-    U8 *start_idat_p = buf + 37;
-    U32 idat_cal_crc = crc(start_idat_p, 4 + get_8_to_32(buf + 33));
-    // printf("IEND chunk CRC error: computed %d \n", get_8_to_32(buf+33) );
-    U32 idat_exp_crc = get_8_to_32(start_idat_p + 4 + get_8_to_32(buf + 33));
-    if (idat_cal_crc != idat_exp_crc) {
-        printf("IDAT chunk CRC error: computed %x, expected %x\n", idat_cal_crc,
-               idat_exp_crc);
-        return 0;
-    }
-
-    // IEND
-    U8 *start_iend_p = buf + 37 + 4 + get_8_to_32(buf + 33) + 8;
-    U32 iend_cal_crc = crc(start_iend_p, 4);
-    U32 iend_exp_crc = get_8_to_32(start_iend_p + 4);
-    if (iend_cal_crc != iend_exp_crc) {
-        printf("IEND chunk CRC error: computed %x, expected %x\n", iend_cal_crc,
-               iend_exp_crc);
-        return 0;
+    if (ret == PNG_TRUNC || n_chunks == 0) {
+        return 1;
     }
-
     return 0;
 }
 
@@ -0,0 +1,183 @@
+/**
+ * @brief: pages/s of findpng3 link extraction over saved HTML pages
+ *
+ * Compares the DOM path find_http() used before (htmlReadMemory, an
+ * XPath context per page for //a/@href, xmlBuildURI per link and
+ * xmlCleanupParser per page) with the streaming link scanner, fed in
+ * CURL_MAX_WRITE_SIZE pieces the way write_cb_curl3() sees a page.
+ * Pages are read into memory first, so only parsing is timed.
+ *
+ * ./link_bench [-r rounds] [-b base URL] file.html ...
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <curl/curl.h>
+#include <libxml2/libxml/HTMLparser.h>
+#include <libxml2/libxml/uri.h>
+#include <libxml2/libxml/xpath.h>
+#include "fmap.h"
+#include "link_scan.h"
+
+#define BASE_URL "http://ece252-1.uwaterloo.ca/~yqhuang/lab4/"
+
+typedef struct page {
+    FILE_MAP fm;
+    char *url;
+} PAGE;
+
+typedef struct scan_state {
+    const char *base;
+    char *abs;
+    size_t abs_cap;
+    long links;
+} SCAN_STATE;
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+/* the old find_http(), minus the URL set */
+static long dom_links(const PAGE *pg)
+{
+    int opts = HTML_PARSE_NOBLANKS | HTML_PARSE_NOERROR |
+               HTML_PARSE_NOWARNING | HTML_PARSE_NONET;
+    htmlDocPtr doc = htmlReadMemory((const char *) pg->fm.buf, pg->fm.len,
+                                    pg->url, NULL, opts);
+    xmlXPathContextPtr ctx;
+    xmlXPathObjectPtr result;
+    long n = 0;
+    int i;
+
+    if (doc == NULL) {
+        return 0;
+    }
+    ctx = xmlXPathNewContext(doc);
+    result = xmlXPathEvalExpression((xmlChar *) "//a/@href", ctx);
+    xmlXPathFreeContext(ctx);
+    if (result != NULL && !xmlXPathNodeSetIsEmpty(result->nodesetval)) {
+        xmlNodeSetPtr nodeset = result->nodesetval;
+        for (i = 0; i < nodeset->nodeNr; i++) {
+            xmlChar *href = xmlNodeListGetString(
+                doc, nodeset->nodeTab[i]->xmlChildrenNode, 1);
+            xmlChar *abs = xmlBuildURI(href, (xmlChar *) pg->url);
+            n += abs != NULL;
+            xmlFree(href);
+            xmlFree(abs);
+        }
+    }
+    xmlXPathFreeObject(result);
+    xmlFreeDoc(doc);
+    xmlCleanupParser();
+    return n;
+}
+
+static void count_link(void *arg, const char *href, size_t len)
+{
+    SCAN_STATE *st = arg;
+
+    st->links += link_resolve(st->base, href, len, &st->abs,
+                              &st->abs_cap) != NULL;
+}
+
+static long scan_links(LINK_SCAN *ls, SCAN_STATE *st, const PAGE *pg)
+{
+    size_t off, len;
+
+    st->base = pg->url;
+    st->links = 0;
+    link_scan_reset(ls);
+    for (off = 0; off < pg->fm.len; off += len) {
+        len = pg->fm.len - off;
+        if (len > CURL_MAX_WRITE_SIZE) {
+            len = CURL_MAX_WRITE_SIZE;
+        }
+        link_scan_feed(ls, (const char *) pg->fm.buf + off, len);
+    }
+    return st->links;
+}
+
+int main(int argc, char **argv)
+{
+    const char *base = BASE_URL;
+    int rounds = 5;
+    PAGE *pages;
+    LINK_SCAN ls;
+    SCAN_STATE st = {0};
+    double t_dom, t_scan, mib = 0;
+    long dom_n = 0, scan_n = 0;
+    int c, i, r, n;
+
+    while ((c = getopt(argc, argv, "r:b:")) != -1) {
+        switch (c) {
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'b':
+            base = optarg;
+            break;
+        default:
+            printf("usage: %s [-r rounds] [-b base URL] file.html ...\n",
+                   argv[0]);
+            return 1;
+        }
+    }
+    n = argc - optind;
+    if (n <= 0 || rounds <= 0) {
+        printf("usage: %s [-r rounds] [-b base URL] file.html ...\n",
+               argv[0]);
+        return 1;
+    }
+    pages = calloc(n, sizeof(PAGE));
+    for (i = 0; i < n; i++) {
+        const char *name = strrchr(argv[optind + i], '/');
+        name = name ? name + 1 : argv[optind + i];
+        if (fmap_open(&pages[i].fm, argv[optind + i]) != 0) {
+            perror(argv[optind + i]);
+            return 1;
+        }
+        pages[i].url = malloc(strlen(base) + strlen(name) + 1);
+        sprintf(pages[i].url, "%s%s", base, name);
+        mib += pages[i].fm.len / (1024. * 1024.);
+    }
+
+    t_dom = now();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < n; i++) {
+            dom_n += dom_links(&pages[i]);
+        }
+    }
+    t_dom = now() - t_dom;
+
+    link_scan_init(&ls, count_link, &st);
+    t_scan = now();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < n; i++) {
+            scan_n += scan_links(&ls, &st, &pages[i]);
+        }
+    }
+    t_scan = now() - t_scan;
+
+    printf("%d pages, %.1f MiB, %d rounds\n", n, mib, rounds);
+    printf("%-6s %10s %12s %10s\n", "", "links", "pages/s", "MiB/s");
+    printf("%-6s %10ld %12.0f %10.1f\n", "dom", dom_n / rounds,
+           n * rounds / t_dom, mib * rounds / t_dom);
+    printf("%-6s %10ld %12.0f %10.1f\n", "stream", scan_n / rounds,
+           n * rounds / t_scan, mib * rounds / t_scan);
+    printf("speedup %.1fx\n", t_dom / t_scan);
+
+    link_scan_cleanup(&ls);
+    free(st.abs);
+    for (i = 0; i < n; i++) {
+        fmap_close(&pages[i].fm);
+        free(pages[i].url);
+    }
+    free(pages);
+    return 0;
+}
@@ -0,0 +1,486 @@
+/**
+ * @brief: streaming link extraction, see link_scan.h
+ *
+ * Reference: https://html.spec.whatwg.org/multipage/parsing.html#tokenization
+ *            https://www.rfc-editor.org/rfc/rfc3986#section-5.2
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "link_scan.h"
+
+#define LINK_TAG_MAX (64 * 1024)  /* longer <a> tags are not followed */
+
+enum {
+    S_TEXT,          /* between tags                                    */
+    S_OPEN,          /* after '<', reading the tag name                 */
+    S_SKIP,          /* inside a tag we do not care about               */
+    S_ATTR,          /* inside an <a> tag, buffering its attributes     */
+    S_BANG,          /* after "<!"                                      */
+    S_COMMENT,       /* inside <!-- -->                                 */
+    S_RAW            /* inside <script> or <style>, looking for the end */
+};
+
+static int is_space(int c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+/* put code point cp at p as UTF-8, return the byte count */
+static int put_utf8(char *p, unsigned long cp)
+{
+    if (cp < 0x80) {
+        p[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        p[0] = 0xc0 | cp >> 6;
+        p[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        p[0] = 0xe0 | cp >> 12;
+        p[1] = 0x80 | (cp >> 6 & 0x3f);
+        p[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    p[0] = 0xf0 | cp >> 18;
+    p[1] = 0x80 | (cp >> 12 & 0x3f);
+    p[2] = 0x80 | (cp >> 6 & 0x3f);
+    p[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+/**
+ * @brief: decode character references in v[0..len) in place; the result
+ *         is never longer than the input
+ * @return decoded length
+ */
+static size_t decode_refs(char *v, size_t len)
+{
+    static const struct {
+        const char *name;
+        char c;
+    } named[] = {{"amp", '&'}, {"lt", '<'}, {"gt", '>'}, {"quot", '"'},
+                 {"apos", '\''}};
+    size_t i = 0, o = 0;
+
+    while (i < len) {
+        size_t j = i + 1, k;
+        unsigned long cp = 0;
+        int digits = 0;
+
+        if (v[i] != '&') {
+            v[o++] = v[i++];
+            continue;
+        }
+        if (j < len && v[j] == '#') {
+            int hex = ++j < len && (v[j] == 'x' || v[j] == 'X');
+            for (j += hex; j < len && cp <= 0x10ffff; j++, digits++) {
+                int c = tolower((unsigned char) v[j]);
+                if (isdigit(c)) {
+                    cp = cp * (hex ? 16 : 10) + c - '0';
+                } else if (hex && c >= 'a' && c <= 'f') {
+                    cp = cp * 16 + c - 'a' + 10;
+                } else {
+                    break;
+                }
+            }
+            if (digits > 0 && cp > 0 && cp <= 0x10ffff) {
+                o += put_utf8(v + o, cp);
+                i = j + (j < len && v[j] == ';');
+                continue;
+            }
+        } else {
+            for (k = 0; k < sizeof(named) / sizeof(named[0]); k++) {
+                size_t n = strlen(named[k].name);
+                if (len - j >= n && memcmp(v + j, named[k].name, n) == 0) {
+                    v[o++] = named[k].c;
+                    i = j + n + (j + n < len && v[j + n] == ';');
+                    break;
+                }
+            }
+            if (k < sizeof(named) / sizeof(named[0])) {
+                continue;
+            }
+        }
+        v[o++] = v[i++];   /* not a reference we know, keep the '&' */
+    }
+    return o;
+}
+
+/* find href among the buffered attributes of an <a> tag */
+static void parse_a(LINK_SCAN *ls)
+{
+    char *p = ls->tag, *end = ls->tag + ls->tag_len;
+
+    while (p < end) {
+        char *name, *v;
+        size_t name_len, v_len;
+
+        while (p < end && (is_space(*p) || *p == '/')) {
+            p++;
+        }
+        for (name = p; p < end && !is_space(*p) && *p != '=' && *p != '/';
+             p++) {
+        }
+        name_len = p - name;
+        while (p < end && is_space(*p)) {
+            p++;
+        }
+        v = p;
+        v_len = 0;
+        if (p < end && *p == '=') {
+            for (p++; p < end && is_space(*p); p++) {
+            }
+            if (p < end && (*p == '"' || *p == '\'')) {
+                char q = *p++;
+                for (v = p; p < end && *p != q; p++) {
+                }
+                v_len = p - v;
+                p += p < end;
+            } else {
+                for (v = p; p < end && !is_space(*p); p++) {
+                }
+                v_len = p - v;
+            }
+        }
+        if (name_len == 4 && strncasecmp(name, "href", 4) == 0) {
+            v_len = decode_refs(v, v_len);
+            while (v_len > 0 && is_space(*v)) {
+                v++;
+                v_len--;
+            }
+            while (v_len > 0 && is_space(v[v_len - 1])) {
+                v_len--;
+            }
+            ls->cb(ls->arg, v, v_len);
+            return;   /* the first href wins, as in a browser */
+        }
+        if (name_len == 0 && v_len == 0 && p < end) {
+            p++;      /* stray '=', step over it */
+        }
+    }
+}
+
+/* state after the '>' of a start tag */
+static int after_tag(LINK_SCAN *ls)
+{
+    if (ls->raw_end != NULL) {
+        ls->raw_len = 0;
+        return S_RAW;
+    }
+    return S_TEXT;
+}
+
+void link_scan_init(LINK_SCAN *ls, LINK_CB cb, void *arg)
+{
+    memset(ls, 0, sizeof(*ls));
+    ls->cb = cb;
+    ls->arg = arg;
+}
+
+/**
+ * @brief: get ready for a new page, keeps the tag buffer
+ */
+void link_scan_reset(LINK_SCAN *ls)
+{
+    ls->state = S_TEXT;
+    ls->quote = 0;
+    ls->name_len = 0;
+    ls->dashes = 0;
+    ls->raw_end = NULL;
+    ls->raw_len = 0;
+    ls->tag_len = 0;
+}
+
+void link_scan_cleanup(LINK_SCAN *ls)
+{
+    free(ls->tag);
+    ls->tag = NULL;
+    ls->tag_cap = 0;
+    ls->tag_len = 0;
+}
+
+/**
+ * @brief: scan the next len bytes of a page, calling ls->cb for every
+ *         complete <a href> in them
+ * @return 0, 1 if out of memory (the tag is dropped, scanning goes on)
+ */
+int link_scan_feed(LINK_SCAN *ls, const char *buf, size_t len)
+{
+    const char *end = buf + len;
+    int ret = 0;
+
+    for (; buf < end; buf++) {
+        int c = (unsigned char) *buf;
+
+        switch (ls->state) {
+        case S_TEXT: {
+            const char *lt = memchr(buf, '<', end - buf);
+            if (lt == NULL) {
+                return ret;
+            }
+            buf = lt;
+            ls->state = S_OPEN;
+            ls->name_len = 0;
+            break;
+        }
+        case S_OPEN:
+            if (ls->name_len == 0) {
+                if (c == '!') {
+                    ls->state = S_BANG;
+                    ls->dashes = 0;
+                } else if (c == '/' || c == '?') {
+                    ls->state = S_SKIP;   /* end tag or processing inst. */
+                    ls->quote = 0;
+                } else if (isalpha(c)) {
+                    ls->name[ls->name_len++] = tolower(c);
+                } else if (c != '<') {
+                    ls->state = S_TEXT;   /* a literal '<' */
+                }
+                break;
+            }
+            if (isalnum(c)) {
+                if (ls->name_len < (int) sizeof(ls->name)) {
+                    ls->name[ls->name_len] = tolower(c);
+                }
+                ls->name_len++;
+                break;
+            }
+            ls->quote = 0;
+            ls->raw_end = NULL;
+            if (ls->name_len == 1 && ls->name[0] == 'a') {
+                ls->tag_len = 0;
+                ls->state = S_ATTR;
+                if (c == '>') {
+                    parse_a(ls);
+                    ls->state = S_TEXT;
+                }
+                break;
+            }
+            if (ls->name_len == 6 && memcmp(ls->name, "script", 6) == 0) {
+                ls->raw_end = "</script";
+            } else if (ls->name_len == 5 && memcmp(ls->name, "style", 5) == 0) {
+                ls->raw_end = "</style";
+            }
+            ls->state = c == '>' ? after_tag(ls) : S_SKIP;
+            break;
+        case S_SKIP:
+        case S_ATTR:
+            if (ls->quote != 0) {
+                if (c == ls->quote) {
+                    ls->quote = 0;
+                }
+            } else if (c == '"' || c == '\'') {
+                ls->quote = c;
+            } else if (c == '>') {
+                if (ls->state == S_ATTR) {
+                    if (ls->tag_len <= LINK_TAG_MAX) {
+                        parse_a(ls);
+                    }
+                    ls->state = S_TEXT;
+                } else {
+                    ls->state = after_tag(ls);
+                }
+                break;
+            }
+            if (ls->state == S_ATTR && ls->tag_len <= LINK_TAG_MAX) {
+                if (ls->tag_len == ls->tag_cap) {
+                    size_t cap = ls->tag_cap ? ls->tag_cap * 2 : 256;
+                    char *t = realloc(ls->tag, cap);
+                    if (t == NULL) {
+                        ls->tag_len = LINK_TAG_MAX + 1;   /* drop the tag */
+                        ret = 1;
+                        break;
+                    }
+                    ls->tag = t;
+                    ls->tag_cap = cap;
+                }
+                ls->tag[ls->tag_len++] = c;
+            }
+            break;
+        case S_BANG:
+            if (c == '-' && ++ls->dashes == 2) {
+                ls->state = S_COMMENT;
+                ls->dashes = 0;
+            } else if (c == '>') {
+                ls->state = S_TEXT;
+            } else if (c != '-') {
+                ls->state = S_SKIP;   /* <!DOCTYPE ...> and the like */
+                ls->quote = 0;
+                ls->raw_end = NULL;
+            }
+            break;
+        case S_COMMENT:
+            if (c == '-') {
+                ls->dashes++;
+            } else if (c == '>' && ls->dashes >= 2) {
+                ls->state = S_TEXT;
+            } else {
+                ls->dashes = 0;
+            }
+            break;
+        case S_RAW:
+            if (tolower(c) == ls->raw_end[ls->raw_len]) {
+                if (ls->raw_end[++ls->raw_len] == 0) {
+                    ls->raw_end = NULL;
+                    ls->quote = 0;
+                    ls->state = S_SKIP;   /* on to the '>' */
+                }
+            } else {
+                ls->raw_len = c == '<';
+            }
+            break;
+        }
+    }
+    return ret;
+}
+
+/* length of the scheme of an absolute URL, 0 if s[0..len) has none */
+static size_t scheme_len(const char *s, size_t len)
+{
+    size_t i;
+
+    if (len == 0 || !isalpha((unsigned char) s[0])) {
+        return 0;
+    }
+    for (i = 1; i < len; i++) {
+        if (s[i] == ':') {
+            return i;
+        }
+        if (!isalnum((unsigned char) s[i]) && s[i] != '+' && s[i] != '-' &&
+            s[i] != '.') {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief: remove "." and ".." segments from the absolute path p[0..n)
+ * @return the new length, never more than n
+ */
+static size_t remove_dots(char *p, size_t n)
+{
+    size_t i = 0, o = 0;
+
+    while (i < n) {
+        size_t s = i + 1, e = s;
+
+        while (e < n && p[e] != '/') {
+            e++;
+        }
+        if (e - s == 1 && p[s] == '.') {
+            if (e == n) {
+                p[o++] = '/';
+            }
+        } else if (e - s == 2 && p[s] == '.' && p[s + 1] == '.') {
+            while (o > 0 && p[o - 1] != '/') {
+                o--;
+            }
+            if (o > 0) {
+                o--;
+            }
+            if (e == n) {
+                p[o++] = '/';
+            }
+        } else {
+            memmove(p + o, p + i, e - i);
+            o += e - i;
+        }
+        i = e;
+    }
+    return o;
+}
+
+/**
+ * @brief: resolve ref[0..ref_len) against the absolute URL base
+ * @param: out char** in/out, buffer reused between calls, realloc'd
+ * @param: cap size_t* in/out, size of *out
+ * @return *out holding the absolute URL, NULL if base is not absolute or
+ *         out of memory
+ */
+const char *link_resolve(const char *base, const char *ref, size_t ref_len,
+                         char **out, size_t *cap)
+{
+    size_t need = strlen(base) + ref_len + 2;
+    size_t s = scheme_len(base, strlen(base));
+    const char *b_auth, *b_path, *b_query, *b_frag;
+    char *o, *path = NULL;
+
+    if (s == 0) {
+        return NULL;
+    }
+    if (*cap < need) {
+        char *p = realloc(*out, need);
+        if (p == NULL) {
+            return NULL;
+        }
+        *out = p;
+        *cap = need;
+    }
+    o = *out;
+    if (scheme_len(ref, ref_len) != 0) {
+        memcpy(o, ref, ref_len);
+        o[ref_len] = 0;
+        return *out;
+    }
+
+    b_auth = base + s + 1;
+    b_path = b_auth;
+    if (b_auth[0] == '/' && b_auth[1] == '/') {
+        b_path = b_auth + 2 + strcspn(b_auth + 2, "/?#");
+    }
+    b_query = b_path + strcspn(b_path, "?#");
+    b_frag = b_query + strcspn(b_query, "#");
+
+    if (ref_len >= 2 && ref[0] == '/' && ref[1] == '/') {
+        size_t k = 2;
+
+        while (k < ref_len && ref[k] != '/' && ref[k] != '?' &&
+               ref[k] != '#') {
+            k++;
+        }
+        memcpy(o, base, s + 1);
+        o += s + 1;
+        path = o + k;    /* path of ref, once copied */
+    } else if (ref_len == 0 || ref[0] == '#') {
+        memcpy(o, base, b_frag - base);
+        o += b_frag - base;
+    } else if (ref[0] == '?') {
+        memcpy(o, base, b_query - base);
+        o += b_query - base;
+    } else if (ref[0] == '/') {
+        memcpy(o, base, b_path - base);
+        o += b_path - base;
+        path = o;
+    } else {
+        const char *dir = b_query;
+
+        memcpy(o, base, b_path - base);
+        o += b_path - base;
+        path = o;
+        if (b_path == b_query && b_path != b_auth) {
+            *o++ = '/';    /* authority and an empty path */
+        } else {
+            while (dir > b_path && dir[-1] != '/') {
+                dir--;
+            }
+            memcpy(o, b_path, dir - b_path);
+            o += dir - b_path;
+        }
+    }
+    memcpy(o, ref, ref_len);
+    o += ref_len;
+    *o = 0;
+
+    if (path != NULL && *path == '/') {
+        size_t n = strcspn(path, "?#");
+        size_t m = remove_dots(path, n);
+        memmove(path + m, path + n, o - (path + n) + 1);
+    }
+    return *out;
+}
@@ -0,0 +1,44 @@
+/**
+ * @brief: streaming <a href> extraction for the findpng3 crawler
+ *
+ * A byte-at-a-time tag scanner that is fed a page in whatever pieces
+ * libcurl delivers it and calls back with every href as soon as the
+ * closing '>' of its <a> tag has arrived, so links are found while the
+ * body is still downloading. It builds no tree. Comments, <script> and
+ * <style> bodies are skipped, attribute values may be quoted or not, and
+ * the common character references (&amp; &lt; &gt; &quot; &apos; &#N;
+ * &#xN;) are decoded. The only memory is one tag buffer per scanner,
+ * kept between pages.
+ *
+ * link_resolve() turns an href into an absolute URL against the page URL
+ * (RFC 3986 section 5.2), again into a buffer that is reused.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/* called with the decoded, whitespace trimmed href, not 0 terminated */
+typedef void (*LINK_CB)(void *arg, const char *href, size_t len);
+
+typedef struct link_scan {
+    int state;
+    char quote;          /* open quote inside a tag, 0 if none          */
+    char name[8];        /* tag name so far, lower case                 */
+    int name_len;
+    int dashes;          /* trailing '-' seen in a comment              */
+    const char *raw_end; /* "</script" or "</style" while in one        */
+    int raw_len;         /* bytes of raw_end matched                    */
+    char *tag;           /* attributes of the current <a> tag           */
+    size_t tag_len;
+    size_t tag_cap;
+    LINK_CB cb;
+    void *arg;
+} LINK_SCAN;
+
+void link_scan_init(LINK_SCAN *ls, LINK_CB cb, void *arg);
+void link_scan_reset(LINK_SCAN *ls);
+int link_scan_feed(LINK_SCAN *ls, const char *buf, size_t len);
+void link_scan_cleanup(LINK_SCAN *ls);
+const char *link_resolve(const char *base, const char *ref, size_t ref_len,
+                         char **out, size_t *cap);
@@ -10,6 +10,7 @@
    Update: Fixed! The check for !numfds was the problem.
 */
 
+#define _GNU_SOURCE   /* memmem */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,13 +18,17 @@
 #include <unistd.h>
 #endif
 #include <curl/multi.h>
-#include <libxml2/libxml/HTMLparser.h>
-#include <libxml2/libxml/parser.h>
-#include <libxml2/libxml/uri.h>
-#include <libxml2/libxml/xpath.h>
-#include <search.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include "lab_png.h"
+#include "link_scan.h"
+#include "mpmc_ring.h"
+#include "url_set.h"
 
 #define MAX_WAIT_MSECS 30*1000 /* Wait max. 30 seconds */
 
@@ -34,40 +39,92 @@
 #define ECE252_HEADER "X-Ece252-Fragment: "
 #define CT_PNG "image/png"
 #define CT_HTML "text/html"
+#define URL_EXPECT 10000000   /* URLs the Bloom filter is sized for with -b */
+#define NET_EVENTS 64         /* epoll events per wait */
+#define POLL_MS 1000          /* longest curl_multi_poll() sleep */
 #define max(a, b) \
    ({ __typeof__ (a) _a = (a); \
        __typeof__ (b) _b = (b); \
      _a > _b ? _a : _b; })
 
+/* HTML bytes on their way from a network thread to a parse thread */
+typedef struct page_chunk {
+    struct page_chunk *next;
+    size_t len;
+    char data[CURL_MAX_WRITE_SIZE];
+} PAGE_CHUNK;
+
 typedef struct recv_buf2 {
     char *buf;       /* memory to hold a copy of received data */
     size_t size;     /* size of valid data in buf in bytes*/
     size_t max_size; /* max capacity of buf in bytes*/
     int seq;         /* >=0 sequence number extracted from http header */
     /* <0 indicates an invalid seq number */
+    CURL *curl;      /* the transfer filling this buffer */
+    long status;     /* HTTP status of the current response */
+    int html;        /* 1: 2xx text/html, body goes to scan, not buf */
+    LINK_SCAN scan;  /* <a href> scanner, kept across pages */
+    char *abs;       /* last resolved link, reused */
+    size_t abs_cap;
+    char *base;      /* page URL, links resolve against it, reused */
+    size_t base_cap;
+    int png;         /* 1: 2xx image/png, is_png() still to run */
+    pthread_mutex_t lock;    /* -n: guards head, tail, queued, done */
+    PAGE_CHUNK *head;        /* -n: HTML not scanned yet */
+    PAGE_CHUNK *tail;
+    int queued;      /* -n: on the parse queue or being parsed */
+    int done;        /* -n: the transfer is over */
+    struct recv_buf2 *next;  /* free list / active transfer list link */
 } RECV_BUF;
 
+/* one network thread: its own multi handle driven from its own epoll */
+typedef struct net_thread {
+    pthread_t tid;
+    CURLM *cm;
+    int epfd;
+    int evfd;        /* eventfd, written for new URLs and for stop */
+    long timeout_ms; /* from CURLMOPT_TIMERFUNCTION, -1 for none */
+    double deadline; /* when timeout_ms runs out, seconds */
+    int running;     /* transfers in cm */
+    int max;         /* this thread's share of -t */
+    int idle;        /* waits for URLs, guarded by frontier_lock */
+    RECV_BUF *active;        /* transfers in cm */
+} NET_THREAD;
+
 CURL *easy_handle_init(RECV_BUF *ptr, char *url);
 int recv_buf_init(RECV_BUF *ptr, size_t max_size);
 int recv_buf_cleanup(RECV_BUF *ptr);
 size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata);
 size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata);
 int process_data(CURL *curl_handle, RECV_BUF *p_recv_buf);
-int find_http(char *fname, int size, int follow_relative_links,
-              const char *base_url);
+static void add_link(void *arg, const char *href, size_t len);
+static int page_feed(RECV_BUF *p, const char *buf, size_t len);
 int process_html(CURL *curl_handle, RECV_BUF *p_recv_buf);
 int process_png(CURL *curl_handle, RECV_BUF *p_recv_buf);
 
-RECV_BUF recv_buf[1000];
-ENTRY e, *ep;
-int url_index =0;
+URL_SET urls;        /* every URL seen, ids [init_index, n) not crawled */
 int used_url=0;
-char p_url_all[1000][256];
 char log_file[256] = "log.txt";
 int png_num = 0;
 int t = 1;
 int m = 50;
-int init_index=0;
+U32 init_index=0;
+size_t budget = 0;   /* -b: MiB of URL set heap before spilling, 0 off */
+RECV_BUF *buf_pool = NULL;  /* finished RECV_BUFs, buffers kept for reuse */
+int n_net = 0;       /* -n: network threads, 0 runs the single loop in main */
+int n_parse = 1;     /* -p: parse threads when n_net > 0 */
+int in_flight = 0;   /* pages taken off the frontier and not released */
+long n_pages = 0;    /* pages released, fetched or failed */
+int stop = 0;        /* crawl over, m PNGs or nothing left to fetch */
+pthread_mutex_t frontier_lock = PTHREAD_MUTEX_INITIALIZER;
+                     /* guards urls, init_index, png_num, in_flight, stop,
+                        buf_pool, the log files and NET_THREAD.idle */
+NET_THREAD *nets = NULL;
+MPMC_RING *parse_q = NULL;  /* RECV_BUF *, pages with work for a parser */
+PAGE_CHUNK *chunk_pool = NULL;
+pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+CURLSH *curl_share = NULL;
+pthread_mutex_t curl_share_lock[CURL_LOCK_DATA_LAST];
 
 static size_t cb(char *d, size_t n, size_t l, void *p)
 {
@@ -76,50 +133,133 @@ static size_t cb(char *d, size_t n, size_t l, void *p)
     (void)p;
     return n*l;
 }
-void cleanup(CURL *curl, RECV_BUF *ptr)
+/* a RECV_BUF off the free list, or a new one; call with frontier_lock */
+static RECV_BUF *recv_buf_get(void)
 {
-    curl_easy_cleanup(curl);
-    curl_global_cleanup();
-    recv_buf_cleanup(ptr);
+    RECV_BUF *ptr = buf_pool;
+
+    if (ptr != NULL) {
+        buf_pool = ptr->next;
+        return ptr;
+    }
+    ptr = calloc(1, sizeof(RECV_BUF));
+    if (ptr != NULL) {
+        pthread_mutex_init(&ptr->lock, NULL);
+    }
+    return ptr;
 }
-htmlDocPtr mem_getdoc(char *buf, int size, const char *url)
+
+/* back on the free list, its buffers stay allocated; call with
+ * frontier_lock */
+static void recv_buf_put(RECV_BUF *ptr)
 {
-    int opts = HTML_PARSE_NOBLANKS | HTML_PARSE_NOERROR | \
-               HTML_PARSE_NOWARNING | HTML_PARSE_NONET;
-    htmlDocPtr doc = htmlReadMemory(buf, size, url, NULL, opts);
+    if (ptr != NULL) {
+        ptr->next = buf_pool;
+        buf_pool = ptr;
+    }
+}
 
-    if ( doc == NULL ) {
-        fprintf(stderr, "Document not parsed successfully.\n");
-        return NULL;
+static double now_sec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+/* kick one network thread out of epoll_wait */
+static void net_wake(NET_THREAD *net)
+{
+    uint64_t one = 1;
+
+    if (write(net->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("eventfd write");
     }
-    return doc;
 }
 
-xmlXPathObjectPtr getnodeset (xmlDocPtr doc, xmlChar *xpath)
+/* wake network threads waiting for URLs, call with frontier_lock */
+static void wake_idle(void)
 {
+    int i;
 
-    xmlXPathContextPtr context;
-    xmlXPathObjectPtr result;
+    for (i = 0; i < n_net; i++) {
+        if (nets[i].idle) {
+            nets[i].idle = 0;
+            net_wake(&nets[i]);
+        }
+    }
+}
 
-    context = xmlXPathNewContext(doc);
-    if (context == NULL) {
-        printf("Error in xmlXPathNewContext\n");
-        return NULL;
+/* end the crawl if it is over, call with frontier_lock */
+static void check_done(void)
+{
+    int i;
+
+    if (stop || (png_num < m &&
+                 (in_flight > 0 || init_index < url_set_count(&urls)))) {
+        return;
     }
-    result = xmlXPathEvalExpression(xpath, context);
-    xmlXPathFreeContext(context);
-    if (result == NULL) {
-        printf("Error in xmlXPathEvalExpression\n");
-        return NULL;
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < n_net; i++) {
+        net_wake(&nets[i]);
     }
-    if(xmlXPathNodeSetIsEmpty(result->nodesetval)){
-        xmlXPathFreeObject(result);
-        printf("No result\n");
-        return NULL;
+}
+
+/* a page is finished with, its RECV_BUF goes back to the pool */
+static void page_release(RECV_BUF *ptr)
+{
+    pthread_mutex_lock(&frontier_lock);
+    recv_buf_put(ptr);
+    in_flight--;
+    n_pages++;
+    check_done();
+    pthread_mutex_unlock(&frontier_lock);
+}
+
+void cleanup(CURL *curl, RECV_BUF *ptr)
+{
+    curl_easy_cleanup(curl);
+    page_release(ptr);
+}
+
+/* remember the URL of the page, resolving links and logging PNGs need it
+ * after the transfer is gone */
+static int set_base(RECV_BUF *p, const char *url)
+{
+    size_t len = strlen(url) + 1;
+
+    if (p->base_cap < len) {
+        char *q = realloc(p->base, len);
+        if (q == NULL) {
+            return 1;
+        }
+        p->base = q;
+        p->base_cap = len;
     }
-    return result;
+    memcpy(p->base, url, len);
+    return 0;
+}
+
+static int set_base_curl(RECV_BUF *p)
+{
+    char *url = NULL;
+
+    curl_easy_getinfo(p->curl, CURLINFO_EFFECTIVE_URL, &url);
+    return url == NULL || set_base(p, url);
 }
 
+/* append one line to a log file, any length */
+static int log_line(const char *path, const char *line)
+{
+    FILE *fp = fopen(path, "a");
+
+    if (fp == NULL) {
+        perror("fopen");
+        return -2;
+    }
+    fprintf(fp, "%s\n", line);
+    return fclose(fp);
+}
 int write_file(const char *path, const void *in, size_t len)
 {
     FILE *fp = NULL;
@@ -166,6 +306,7 @@ CURL *easy_handle_init(RECV_BUF *ptr, char *url)
         fprintf(stderr, "curl_easy_init: returned NULL\n");
         return NULL;
     }
+    ptr->curl = curl_handle;
 
     /* specify URL to get */
     curl_easy_setopt(curl_handle, CURLOPT_URL, url);
@@ -218,14 +359,26 @@ int recv_buf_init(RECV_BUF *ptr, size_t max_size)
         return 1;
     }
 
-    p = malloc(max_size);
-    if (p == NULL) {
-        return 2;
+    if (ptr->max_size < max_size) {   /* a reused buffer may be big enough */
+        p = realloc(ptr->buf, max_size);
+        if (p == NULL) {
+            return 2;
+        }
+        ptr->buf = p;
+        ptr->max_size = max_size;
     }
-    ptr->buf = p;
     ptr->size = 0;
-    ptr->max_size = max_size;
     ptr->seq = -1;              /* valid seq should be positive */
+    ptr->status = 0;
+    ptr->html = 0;
+    ptr->png = 0;
+    ptr->head = ptr->tail = NULL;
+    ptr->queued = 0;
+    ptr->done = 0;
+    if (ptr->scan.cb == NULL) {
+        link_scan_init(&ptr->scan, add_link, ptr);
+    }
+    link_scan_reset(&ptr->scan);
     return 0;
 }
 
@@ -236,8 +389,16 @@ int recv_buf_cleanup(RECV_BUF *ptr)
     }
 
     free(ptr->buf);
+    ptr->buf = NULL;
     ptr->size = 0;
     ptr->max_size = 0;
+    link_scan_cleanup(&ptr->scan);
+    free(ptr->abs);
+    ptr->abs = NULL;
+    ptr->abs_cap = 0;
+    free(ptr->base);
+    ptr->base = NULL;
+    ptr->base_cap = 0;
     return 0;
 }
 
@@ -269,6 +430,16 @@ size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata)
         /* extract img sequence number */
         p->seq = atoi(p_recv + strlen(ECE252_HEADER));
 
+    } else if (realsize > 5 && strncmp(p_recv, "HTTP/", 5) == 0) {
+        /* status line, a redirect starts a new response */
+        char *sp = memchr(p_recv, ' ', realsize);
+        p->status = sp ? atol(sp + 1) : 0;
+        p->html = 0;
+        link_scan_reset(&p->scan);
+    } else if (realsize > 13 && strncasecmp(p_recv, "Content-Type:", 13) == 0 &&
+               memmem(p_recv, realsize, CT_HTML, strlen(CT_HTML)) != NULL) {
+        p->html = p->status >= 200 && p->status < 300 &&
+                  set_base_curl(p) == 0;
     }
     return realsize;
 }
@@ -289,6 +460,16 @@ size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata)
     size_t realsize = size * nmemb;
     RECV_BUF *p = (RECV_BUF *)p_userdata;
 
+    if (p->html) {
+        /* links are found as the page arrives, the page is not kept */
+        if (n_net == 0) {
+            link_scan_feed(&p->scan, p_recv, realsize);
+        } else if (page_feed(p, p_recv, realsize) != 0) {
+            return -1;
+        }
+        return realsize;
+    }
+
     if (p->size + realsize + 1 > p->max_size) {/* hope this rarely happens */
         /* received data is not 0 terminated, add one byte for terminating 0 */
         size_t new_size = p->max_size + max(BUF_INC, realsize + 1);
@@ -344,76 +525,52 @@ int process_data(CURL *curl_handle, RECV_BUF *p_recv_buf)
 
 int process_html(CURL *curl_handle, RECV_BUF *p_recv_buf)
 {
-    char fname[256];
-    int follow_relative_link = 1;
-    char *url = NULL;
-    pid_t pid =getpid();
-
-    curl_easy_getinfo(curl_handle, CURLINFO_EFFECTIVE_URL, &url);
-    find_http(p_recv_buf->buf, p_recv_buf->size, follow_relative_link, url);
-    //sprintf(fname, "./output_%d.html", pid);
-    //return write_file(fname, p_recv_buf->buf, p_recv_buf->size);
+    /* the links were taken out by write_cb_curl3() while the page came in */
+    (void) curl_handle;
+    (void) p_recv_buf;
     return 0;
 }
 
-int find_http(char *buf, int size, int follow_relative_links, const char *base_url)
+/**
+ * @brief link scanner call back: resolve an href against the page URL and
+ *        queue it if it is a new http(s) URL
+ */
+static void add_link(void *arg, const char *href, size_t len)
 {
-    int i;
-    htmlDocPtr doc;
-    xmlChar *xpath = (xmlChar*) "//a/@href";
-    xmlNodeSetPtr nodeset;
-    xmlXPathObjectPtr result;
-    xmlChar *href;
-    char logurl[256];
-
-    if (buf == NULL) {
-        return 1;
+    RECV_BUF *p = arg;
+    const char *url;
+
+    url = link_resolve(p->base, href, len, &p->abs, &p->abs_cap);
+    if ( url != NULL && !strncmp(url, "http", 4) ) {
+        U32 id;
+        int added;
+
+        pthread_mutex_lock(&frontier_lock);
+        added = url_set_add(&urls, url, &id);
+        if (added == 1) {
+            //write log.txt
+            log_line(log_file, url_set_get(&urls, id));
+            wake_idle();
+        } else if (added < 0) {
+            fprintf(stderr, "url_set_add: out of memory\n");
+        }
+        pthread_mutex_unlock(&frontier_lock);
     }
+}
 
-    doc = mem_getdoc(buf, size, base_url);
-    result = getnodeset (doc, xpath);
-    if (result) {
-        nodeset = result->nodesetval;
-        for (i=0; i < nodeset->nodeNr; i++) {
-            href = xmlNodeListGetString(doc, nodeset->nodeTab[i]->xmlChildrenNode, 1);
-            if ( follow_relative_links ) {
-                xmlChar *old = href;
-                href = xmlBuildURI(href, (xmlChar *) base_url);
-                xmlFree(old);
-            }
-            if ( href != NULL && !strncmp((const char *)href, "http", 4) ) {
-                e.key = href;
-                /* data is just an integer, instead of a
-                   pointer to something */
-                e.data = (void *) url_index;
-                ep = hsearch(e, FIND);
-                /* there should be no failures */
-                if (ep == NULL) {
-                    strcpy(p_url_all[url_index],href);
-                    e.key=p_url_all[url_index];
-                    e.data=url_index;
-                    ep = hsearch(e, ENTER);
-                    if (ep != NULL){
-//                        deque_push_back(&visited_url_queue, url_index);
-//                        printf("enqueue: %d \n", visited_url_queue.items[visited_url_queue.tail-1]);
-//                        printf("enqueue: %s\n", p_url_all[url_index]);
-                        //push(&visited_url_stack, url_index);
-                        url_index += 1;
-//                        pthread_mutex_unlock(&lock_thread);
-                        //write log.txt
-                        sprintf(logurl, "%s\n", href);
-                        write_file(log_file, logurl, strlen(logurl));
-                    }else{
-                        perror("error hash\n");
-                    }
-                }
-            }
-            xmlFree(href);
-        }
-        xmlXPathFreeObject (result);
+/* is_png() on a complete body, log it if it is one of the first m */
+static int check_png(RECV_BUF *p)
+{
+    if (is_png((U8 *)p->buf, p->size) != 0) {
+        return 0;
     }
-    xmlFreeDoc(doc);
-    xmlCleanupParser();
+    pthread_mutex_lock(&frontier_lock);
+    if (png_num < m) {
+        log_line("./png_urls.txt", p->base);
+        png_num += 1;
+        check_done();
+    }
+    pthread_mutex_unlock(&frontier_lock);
     return 0;
 }
 
@@ -426,34 +583,449 @@ int process_png(CURL *curl_handle, RECV_BUF *p_recv_buf)
 //        return 0;
 //    }
 //    pthread_mutex_unlock(&lock_png);
-    pid_t pid =getpid();
-    char fname[256];
-    char url[256];
-    char *eurl = NULL;          /* effective URL */
-    curl_easy_getinfo(curl_handle, CURLINFO_EFFECTIVE_URL, &eurl);
-    if ( eurl != NULL) {
-        if(is_png(p_recv_buf->buf,p_recv_buf->size)==0 ){
-            sprintf(fname, "./png_urls.txt");
-            sprintf(url, "%s\n", eurl);
-            write_file(fname, url, strlen(url));
-            png_num += 1;
-        }
+    (void) curl_handle;
+    if (set_base_curl(p_recv_buf) != 0) {   /* effective URL */
+        return 1;
+    }
+    if (n_net > 0) {
+        p_recv_buf->png = 1;    /* a parse thread checks it */
+        return 0;
     }
     //hit_url("");
-    return 0;
+    return check_png(p_recv_buf);
+}
+
+/**
+ * @brief take the next URL off the frontier and set up its transfer
+ * @param net NET_THREAD* the caller, marked idle if there is nothing to
+ *        take; NULL from the single loop
+ * @return the easy handle, NULL if the frontier is empty or the crawl over
+ */
+static CURL *next_transfer(NET_THREAD *net)
+{
+    RECV_BUF *buf = NULL;
+    CURL *eh;
+
+    pthread_mutex_lock(&frontier_lock);
+    if (url_set_compact(&urls, &init_index) < 0) {
+        fprintf(stderr, "url_set_compact: spill failed\n");
+    }
+    if (!stop && init_index < url_set_count(&urls) &&
+        (buf = recv_buf_get()) != NULL &&
+        set_base(buf, url_set_get(&urls, init_index)) == 0) {
+        init_index += 1;
+        in_flight++;
+    } else {
+        recv_buf_put(buf);
+        buf = NULL;
+        if (net != NULL && !stop) {
+            net->idle = 1;
+        }
+    }
+    pthread_mutex_unlock(&frontier_lock);
+    if (buf == NULL) {
+        return NULL;
+    }
+    eh = easy_handle_init(buf, buf->base);
+    if (eh == NULL) {
+        page_release(buf);
+        return NULL;
+    }
+    if (curl_share != NULL) {
+        curl_easy_setopt(eh, CURLOPT_SHARE, curl_share);
+    }
+    return eh;
 }
 
 static void init(CURLM *cm)
 {
-//    CURL *eh = NULL;
-    /* init user defined call back function buffer */
-    if(init_index<url_index){
-        CURL *eh = easy_handle_init(&recv_buf[init_index], p_url_all[init_index]);
+    CURL *eh = next_transfer(NULL);
+
+    if (eh != NULL) {
         curl_multi_add_handle(cm, eh);
-        init_index+=1;
     }
-//    eh = easy_handle_init(&recv_buf[i], urls[i]);
-//    curl_multi_add_handle(cm, eh);
+}
+
+/**
+ * @brief hand HTML bytes to the parse threads, in CURL_MAX_WRITE_SIZE
+ *        chunks off a free list
+ * @return 0, 1 if out of memory
+ */
+static int page_feed(RECV_BUF *p, const char *buf, size_t len)
+{
+    while (len > 0) {
+        PAGE_CHUNK *c;
+        int push;
+
+        pthread_mutex_lock(&chunk_lock);
+        c = chunk_pool;
+        if (c != NULL) {
+            chunk_pool = c->next;
+        }
+        pthread_mutex_unlock(&chunk_lock);
+        if (c == NULL && (c = malloc(sizeof(PAGE_CHUNK))) == NULL) {
+            return 1;
+        }
+        c->len = len < sizeof(c->data) ? len : sizeof(c->data);
+        c->next = NULL;
+        memcpy(c->data, buf, c->len);
+        buf += c->len;
+        len -= c->len;
+
+        pthread_mutex_lock(&p->lock);
+        if (p->tail != NULL) {
+            p->tail->next = c;
+        } else {
+            p->head = c;
+        }
+        p->tail = c;
+        push = !p->queued;
+        p->queued = 1;
+        pthread_mutex_unlock(&p->lock);
+        if (push) {
+            mpmc_push(parse_q, &p);
+        }
+    }
+    return 0;
+}
+
+/* the transfer of p is over, a parse thread finishes and releases it */
+static void page_done(RECV_BUF *p)
+{
+    int push;
+
+    pthread_mutex_lock(&p->lock);
+    p->done = 1;
+    push = !p->queued;
+    p->queued = 1;
+    pthread_mutex_unlock(&p->lock);
+    if (push) {
+        mpmc_push(parse_q, &p);
+    }
+}
+
+/**
+ * @brief parse thread: scan queued HTML, check finished PNGs, release
+ *        finished pages; a NULL page ends the thread
+ */
+static void *parse_main(void *arg)
+{
+    RECV_BUF *p;
+
+    (void) arg;
+    for (;;) {
+        PAGE_CHUNK *c, *next;
+        int done;
+
+        mpmc_pop(parse_q, &p);
+        if (p == NULL) {
+            return NULL;
+        }
+        for (;;) {
+            pthread_mutex_lock(&p->lock);
+            c = p->head;
+            p->head = p->tail = NULL;
+            done = p->done;
+            if (c == NULL && !done) {
+                p->queued = 0;      /* page_feed() queues it again */
+            }
+            pthread_mutex_unlock(&p->lock);
+            if (c == NULL) {
+                break;
+            }
+            for (; c != NULL; c = next) {
+                next = c->next;
+                link_scan_feed(&p->scan, c->data, c->len);
+                pthread_mutex_lock(&chunk_lock);
+                c->next = chunk_pool;
+                chunk_pool = c;
+                pthread_mutex_unlock(&chunk_lock);
+            }
+        }
+        if (done) {
+            if (p->png) {
+                check_png(p);
+            }
+            page_release(p);
+        }
+    }
+}
+
+/* CURLMOPT_SOCKETFUNCTION: keep the epoll set in step with libcurl */
+static int net_socket_cb(CURL *eh, curl_socket_t s, int what, void *userp,
+                         void *socketp)
+{
+    NET_THREAD *net = userp;
+    struct epoll_event ev;
+
+    (void) eh;
+    (void) socketp;
+    if (what == CURL_POLL_REMOVE) {
+        epoll_ctl(net->epfd, EPOLL_CTL_DEL, s, NULL);
+        return 0;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((what & CURL_POLL_IN) ? EPOLLIN : 0) |
+                ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+    ev.data.fd = s;
+    if (epoll_ctl(net->epfd, EPOLL_CTL_MOD, s, &ev) != 0 &&
+        (errno != ENOENT || epoll_ctl(net->epfd, EPOLL_CTL_ADD, s, &ev) != 0)) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+/* CURLMOPT_TIMERFUNCTION: when to call socket_action with
+ * CURL_SOCKET_TIMEOUT, -1 to stop the timer */
+static int net_timer_cb(CURLM *cm, long timeout_ms, void *userp)
+{
+    NET_THREAD *net = userp;
+
+    (void) cm;
+    net->timeout_ms = timeout_ms;
+    if (timeout_ms >= 0) {
+        net->deadline = now_sec() + timeout_ms / 1000.;
+    }
+    return 0;
+}
+
+/* finished transfers of net go on to the parse threads */
+static void net_reap(NET_THREAD *net)
+{
+    CURLMsg *msg;
+    int left;
+
+    while ((msg = curl_multi_info_read(net->cm, &left)) != NULL) {
+        RECV_BUF *p = NULL, **pp;
+        CURL *eh = msg->easy_handle;
+
+        if (msg->msg != CURLMSG_DONE) {
+            continue;
+        }
+        curl_easy_getinfo(eh, CURLINFO_PRIVATE, &p);
+        if (msg->data.result != CURLE_OK) {
+            fprintf(stderr, "CURL error code: %d\n", msg->data.result);
+        } else {
+            process_data(eh, p);
+        }
+        curl_multi_remove_handle(net->cm, eh);
+        curl_easy_cleanup(eh);
+        net->running--;
+        for (pp = &net->active; *pp != p; pp = &(*pp)->next) {
+            continue;
+        }
+        *pp = p->next;
+        page_done(p);
+    }
+}
+
+/**
+ * @brief network thread: keep net->max transfers going from the frontier,
+ *        wait in epoll_wait and drive them with curl_multi_socket_action
+ */
+static void *net_main(void *arg)
+{
+    NET_THREAD *net = arg;
+    struct epoll_event ev[NET_EVENTS];
+    int still, n, i;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        int wait_ms = -1;
+        CURL *eh;
+
+        while (net->running < net->max && (eh = next_transfer(net)) != NULL) {
+            RECV_BUF *p = NULL;
+
+            curl_easy_getinfo(eh, CURLINFO_PRIVATE, &p);
+            p->next = net->active;
+            net->active = p;
+            net->running++;
+            curl_multi_add_handle(net->cm, eh);
+        }
+        if (net->timeout_ms >= 0) {
+            double left = net->deadline - now_sec();
+            wait_ms = left > 0 ? (int) (left * 1000) + 1 : 0;
+        }
+        n = epoll_wait(net->epfd, ev, NET_EVENTS, wait_ms);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            int fd = ev[i].data.fd;
+            int flags = 0;
+
+            if (fd == net->evfd) {
+                uint64_t v;
+                if (read(net->evfd, &v, sizeof(v)) < 0 && errno != EAGAIN) {
+                    perror("eventfd read");
+                }
+                continue;
+            }
+            if (ev[i].events & EPOLLIN) {
+                flags |= CURL_CSELECT_IN;
+            }
+            if (ev[i].events & EPOLLOUT) {
+                flags |= CURL_CSELECT_OUT;
+            }
+            if (ev[i].events & (EPOLLERR | EPOLLHUP)) {
+                flags |= CURL_CSELECT_ERR;
+            }
+            curl_multi_socket_action(net->cm, fd, flags, &still);
+        }
+        if (net->timeout_ms >= 0 && now_sec() >= net->deadline) {
+            net->timeout_ms = -1;
+            curl_multi_socket_action(net->cm, CURL_SOCKET_TIMEOUT, 0, &still);
+        }
+        net_reap(net);
+    }
+    /* the crawl is over, whatever is still downloading is dropped */
+    while (net->active != NULL) {
+        RECV_BUF *p = net->active;
+
+        net->active = p->next;
+        curl_multi_remove_handle(net->cm, p->curl);
+        curl_easy_cleanup(p->curl);
+        page_done(p);
+    }
+    return NULL;
+}
+
+static void share_lock(CURL *eh, curl_lock_data data,
+                       curl_lock_access access, void *userp)
+{
+    (void) eh;
+    (void) access;
+    (void) userp;
+    pthread_mutex_lock(&curl_share_lock[data]);
+}
+
+static void share_unlock(CURL *eh, curl_lock_data data, void *userp)
+{
+    (void) eh;
+    (void) userp;
+    pthread_mutex_unlock(&curl_share_lock[data]);
+}
+
+/**
+ * @brief -n: crawl with n_net network threads sharing the frontier and a
+ *        DNS/TLS session cache, and n_parse threads scanning pages and
+ *        checking PNGs while the network threads keep downloading
+ * @return 0 on success, 1 if a thread or handle could not be set up
+ */
+static int crawl_threads(void)
+{
+    pthread_t *parsers;
+    RECV_BUF *none = NULL;
+    int i, n_parsers = 0, n_nets = 0, ret = 0;
+
+    if (n_net > t) {
+        n_net = t;   /* a thread without transfers would only wait */
+    }
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&curl_share_lock[i], NULL);
+    }
+    /* connections stay per multi handle: libcurl does not support one
+     * connection cache used by concurrently running threads */
+    curl_share = curl_share_init();
+    nets = calloc(n_net, sizeof(NET_THREAD));
+    parsers = calloc(n_parse, sizeof(pthread_t));
+    if (posix_memalign((void **) &parse_q, MPMC_CACHE_LINE,
+                       mpmc_ring_size(t + n_parse, sizeof(RECV_BUF *))) != 0) {
+        parse_q = NULL;
+    }
+    if (curl_share == NULL || nets == NULL || parsers == NULL ||
+        parse_q == NULL) {
+        fprintf(stderr, "crawl_threads: out of memory\n");
+        ret = 1;
+        goto out;
+    }
+    mpmc_ring_init(parse_q, t + n_parse, sizeof(RECV_BUF *));
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+
+    for (i = 0; i < n_net; i++) {
+        NET_THREAD *net = &nets[i];
+        struct epoll_event ev;
+
+        net->max = t / n_net + (i < t % n_net);
+        net->timeout_ms = -1;
+        net->cm = curl_multi_init();
+        net->epfd = epoll_create1(EPOLL_CLOEXEC);
+        net->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = net->evfd;
+        if (net->cm == NULL || net->epfd < 0 || net->evfd < 0 ||
+            epoll_ctl(net->epfd, EPOLL_CTL_ADD, net->evfd, &ev) != 0) {
+            perror("crawl_threads");
+            ret = 1;
+            goto out;
+        }
+        curl_multi_setopt(net->cm, CURLMOPT_SOCKETFUNCTION, net_socket_cb);
+        curl_multi_setopt(net->cm, CURLMOPT_SOCKETDATA, net);
+        curl_multi_setopt(net->cm, CURLMOPT_TIMERFUNCTION, net_timer_cb);
+        curl_multi_setopt(net->cm, CURLMOPT_TIMERDATA, net);
+    }
+
+    for (; n_parsers < n_parse; n_parsers++) {
+        if (pthread_create(&parsers[n_parsers], NULL, parse_main, NULL) != 0) {
+            perror("pthread_create");
+            ret = 1;
+            goto out;
+        }
+    }
+    for (; n_nets < n_net; n_nets++) {
+        if (pthread_create(&nets[n_nets].tid, NULL, net_main,
+                           &nets[n_nets]) != 0) {
+            perror("pthread_create");
+            pthread_mutex_lock(&frontier_lock);
+            __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+            for (i = 0; i < n_nets; i++) {
+                net_wake(&nets[i]);
+            }
+            pthread_mutex_unlock(&frontier_lock);
+            ret = 1;
+            break;
+        }
+    }
+    for (i = 0; i < n_nets; i++) {
+        pthread_join(nets[i].tid, NULL);
+    }
+out:
+    /* pages still queued are parsed before the parsers see their NULL */
+    for (i = 0; i < n_parsers; i++) {
+        mpmc_push(parse_q, &none);
+    }
+    for (i = 0; i < n_parsers; i++) {
+        pthread_join(parsers[i], NULL);
+    }
+    for (i = 0; nets != NULL && i < n_net; i++) {
+        if (nets[i].cm != NULL) {
+            curl_multi_cleanup(nets[i].cm);
+        }
+        if (nets[i].epfd > 0) {
+            close(nets[i].epfd);
+        }
+        if (nets[i].evfd > 0) {
+            close(nets[i].evfd);
+        }
+    }
+    while (chunk_pool != NULL) {
+        PAGE_CHUNK *next = chunk_pool->next;
+        free(chunk_pool);
+        chunk_pool = next;
+    }
+    curl_share_cleanup(curl_share);
+    curl_share = NULL;
+    free(parse_q);
+    free(parsers);
+    free(nets);
+    nets = NULL;
+    return ret;
 }
 
 int main(int argc, char** argv )
@@ -463,14 +1035,13 @@ int main(int argc, char** argv )
     CURLMsg *msg=NULL;
     CURLcode return_code=0;
     int still_running=0, i=0, msgs_left=0;
-    int http_status_code;
-    const RECV_BUF *ret_buf;
+    RECV_BUF *ret_buf;
     char logurl[256];
     int c;
     int arg_num = 0;
-    char url_need[256];
+    const char *url_need = SEED_URL;
 
-    while ((c = getopt (argc, argv, "t:m:v:")) != -1) {
+    while ((c = getopt (argc, argv, "t:m:v:b:n:p:")) != -1) {
         switch (c) {
             case 't':
                 arg_num += 2;
@@ -498,110 +1069,124 @@ int main(int argc, char** argv )
                     return -1;
                 }
                 break;
+            case 'b':
+                arg_num += 2;
+                budget = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                arg_num += 2;
+                n_net = atoi(optarg);
+                if (n_net <= 0) {
+                    return -1;
+                }
+                break;
+            case 'p':
+                arg_num += 2;
+                n_parse = atoi(optarg);
+                if (n_parse <= 0) {
+                    return -1;
+                }
+                break;
             default:
                 return -1;
         }
     }
     double times[2];
     struct timeval tv;
+    struct rusage ru;
     if (gettimeofday(&tv, NULL) != 0) {
         abort();
     }
 
     times[0] = (tv.tv_sec) + tv.tv_usec / 1000000.;
-    if (argc == 1) {
-        strcpy(url_need, SEED_URL);
-    } else if(arg_num == 2){
-        strcpy(url_need, argv[3]);
-    }else if(arg_num == 4) {
-        strcpy(url_need, argv[5]);
-    }else if(arg_num == 6){
-        strcpy(url_need, argv[7]);
+    if (optind < argc) {
+        url_need = argv[optind];
     }
 
     curl_global_init(CURL_GLOBAL_ALL);
 
+    if (url_set_init(&urls, 1000) != 0 ||
+        (budget > 0 && url_set_budget(&urls, budget << 20, URL_EXPECT) != 0) ||
+        url_set_add(&urls, url_need, NULL) < 0) {
+        fprintf(stderr, "url_set_init: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    if (n_net > 0) {
+        if (crawl_threads() != 0) {
+            return EXIT_FAILURE;
+        }
+        goto done;
+    }
     cm = curl_multi_init();
-    hcreate(1000);
-    strcpy(p_url_all[url_index],url_need);
-//    sprintf(logurl, "%s \n", urls[0]);
-//    write_file(log_file, logurl, strlen(urls[0]));
-    url_index+=1;
     init(cm);
 
-//    curl_multi_perform(cm, &still_running);
-
     do {
         curl_multi_perform(cm, &still_running);
-        /*
-         if(!numfds) {
-            fprintf(stderr, "error: curl_multi_wait() numfds=%d\n", numfds);
-            return EXIT_FAILURE;
-         }
-        */
-   //     curl_multi_perform(cm, &still_running);
         while((msg = curl_multi_info_read(cm, &msgs_left))){
             if (msg->msg == CURLMSG_DONE) {
                 eh = msg->easy_handle;
                 return_code = msg->data.result;
-                if(return_code!=CURLE_OK) {
-                    fprintf(stderr, "CURL error code: %d\n", msg->data.result);
-		    ret_buf = NULL;
-		    curl_easy_getinfo(eh, CURLINFO_PRIVATE, &ret_buf);
-                    curl_multi_remove_handle(cm, eh);
-		    cleanup(eh, ret_buf);
-		    continue;
-                }
-
-                // Get HTTP status code
-                http_status_code=0;
                 ret_buf = NULL;
-
-                curl_easy_getinfo(eh, CURLINFO_RESPONSE_CODE, &http_status_code);
                 curl_easy_getinfo(eh, CURLINFO_PRIVATE, &ret_buf);
-
-                if(http_status_code==200) {
-//                printf("200 OK for %s\n", ret_buf->buf);
-                } else if(http_status_code!=400) {
-//                    fprintf(stderr, "GET of %s returned http status code %d\n", ret_buf->buf, http_status_code);
+                if(return_code!=CURLE_OK) {
+                    fprintf(stderr, "CURL error code: %d\n", msg->data.result);
+                } else {
+                    process_data(eh, ret_buf);
                 }
-                process_data(eh, ret_buf);
                 curl_multi_remove_handle(cm, eh);
-	        cleanup(eh, ret_buf);
-	    }
+                cleanup(eh, ret_buf);
+            }
         }
-//        curl_multi_perform(cm, &still_running);
         if(m<=png_num){
-	while(still_running){
-	    curl_multi_perform(cm, &still_running);
-            while((msg = curl_multi_info_read(cm, &msgs_left))){
-		if (msg->msg == CURLMSG_DONE) {
-                    eh = msg->easy_handle;
-                    ret_buf = NULL;
-                    curl_easy_getinfo(eh, CURLINFO_PRIVATE, &ret_buf);
-                    curl_multi_remove_handle(cm, eh);
-                    cleanup(eh, ret_buf);
-		}
+            /* let the transfers still running finish, then stop */
+            while(still_running){
+                curl_multi_poll(cm, NULL, 0, POLL_MS, NULL);
+                curl_multi_perform(cm, &still_running);
+                while((msg = curl_multi_info_read(cm, &msgs_left))){
+                    if (msg->msg == CURLMSG_DONE) {
+                        eh = msg->easy_handle;
+                        ret_buf = NULL;
+                        curl_easy_getinfo(eh, CURLINFO_PRIVATE, &ret_buf);
+                        curl_multi_remove_handle(cm, eh);
+                        cleanup(eh, ret_buf);
+                    }
+                }
             }
-	}
-	    break;
+            break;
         }
-        if((init_index==url_index) && still_running==0){
+        if((init_index==url_set_count(&urls)) && still_running==0){
             break;
         }
         int w=t-still_running;
         for (i = 0; i < w; ++i) {
             init(cm);
         }
-        curl_multi_perform(cm, &still_running);
+        /* sleep until a socket is ready or a libcurl timeout is due, new
+         * handles make it return at once */
+        curl_multi_poll(cm, NULL, 0, POLL_MS, NULL);
     } while(1);
 
     curl_multi_cleanup(cm);
+done:
+    url_set_cleanup(&urls);
+    while (buf_pool != NULL) {
+        RECV_BUF *next = buf_pool->next;
+        recv_buf_cleanup(buf_pool);
+        free(buf_pool);
+        buf_pool = next;
+    }
+    curl_global_cleanup();
     //time
     if (gettimeofday(&tv, NULL) != 0) {
         abort();
     }
     times[1] = (tv.tv_sec) + tv.tv_usec / 1000000.;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        double cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000. +
+                     ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.;
+        printf("CPU time: %lf seconds for %ld pages, %.3lf ms per page\n",
+               cpu, n_pages, n_pages > 0 ? cpu * 1000 / n_pages : 0.);
+    }
     printf("findpng2 execution time: %lf seconds\n", times[1] - times[0]);
 
     return EXIT_SUCCESS;
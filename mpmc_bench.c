@@ -0,0 +1,218 @@
+/**
+ * @brief: push/pop throughput of the paster2 queues across processes
+ *
+ * Compares the semaphore-guarded deque paster2 used before (four sem_t:
+ * push, pop, slots, exists) with the lock-free MPMC ring, with P forked
+ * producers and C forked consumers sharing one queue, P = C = 1 .. 64.
+ *
+ * ./mpmc_bench [-n ops] [-q queue size] [-s item bytes] [-m max procs]
+ */
+
+#include <getopt.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "mpmc_ring.h"
+
+/* the old paster2 queue: fixed items, [head, tail), four semaphores */
+typedef struct sem_deque {
+    sem_t push, pop, slots, exists;
+    int capacity;
+    int head, tail;
+    int item_size;
+    /* capacity items follow */
+} SEM_DEQUE;
+
+static char *sem_item(SEM_DEQUE *q, int i)
+{
+    return (char *) (q + 1) + (size_t) i * q->item_size;
+}
+
+static void sem_deque_push(SEM_DEQUE *q, const void *item)
+{
+    sem_wait(&q->push);
+    sem_wait(&q->slots);
+    memcpy(sem_item(q, q->tail++), item, q->item_size);
+    if (q->tail >= q->capacity) q->tail -= q->capacity;
+    sem_post(&q->exists);
+    sem_post(&q->push);
+}
+
+static void sem_deque_pop(SEM_DEQUE *q, void *item)
+{
+    sem_wait(&q->pop);
+    sem_wait(&q->exists);
+    memcpy(item, sem_item(q, q->head++), q->item_size);
+    if (q->head >= q->capacity) q->head -= q->capacity;
+    sem_post(&q->slots);
+    sem_post(&q->pop);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+/**
+ * @brief: a one cell ring must still tell full from empty
+ * @return 0 if it does
+ */
+static int ring_check(void)
+{
+    static union {
+        MPMC_RING q;
+        char mem[sizeof(MPMC_RING) + 2 * MPMC_CACHE_LINE];
+    } u;
+    long a = 1, b = 2, out = 0;
+    int i, bad = 0;
+
+    if (mpmc_ring_size(1, sizeof(long)) > sizeof(u) ||
+        mpmc_ring_init(&u.q, 1, sizeof(long)) != 0) {
+        return 1;
+    }
+    for (i = 0; i < 3; i++) {
+        bad += mpmc_try_push(&u.q, &a) != 0;
+        bad += mpmc_try_push(&u.q, &b) != 1;    /* full */
+        bad += mpmc_try_pop(&u.q, &out) != 0 || out != a;
+        bad += mpmc_try_pop(&u.q, &out) != 1;   /* empty */
+    }
+    return bad;
+}
+
+/* share of n ops for worker i of k */
+static long share(long n, int i, int k)
+{
+    return n / k + (i < n % k);
+}
+
+/**
+ * @brief: one run, P producers and C consumers moving n items
+ * @return items per second
+ */
+static double run(void *shm, int use_ring, int P, int C, long n,
+                  int item_size)
+{
+    char *item = calloc(1, item_size);
+    double t0 = now();
+    int i;
+    long k;
+
+    for (i = 0; i < P + C; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            abort();
+        }
+        if (pid > 0) {
+            continue;
+        }
+        if (i < P) {
+            for (k = share(n, i, P); k > 0; k--) {
+                memcpy(item, &k, sizeof(k));
+                if (use_ring) {
+                    mpmc_push(shm, item);
+                } else {
+                    sem_deque_push(shm, item);
+                }
+            }
+        } else {
+            for (k = share(n, i - P, C); k > 0; k--) {
+                if (use_ring) {
+                    mpmc_pop(shm, item);
+                } else {
+                    sem_deque_pop(shm, item);
+                }
+            }
+        }
+        _exit(0);
+    }
+    while (wait(NULL) > 0) {
+    }
+    free(item);
+    return n / (now() - t0);
+}
+
+int main(int argc, char **argv)
+{
+    long n = 200000;
+    int queue_size = 16;
+    int item_size = 64;
+    int max_procs = 64;
+    int c, p;
+
+    while ((c = getopt(argc, argv, "n:q:s:m:")) != -1) {
+        switch (c) {
+        case 'n':
+            n = atol(optarg);
+            break;
+        case 'q':
+            queue_size = atoi(optarg);
+            break;
+        case 's':
+            item_size = atoi(optarg);
+            break;
+        case 'm':
+            max_procs = atoi(optarg);
+            break;
+        default:
+            printf("usage: %s [-n ops] [-q queue] [-s item] [-m procs]\n",
+                   argv[0]);
+            return 1;
+        }
+    }
+    if (n <= 0 || queue_size <= 0 || item_size < (int) sizeof(long)) {
+        printf("bad parameter\n");
+        return 1;
+    }
+
+    if (ring_check() != 0) {
+        printf("mpmc_ring: one cell ring lost or invented items\n");
+        return 1;
+    }
+    size_t sem_size = sizeof(SEM_DEQUE) + (size_t) queue_size * item_size;
+    size_t ring_size = mpmc_ring_size(queue_size, item_size);
+    size_t size = sem_size > ring_size ? sem_size : ring_size;
+    void *shm = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shm == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    printf("%ld items of %d bytes, queue size %d, %ld CPU(s)\n", n,
+           item_size, queue_size, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%4s %4s %14s %14s %8s\n", "P", "C", "sem ops/s", "ring ops/s",
+           "speedup");
+    for (p = 1; p <= max_procs; p *= 2) {
+        SEM_DEQUE *q = shm;
+        double sem_ops, ring_ops;
+
+        memset(q, 0, sizeof(*q));
+        sem_init(&q->push, 1, 1);
+        sem_init(&q->pop, 1, 1);
+        sem_init(&q->slots, 1, queue_size);
+        sem_init(&q->exists, 1, 0);
+        q->capacity = queue_size;
+        q->item_size = item_size;
+        sem_ops = run(shm, 0, p, p, n, item_size);
+        sem_destroy(&q->push);
+        sem_destroy(&q->pop);
+        sem_destroy(&q->slots);
+        sem_destroy(&q->exists);
+
+        mpmc_ring_init(shm, queue_size, item_size);
+        ring_ops = run(shm, 1, p, p, n, item_size);
+
+        printf("%4d %4d %14.0f %14.0f %7.2fx\n", p, p, sem_ops, ring_ops,
+               ring_ops / sem_ops);
+    }
+    munmap(shm, size);
+    return 0;
+}
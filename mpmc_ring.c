@@ -0,0 +1,176 @@
+/**
+ * @brief: bounded lock-free MPMC ring buffer, see mpmc_ring.h
+ */
+
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "mpmc_ring.h"
+
+/* each cell: sequence number, then the item. The sequence counts in
+ * half steps, 2 * pos free for the push at pos, 2 * pos + 1 holding the
+ * item pushed at pos; with whole steps a one cell ring could not tell
+ * "pushed at pos" from "free for pos + 1". */
+typedef struct mpmc_cell {
+    U64 seq;
+    char item[];
+} MPMC_CELL;
+
+static MPMC_CELL *cell_at(MPMC_RING *q, U64 pos)
+{
+    return (MPMC_CELL *) ((char *) (q + 1) +
+                          (size_t) (pos % q->capacity) * q->cell_size);
+}
+
+/* shared (not FUTEX_PRIVATE) so forked processes can wake each other */
+static void futex_wait(U32 *addr, U32 val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static void futex_wake(U32 *addr, int n)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+static U32 cell_size(U32 item_size)
+{
+    size_t n = sizeof(MPMC_CELL) + item_size;
+    return (U32) ((n + MPMC_CACHE_LINE - 1) & ~(size_t) (MPMC_CACHE_LINE - 1));
+}
+
+/**
+ * @brief: bytes of (shared) memory a ring of capacity items needs
+ */
+size_t mpmc_ring_size(U32 capacity, U32 item_size)
+{
+    return sizeof(MPMC_RING) + (size_t) capacity * cell_size(item_size);
+}
+
+/**
+ * @brief: set up an empty ring in memory of mpmc_ring_size() bytes
+ * @return 0 on success, 1 on a bad argument
+ */
+int mpmc_ring_init(MPMC_RING *q, U32 capacity, U32 item_size)
+{
+    U32 i;
+
+    if (q == NULL || capacity == 0) {
+        return 1;
+    }
+    memset(q, 0, sizeof(*q));
+    q->capacity = capacity;
+    q->item_size = item_size;
+    q->cell_size = cell_size(item_size);
+    for (i = 0; i < capacity; i++) {
+        cell_at(q, i)->seq = 2 * (U64) i;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return 0;
+}
+
+/**
+ * @brief: copy item into the ring unless it is full, never blocks
+ * @return 0 pushed, 1 full
+ */
+int mpmc_try_push(MPMC_RING *q, const void *item)
+{
+    U64 pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    MPMC_CELL *cell;
+
+    for (;;) {
+        cell = cell_at(q, pos);
+        U64 seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long dif = (long) (seq - 2 * pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return 1;  /* the cell still holds an item from a lap ago */
+        } else {
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    memcpy(cell->item, item, q->item_size);
+    __atomic_store_n(&cell->seq, 2 * pos + 1, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&q->not_empty, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->pop_waiters, __ATOMIC_SEQ_CST) != 0) {
+        futex_wake(&q->not_empty, 1);
+    }
+    return 0;
+}
+
+/**
+ * @brief: copy the oldest item out of the ring unless it is empty, never
+ *         blocks
+ * @return 0 popped, 1 empty
+ */
+int mpmc_try_pop(MPMC_RING *q, void *item)
+{
+    U64 pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    MPMC_CELL *cell;
+
+    for (;;) {
+        cell = cell_at(q, pos);
+        U64 seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long dif = (long) (seq - (2 * pos + 1));
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return 1;  /* nothing published in this cell yet */
+        } else {
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    memcpy(item, cell->item, q->item_size);
+    __atomic_store_n(&cell->seq, 2 * (pos + q->capacity), __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&q->not_full, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->push_waiters, __ATOMIC_SEQ_CST) != 0) {
+        futex_wake(&q->not_full, 1);
+    }
+    return 0;
+}
+
+/**
+ * @brief: push, sleeping on the not_full futex while the ring is full.
+ *         The futex word is read before the attempt, so a pop between the
+ *         failed attempt and the sleep makes FUTEX_WAIT return at once.
+ */
+void mpmc_push(MPMC_RING *q, const void *item)
+{
+    for (;;) {
+        U32 seen = __atomic_load_n(&q->not_full, __ATOMIC_SEQ_CST);
+        if (mpmc_try_push(q, item) == 0) {
+            return;
+        }
+        __atomic_add_fetch(&q->push_waiters, 1, __ATOMIC_SEQ_CST);
+        futex_wait(&q->not_full, seen);
+        __atomic_sub_fetch(&q->push_waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * @brief: pop, sleeping on the not_empty futex while the ring is empty
+ */
+void mpmc_pop(MPMC_RING *q, void *item)
+{
+    for (;;) {
+        U32 seen = __atomic_load_n(&q->not_empty, __ATOMIC_SEQ_CST);
+        if (mpmc_try_pop(q, item) == 0) {
+            return;
+        }
+        __atomic_add_fetch(&q->pop_waiters, 1, __ATOMIC_SEQ_CST);
+        futex_wait(&q->not_empty, seen);
+        __atomic_sub_fetch(&q->pop_waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
@@ -0,0 +1,51 @@
+/**
+ * @brief: bounded lock-free multi-producer/multi-consumer ring buffer
+ *
+ * Vyukov's sequence-numbered cell queue: every cell carries a sequence
+ * number that tells a producer (seq == 2 pos) or a consumer (seq == 2 pos + 1)
+ * that the cell is theirs, and a single CAS on the shared enqueue/dequeue
+ * position claims it. There is no lock, producers do not serialize on each
+ * other, and a push or pop makes no system call.
+ *
+ * Only when the ring is full (or empty) does the caller sleep on a futex;
+ * the other side wakes it only if somebody is actually waiting. The ring is
+ * position independent and uses shared futexes, so it can live in System V
+ * or mmap'd shared memory and be used from forked processes as well as
+ * threads.
+ *
+ * Reference: D. Vyukov, "Bounded MPMC queue", 1024cores.net
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+typedef unsigned int U32;
+typedef unsigned long int U64;
+
+#define MPMC_CACHE_LINE 64
+
+typedef struct mpmc_ring {
+    U32 capacity;        /* cells                                      */
+    U32 item_size;       /* bytes copied per push/pop                  */
+    U32 cell_size;       /* item_size + sequence, cache line aligned   */
+    char pad0[MPMC_CACHE_LINE - 3 * sizeof(U32)];
+    U64 enqueue_pos;     /* next position to push                      */
+    char pad1[MPMC_CACHE_LINE - sizeof(U64)];
+    U64 dequeue_pos;     /* next position to pop                       */
+    char pad2[MPMC_CACHE_LINE - sizeof(U64)];
+    U32 not_full;        /* futex word, bumped after every pop         */
+    U32 push_waiters;
+    char pad3[MPMC_CACHE_LINE - 2 * sizeof(U32)];
+    U32 not_empty;       /* futex word, bumped after every push        */
+    U32 pop_waiters;
+    char pad4[MPMC_CACHE_LINE - 2 * sizeof(U32)];
+    /* capacity cells of cell_size bytes follow */
+} MPMC_RING;
+
+size_t mpmc_ring_size(U32 capacity, U32 item_size);
+int mpmc_ring_init(MPMC_RING *q, U32 capacity, U32 item_size);
+int mpmc_try_push(MPMC_RING *q, const void *item);
+int mpmc_try_pop(MPMC_RING *q, void *item);
+void mpmc_push(MPMC_RING *q, const void *item);
+void mpmc_pop(MPMC_RING *q, void *item);
@@ -1,22 +1,49 @@
+#include <arpa/inet.h>
 #include <curl/curl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <linux/futex.h>
+#include <pthread.h>
 #include <semaphore.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
 #include <sys/shm.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
-#include "catpng.c"
+#include "mpmc_ring.h"
+#include "shm_arena.h"
+#include "crc.h"
+#include "lab_png.h"
+#include "png_chunk.h"
+#include "zutil.h"
 
-#define BUF_SIZE 10240 /* 1024*10 = 10K */
 #define ECE252_HEADER "X-Ece252-Fragment: "
-#define IMG_URL_BASE "http://ece252-1.uwaterloo.ca:2530/image?"
+#define IMG_URL_BASE "http://ece252-%d.uwaterloo.ca:2530/image?"
+#define N_SERVERS 3  // ece252-1, ece252-2, ece252-3 serve the same images
 #define URL_LEN 256
 #define TOTAL_PART 50
 #define SEM_PROC 1  // shared in procs
 #define MAX_CONSUMER 100
+#define MAX_PRODUCER 100
+#define ARENA_SIZE (512UL << 20)  // fragment data, only touched pages cost
+#define CONTENT_LENGTH "Content-Length:"
+#define IDAT_BUF (64 * 1024)  // compressed bytes per IDAT chunk of all.png
+#define CONNECT_TIMEOUT_MS 2000
+#define TOTAL_TIMEOUT_MS 10000  // per request, it is retried after that
+#define MAX_RETRY 5             // per fragment
+#define RETRY_BASE_MS 50        // backoff before the first retry, doubled
+#define RETRY_MAX_MS 2000       // after each one up to this, then jittered
+#define HEDGE_MIN_SAMPLES 10    // downloads timed before any hedging
+#define LAT_BUCKETS 64
+#define LAT_STEP 1.189207115    // 2^(1/4), latency bucket growth
 
 /* for log */
 // abort when cond != 0
@@ -38,21 +65,6 @@
             abort();                  \
         }                             \
     } while (0)
-// connect
-#define CONNECT(p, id, addr, flag) \
-    do {                           \
-        p = shmat(id, addr, flag); \
-        if (p == (void *)-1) {     \
-            perror("shmat");       \
-            abort();               \
-        }                          \
-    } while (0)
-// disconnect
-#define DETACH(p)        \
-    if (shmdt(p) != 0) { \
-        perror("shmdt"); \
-        abort();         \
-    }
 /* for sem */
 // init sem variable
 #define INITSEM(p, value)                        \
@@ -62,92 +74,261 @@
     }
 
 // Buffer begin
+// The fragment data lives in a block of the shared arena p_arena, a
+// Buffer only names it by offset, so it means the same in every process.
 typedef struct Buffer {
-    char buf[BUF_SIZE];
+    U32 off;   // data block in p_arena, SHM_ARENA_NIL if none yet
+    U32 cap;   // bytes the block holds
     int size;
     int seq;
 } Buffer;
 int buffer_init(Buffer *p_buf) {
     LOG_ABORT(p_buf == NULL);
+    p_buf->off = SHM_ARENA_NIL;
+    p_buf->cap = 0;
     p_buf->size = 0;
     p_buf->seq = -1;
     return 0;
 }
+int buffer_reserve(Buffer *p_buf, size_t len);
+void buffer_free(Buffer *p_buf);
 // Buffer end
 
-// Deque begin
-typedef struct Deque {
-    int capacity;
-    int size;
-    int head, tail;  // [head,tail)
-    Buffer *items;
-} Deque;
-int sizeof_shm_deque(int queue_size) {
-    return sizeof(Deque) + sizeof(Buffer) * queue_size;
-}
-int update_shm_deque(Deque *q) {
-    q->items = (Buffer *)((char *)q + sizeof(Deque));
+// Slot begin
+// Fragments are downloaded straight into a Buffer slot of shared memory.
+// A producer reserves a free slot, curl writes into it, and committing it
+// queues only the slot index; consumers never copy the data. Free slot
+// indices and committed ones travel through two lock-free MPMC_RINGs of
+// ints, see mpmc_ring.h. A consumer releases the slot as soon as the
+// fragment is decoded into the Frame.
+int slot_reserve(void);
+void slot_commit(int slot);
+void slot_release(int slot);
+// Slot end
+
+// Transfer begin
+// One producer drives up to `transfers` fragments at once through a
+// curl_multi handle; each keeps its easy handle for the whole run. A
+// failed download is retried after a jittered backoff on the next
+// server. A download slower than the p95 of all downloads so far gets a
+// hedge: the same fragment from another server on one of `transfers`
+// spare handles, and whichever copy completes first is kept.
+#define TR_IDLE 0
+#define TR_RUNNING 1
+#define TR_WAITING 2  // backing off before a retry
+typedef struct Transfer {
+    CURL *curl;
+    int state;
+    int slot;      // slot being downloaded into, -1 when not running
+    int task;      // fragment number, 1 based
+    int server;    // 0 .. N_SERVERS - 1
+    int attempt;   // retries of task so far
+    int peer;      // transfer racing this one for task, -1 if none
+    int hedged;    // task already has had a hedge
+    double start;  // ms, when the request was sent
+    double due;    // ms, TR_WAITING: when to retry
+} Transfer;
+// Transfer end
+
+// Latency begin
+// Download times of every producer, in buckets growing by 2^(1/4) from
+// 1 ms, for the hedging threshold.
+typedef struct Latency {
+    U32 n;
+    U32 bucket[LAT_BUCKETS];
+} Latency;
+void latency_add(double ms);
+double latency_p95(void);
+// Latency end
+
+// Frame begin
+// The decoded image. Every fragment is a horizontal strip of the same
+// size, so the raw scanlines (filter byte + pixels per row) of fragment seq
+// go at seq * strip_len of one block in p_arena. The first consumer to
+// decode a fragment sets the geometry, the rest check against it.
+// Because strips stack vertically, the main process deflates and writes
+// fragment k as soon as fragments 0..k are all decoded, following the
+// contiguous prefix as it grows.
+#define FRAME_EMPTY 0
+#define FRAME_INIT 1   // geometry being set up
+#define FRAME_READY 2
+#define FRAME_BAD 3    // no room for the raw image
+typedef struct Frame {
+    int state;
+    int n_done;        // fragments decoded into place, futex word
+    int done[TOTAL_PART];  // fragment seq decoded
+    int watermark;     // fragments 0..watermark-1 are written to all.png
+    U32 width;
+    U32 strip_height;  // rows per fragment
+    U8 bit_depth;
+    U8 color_type;
+    U32 strip_len;     // raw bytes per fragment
+    U32 off;           // raw image block in p_arena
+    U32 cap;
+} Frame;
+int frame_setup(const PNG_HEAD *h);
+int frame_decode(Buffer *p_buf, ZS_STREAM *zs);
+void frame_fail(void);
+int frame_stream_png(const char *path);
+// Frame end
+
+// global variables
+int producers, consumers, queue_size, random_wait, pic_number;
+int use_threads;  // --threads: pthreads in this process instead of fork()
+int transfers = 1;  // --transfers: downloads in flight per producer
+int n_slots;  // enough that slot_reserve() never waits on a consumer
+CURLSH *curl_share;  // --threads: DNS and TLS session cache of all producers
+pthread_mutex_t curl_share_lock[CURL_LOCK_DATA_LAST];
+pthread_t *tids;  // --threads: producers, then consumers
+pid_t prod_pids[MAX_PRODUCER];  // forked producers
+pid_t cons_pids[MAX_CONSUMER];  // forked consumers, 0 once reaped
+int cons_states[MAX_CONSUMER];
+// shared memory variables, mapped by main before the fork
+int *p_now_downloaded;
+sem_t *p_sem_get_task, *p_sem_need_consume;
+MPMC_RING *p_queue;
+MPMC_RING *p_free;
+Buffer *p_slots;
+Frame *p_frame;
+Latency *p_latency;
+SHM_ARENA *p_arena;
+__thread SHM_ARENA_CACHE arena_cache;  // blocks this worker freed
+
+/**
+ * @brief new zeroed memory every producer and consumer can use: a System V
+ *        segment attached here in process mode, private anonymous memory in
+ *        --threads mode. Pages are only backed once touched.
+ *        The segment is marked for removal as soon as it is attached. Forked
+ *        children inherit the attachment and the kernel frees the segment
+ *        when the last of them exits, so nothing is left for clean_ipcs.sh
+ *        even after an abort().
+ * @param size size_t bytes
+ */
+void *shared_map(size_t size) {
+    void *p;
+    int id;
+
+    if (use_threads) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        LOG_ABORT(p == MAP_FAILED);
+        return p;
+    }
+    NEWSHM(id, IPC_PRIVATE, size,
+           IPC_CREAT | IPC_EXCL | SHM_NORESERVE | S_IRUSR | S_IWUSR);
+    p = shmat(id, NULL, 0);
+    LOG_ABORT(p == (void *)-1);
+    LOG_ABORT(shmctl(id, IPC_RMID, NULL));
+    return p;
+}
+
+void curl_share_lock_cb(CURL *handle, curl_lock_data data,
+                        curl_lock_access access, void *userptr) {
+    pthread_mutex_lock(&curl_share_lock[data]);
+}
+
+void curl_share_unlock_cb(CURL *handle, curl_lock_data data, void *userptr) {
+    pthread_mutex_unlock(&curl_share_lock[data]);
+}
+
+/**
+ * @brief one CURLSH for all producer threads, so they resolve the server
+ *        and resume TLS sessions once; connections stay per handle, libcurl
+ *        does not support sharing them between concurrent threads
+ */
+CURLSH *curl_share_new(void) {
+    CURLSH *share = curl_share_init();
+    int i;
+
+    LOG_ABORT(share == NULL);
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&curl_share_lock[i], NULL);
+    }
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, curl_share_lock_cb);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, curl_share_unlock_cb);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    return share;
+}
+
+int gen_url(char *res_url, int part, int server) {
+    char base[URL_LEN];
+
+    snprintf(base, URL_LEN, IMG_URL_BASE, server + 1);
+    if (snprintf(res_url, URL_LEN, "%simg=%d&part=%d", base, pic_number,
+                 part) < 0)
+        return -1;
     return 0;
 }
-int init_shm_deque(Deque *q, int queue_size) {
-    if (q == NULL || queue_size == 0) {
+
+/**
+ * @brief make the data block of p_buf hold at least len bytes, moving the
+ *        bytes received so far to a larger size class when needed
+ * @return 0 on success, 1 when len is over SHM_ARENA_MAX or p_arena is full
+ */
+int buffer_reserve(Buffer *p_buf, size_t len) {
+    U32 off, cap;
+
+    if (len <= p_buf->cap) {
+        return 0;
+    }
+    if (len < 2 * (size_t)p_buf->cap) {
+        len = 2 * (size_t)p_buf->cap;  // grow geometrically while streaming
+    }
+    if (len > SHM_ARENA_MAX) {
         return 1;
     }
-    q->capacity = queue_size;
-    q->size = 0;
-    q->head = 0;
-    q->tail = 0;
-    update_shm_deque(q);
+    off = shm_arena_alloc(p_arena, &arena_cache, len, &cap);
+    if (off == SHM_ARENA_NIL) {
+        return 1;
+    }
+    if (p_buf->size > 0) {
+        memcpy(shm_arena_ptr(p_arena, off),
+               shm_arena_ptr(p_arena, p_buf->off), p_buf->size);
+    }
+    buffer_free(p_buf);
+    p_buf->off = off;
+    p_buf->cap = cap;
     return 0;
 }
-// sem_slots and sem_exists to ensure the operate valid
-/*
-int deque_full(Deque *q) {
-    LOG_ABORT(q == NULL);
-    return (q->size == q->capacity);
-}
-int deque_empty(Deque *q) {
-    LOG_ABORT(q == NULL);
-    return (q->size == 0);
-}*/
-int deque_push_back(Deque *q, Buffer *item) {
-    LOG_ABORT(q == NULL);
-    // LOG_ABORT(deque_full(q));
-    // q->size++;
-    q->items[q->tail++] = *item;
-    if (q->tail >= q->capacity) q->tail -= q->capacity;
-    return 0;
+
+/**
+ * @brief give the data block of p_buf back to the arena
+ */
+void buffer_free(Buffer *p_buf) {
+    if (p_buf->off != SHM_ARENA_NIL) {
+        shm_arena_free(p_arena, &arena_cache, p_buf->off, p_buf->cap);
+    }
+    p_buf->off = SHM_ARENA_NIL;
+    p_buf->cap = 0;
 }
-int deque_pop_front(Deque *q, Buffer *item) {
-    LOG_ABORT(q == NULL);
-    // LOG_ABORT(deque_empty(q));
-    // q->size--;
-    *item = q->items[q->head++];
-    if (q->head >= q->capacity) q->head -= q->capacity;
-    return 0;
+
+/**
+ * @brief take a free slot, waiting while all of them are in use
+ * @return slot index into p_slots, emptied
+ */
+int slot_reserve(void) {
+    int slot;
+    mpmc_pop(p_free, &slot);
+    buffer_init(&p_slots[slot]);
+    return slot;
 }
-// Deque end
 
-// global variables
-int producers, consumers, queue_size, random_wait, pic_number;
-// id of shared memory variables
-int si_now_downloaded;
-int si_sem_get_task, si_sem_need_consume, si_sem_push, si_sem_pop,
-        si_sem_exists, si_sem_slots;
-int si_queue;
-int si_buf_all;
-// shared memory variables
-int *p_now_downloaded;
-sem_t *p_sem_get_task, *p_sem_need_consume, *p_sem_push, *p_sem_pop,
-        *p_sem_exists, *p_sem_slots;
-Deque *p_queue;
-Buffer *p_buf_all;
+/**
+ * @brief hand a filled slot to the consumers, waiting while the queue is
+ *        full; only the index is copied
+ */
+void slot_commit(int slot) {
+    mpmc_push(p_queue, &slot);
+}
 
-int gen_url(char *res_url, int part) {
-    if (snprintf(res_url, URL_LEN, "%simg=%d&part=%d", IMG_URL_BASE, pic_number,
-                 part) < 0)
-        return -1;
-    return 0;
+/**
+ * @brief give a slot and its data block back once the data is no longer
+ *        needed
+ */
+void slot_release(int slot) {
+    buffer_free(&p_slots[slot]);
+    mpmc_push(p_free, &slot);
 }
 
 size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata);
@@ -177,6 +358,16 @@ size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb,
         strncmp(p_recv, ECE252_HEADER, strlen(ECE252_HEADER)) == 0) {
         /* extract img sequence number */
         p_recv_buf->seq = atoi(p_recv + strlen(ECE252_HEADER));
+    } else if (realsize > strlen(CONTENT_LENGTH) &&
+               strncasecmp(p_recv, CONTENT_LENGTH,
+                           strlen(CONTENT_LENGTH)) == 0) {
+        /* size the data block once up front when the server says how big */
+        if (buffer_reserve(p_recv_buf,
+                           strtoul(p_recv + strlen(CONTENT_LENGTH), NULL,
+                                   10))) {
+            fprintf(stderr, "header_cb_curl: no room for fragment\n");
+            return 0;
+        }
     }
     return realsize;
 }
@@ -194,8 +385,14 @@ size_t write_cb_curl(char *p_recv, size_t size, size_t nmemb,
                      void *p_userdata) {
     size_t realsize = size * nmemb;
     struct Buffer *p_recv_buf = (struct Buffer *)p_userdata;
-    // LOG_ABORT(p_recv_buf->size + realsize > BUF_SIZE);
-    memcpy(p_recv_buf->buf + p_recv_buf->size, p_recv, realsize);
+
+    if (buffer_reserve(p_recv_buf, p_recv_buf->size + realsize)) {
+        fprintf(stderr, "write_cb_curl: no room for fragment\n");
+        return 0;  // makes curl_easy_perform() fail with CURLE_WRITE_ERROR
+    }
+    memcpy((char *)shm_arena_ptr(p_arena, p_recv_buf->off) +
+               p_recv_buf->size,
+           p_recv, realsize);
     p_recv_buf->size += realsize;
     return realsize;
 }
@@ -233,133 +430,745 @@ int write_file(const char *path, const void *in, size_t len) {
     return fclose(fp);
 }
 
-int producer(int id) {
-    int now_task = 0;
+/**
+ * @brief claim the next fragment to download
+ * @return fragment number, 1 based, 0 once every fragment is claimed
+ */
+int next_task(void) {
+    int now_task;
+
+    LOG_ABORT(sem_wait(p_sem_get_task));
+    if (*p_now_downloaded == TOTAL_PART) {
+        now_task = 0;
+    } else {
+        (*p_now_downloaded)++;
+        now_task = *p_now_downloaded;
+    }
+    LOG_ABORT(sem_post(p_sem_get_task));
+    return now_task;
+}
+
+/* wall clock in ms, for download latencies and retry deadlines */
+double now_ms(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000. + tv.tv_usec / 1000.;
+}
+
+/**
+ * @brief record one successful download time for every producer to see
+ */
+void latency_add(double ms) {
+    double bound = 1.;
+    int b = 0;
+
+    while (bound < ms && b < LAT_BUCKETS - 1) {
+        bound *= LAT_STEP;
+        b++;
+    }
+    __atomic_add_fetch(&p_latency->bucket[b], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&p_latency->n, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 95th percentile download time so far, rounded up to its bucket
+ * @return ms, 0 until HEDGE_MIN_SAMPLES downloads have finished
+ */
+double latency_p95(void) {
+    U32 n = __atomic_load_n(&p_latency->n, __ATOMIC_RELAXED);
+    U32 seen = 0;
+    double bound = 1.;
+    int b;
+
+    if (n < HEDGE_MIN_SAMPLES) {
+        return 0;
+    }
+    for (b = 0; b < LAT_BUCKETS - 1; b++, bound *= LAT_STEP) {
+        seen += __atomic_load_n(&p_latency->bucket[b], __ATOMIC_RELAXED);
+        if (seen * 100 >= n * 95) {
+            break;
+        }
+    }
+    return bound;
+}
+
+/**
+ * @brief an easy handle set up once and reused for every fragment it
+ *        downloads, so it keeps its connection alive between them
+ */
+CURL *transfer_new(Transfer *p_tr) {
+    CURL *curl_handle = curl_easy_init();
+
+    LOG_ABORT(curl_handle == NULL);
+    memset(p_tr, 0, sizeof(*p_tr));
+    p_tr->curl = curl_handle;
+    p_tr->state = TR_IDLE;
+    p_tr->slot = -1;
+    p_tr->peer = -1;
+    /* register write call back function to process received data */
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_cb_curl);
+    /* register header call back function to process received header data */
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, header_cb_curl);
+    /* some servers requires a user-agent field */
+    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+    /* a stuck server costs a retry, not the whole run */
+    curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT_MS,
+                     (long)CONNECT_TIMEOUT_MS);
+    curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT_MS, (long)TOTAL_TIMEOUT_MS);
+    /* find the Transfer again when curl_multi reports it done */
+    curl_easy_setopt(curl_handle, CURLOPT_PRIVATE, p_tr);
+    if (curl_share != NULL) {
+        curl_easy_setopt(curl_handle, CURLOPT_SHARE, curl_share);
+    }
+    return curl_handle;
+}
+
+/**
+ * @brief start downloading fragment task from server into a newly
+ *        reserved shared slot
+ */
+void transfer_start(CURLM *multi_handle, Transfer *p_tr, int task,
+                    int server) {
     char url[URL_LEN];
-    CURL *curl_handle;
-    CURLcode res;
+    Buffer *p_recv_buf;
+
+    LOG_ABORT(gen_url(url, task - 1, server));
+    p_tr->task = task;
+    p_tr->server = server;
+    p_tr->slot = slot_reserve();
+    p_tr->start = now_ms();
+    p_tr->state = TR_RUNNING;
+    p_recv_buf = &p_slots[p_tr->slot];
+    /* specify URL to get */
+    curl_easy_setopt(p_tr->curl, CURLOPT_URL, url);
+    /* user defined data structure passed to the call back functions */
+    curl_easy_setopt(p_tr->curl, CURLOPT_WRITEDATA, (void *)p_recv_buf);
+    curl_easy_setopt(p_tr->curl, CURLOPT_HEADERDATA, (void *)p_recv_buf);
+    LOG_ABORT(curl_multi_add_handle(multi_handle, p_tr->curl));
+}
+
+/**
+ * @brief stop a running transfer, dropping whatever it received
+ */
+void transfer_stop(CURLM *multi_handle, Transfer *p_tr) {
+    curl_multi_remove_handle(multi_handle, p_tr->curl);
+    slot_release(p_tr->slot);
+    p_tr->slot = -1;
+    p_tr->state = TR_IDLE;
+    p_tr->peer = -1;
+}
+
+/**
+ * @brief 1 if a finished transfer brought back a whole fragment
+ */
+int transfer_ok(Transfer *p_tr, CURLcode res) {
+    Buffer *p_recv_buf = &p_slots[p_tr->slot];
+    long code = 0;
+
+    curl_easy_getinfo(p_tr->curl, CURLINFO_RESPONSE_CODE, &code);
+    return res == CURLE_OK && code == 200 && p_recv_buf->seq == p_tr->task - 1;
+}
+
+/**
+ * @brief say why a transfer failed: the curl error, else the HTTP status,
+ *        else the fragment that came back instead of the one asked for
+ */
+void transfer_log_fail(int id, Transfer *p_tr, CURLcode res) {
+    long code = 0;
+
+    printf("Producer ID[%d]: task[%d] server[%d] failed: ", id, p_tr->task,
+           p_tr->server + 1);
+    curl_easy_getinfo(p_tr->curl, CURLINFO_RESPONSE_CODE, &code);
+    if (res != CURLE_OK) {
+        printf("%s\n", curl_easy_strerror(res));
+    } else if (code != 200) {
+        printf("HTTP %ld\n", code);
+    } else {
+        printf("got seq[%d]\n", p_slots[p_tr->slot].seq);
+    }
+}
+
+/**
+ * @brief schedule another attempt at a failed fragment after a jittered
+ *        exponential backoff, on the next server
+ * @return 0, or 1 once the fragment has used up MAX_RETRY retries
+ */
+int transfer_retry(Transfer *p_tr, unsigned int *p_seed) {
+    double backoff;
+
+    if (p_tr->attempt == MAX_RETRY) {
+        return 1;
+    }
+    backoff = RETRY_BASE_MS * (double)(1 << p_tr->attempt);
+    if (backoff > RETRY_MAX_MS) {
+        backoff = RETRY_MAX_MS;
+    }
+    backoff *= 0.5 + rand_r(p_seed) / (RAND_MAX + 1.);  // 0.5x to 1.5x
+    p_tr->attempt++;
+    p_tr->server = (p_tr->server + 1) % N_SERVERS;
+    p_tr->due = now_ms() + backoff;
+    p_tr->state = TR_WAITING;
+    return 0;
+}
+
+int producer(int id) {
+    int now_task = 1;  // 0 once every fragment is claimed
+    int i, j, running, refill, n_busy = 0, n_msgs, ret = 0;
+    unsigned int seed = getpid() ^ (id << 16);
+    double now, p95, wake;
+    CURLM *multi_handle;
+    CURLMsg *msg;
+    Transfer *trs, *p_tr, *p_peer;
+    Buffer *p_recv_buf;
 
-    Buffer *p_recv_buf = malloc(sizeof(Buffer));
     printf("Producer ID[%d]: init pid[%d] ppid[%d]\n", id, getpid(), getppid());
-    CONNECT(p_sem_get_task, si_sem_get_task, NULL, 0);
-    CONNECT(p_sem_push, si_sem_push, NULL, 0);
-    CONNECT(p_sem_slots, si_sem_slots, NULL, 0);
-    CONNECT(p_sem_exists, si_sem_exists, NULL, 0);
-    CONNECT(p_queue, si_queue, NULL, 0);
-    update_shm_deque(p_queue);
-    while (1) {
-        // init buffer
-        buffer_init(p_recv_buf);
-        // get a task
-        LOG_ABORT(sem_wait(p_sem_get_task));
-        if (*p_now_downloaded == TOTAL_PART) {
-            now_task = 0;
-        } else {
-            (*p_now_downloaded)++;
-            now_task = *p_now_downloaded;
+    multi_handle = curl_multi_init();
+    LOG_ABORT(multi_handle == NULL);
+    // transfers handles for fragments, as many again for their hedges
+    trs = malloc(sizeof(Transfer) * 2 * transfers);
+    LOG_ABORT(trs == NULL);
+    for (i = 0; i < 2 * transfers; i++) {
+        transfer_new(&trs[i]);
+    }
+    while (!ret) {
+        now = now_ms();
+        p95 = latency_p95();
+        wake = now + 1000;
+        for (i = 0; i < 2 * transfers; i++) {
+            p_tr = &trs[i];
+            if (p_tr->state == TR_WAITING && p_tr->due <= now) {
+                // backoff over, try again
+                transfer_start(multi_handle, p_tr, p_tr->task, p_tr->server);
+                printf("Producer ID[%d]: retry task[%d] server[%d]\n", id,
+                       p_tr->task, p_tr->server + 1);
+            } else if (p_tr->state == TR_IDLE && i < transfers && now_task) {
+                // keep up to transfers fragments in flight
+                now_task = next_task();
+                if (!now_task) continue;
+                p_tr->attempt = 0;
+                p_tr->hedged = 0;
+                transfer_start(multi_handle, p_tr, now_task, 0);
+                n_busy++;
+                printf("Producer ID[%d]: run task[%d] slot[%d]\n", id,
+                       now_task, p_tr->slot);
+            } else if (p_tr->state == TR_RUNNING && p95 > 0 &&
+                       !p_tr->hedged && p_tr->peer < 0 &&
+                       now - p_tr->start > p95) {
+                // slower than 95% of downloads: race a copy on another
+                // server, the first whole response wins
+                for (j = transfers; j < 2 * transfers; j++) {
+                    if (trs[j].state == TR_IDLE) break;
+                }
+                if (j == 2 * transfers) continue;
+                p_tr->hedged = trs[j].hedged = 1;
+                p_tr->peer = j;
+                trs[j].peer = i;
+                trs[j].attempt = p_tr->attempt;
+                transfer_start(multi_handle, &trs[j], p_tr->task,
+                               (p_tr->server + 1) % N_SERVERS);
+                printf("Producer ID[%d]: hedge task[%d] server[%d] "
+                       "after %.0f ms\n", id, p_tr->task,
+                       trs[j].server + 1, now - p_tr->start);
+            }
+            if (p_tr->state == TR_WAITING && p_tr->due < wake) {
+                wake = p_tr->due;
+            }
+            if (p_tr->state == TR_RUNNING && p95 > 0 && !p_tr->hedged &&
+                p_tr->start + p95 < wake) {
+                wake = p_tr->start + p95;
+            }
+        }
+        if (n_busy == 0) break;
+        LOG_ABORT(curl_multi_perform(multi_handle, &running));
+        refill = 0;
+        while ((msg = curl_multi_info_read(multi_handle, &n_msgs)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            refill = 1;  // handles freed up, refill before sleeping
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
+                              (char **)&p_tr);
+            if (p_tr->state != TR_RUNNING) continue;  // lost the race
+            p_peer = p_tr->peer >= 0 ? &trs[p_tr->peer] : NULL;
+            if (!transfer_ok(p_tr, msg->data.result)) {
+                transfer_log_fail(id, p_tr, msg->data.result);
+                transfer_stop(multi_handle, p_tr);
+                if (p_peer != NULL) {
+                    p_peer->peer = -1;  // the other copy carries on alone
+                } else if (transfer_retry(p_tr, &seed)) {
+                    printf("Producer ID[%d]: giving up on task[%d]\n", id,
+                           p_tr->task);
+                    ret = 1;
+                }
+                continue;
+            }
+            latency_add(now_ms() - p_tr->start);
+            if (p_peer != NULL) {  // won the race, drop the other copy
+                transfer_stop(multi_handle, p_peer);
+            }
+            curl_multi_remove_handle(multi_handle, p_tr->curl);
+            n_busy--;
+            p_recv_buf = &p_slots[p_tr->slot];
+            printf("Producer ID[%d]: got buffer size[%d] seq[%d]\n", id,
+                   p_recv_buf->size, p_recv_buf->seq);
+            slot_commit(p_tr->slot);  // sleeps only while the queue is full
+            printf("Producer ID[%d]: push buffer seq[%d] slot[%d] to queue\n",
+                   id, p_recv_buf->seq, p_tr->slot);
+            p_tr->slot = -1;
+            p_tr->peer = -1;
+            p_tr->state = TR_IDLE;
+        }
+        if (ret) break;
+        now = now_ms();
+        // sleeps the whole timeout too when every fragment is backing off
+        if (!refill && wake > now) {
+            LOG_ABORT(curl_multi_poll(multi_handle, NULL, 0,
+                                      (int)(wake - now) + 1, NULL));
         }
-        LOG_ABORT(sem_post(p_sem_get_task));
-        if (!now_task) break;
-        LOG_ABORT(gen_url(url, now_task - 1));
-        printf("Producer ID[%d]: run task[%d] url[%s]\n", id, now_task, url);
-        curl_handle = curl_easy_init();
-        LOG_ABORT(curl_handle == NULL);
-        /* specify URL to get */
-        curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-        /* register write call back function to process received data */
-        curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_cb_curl);
-        /* user defined data structure passed to the call back function */
-        curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)p_recv_buf);
-
-        /* register header call back function to process received header data */
-        curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, header_cb_curl);
-        /* user defined data structure passed to the call back function */
-        curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)p_recv_buf);
-
-        /* some servers requires a user-agent field */
-        curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-
-        /* get it! */
-        res = curl_easy_perform(curl_handle);
-
-        LOG_ABORT(res != CURLE_OK);
-        printf("Producer ID[%d]: got buffer size[%d] seq[%d]\n", id,
-               p_recv_buf->size, p_recv_buf->seq);
-	LOG_ABORT(sem_wait(p_sem_push));
-        LOG_ABORT(sem_wait(p_sem_slots));
-        LOG_ABORT(deque_push_back(p_queue, p_recv_buf));
-        printf("Producer ID[%d]: push buffer seq[%d] to queue\n", id,
-               p_recv_buf->seq);
-        LOG_ABORT(sem_post(p_sem_exists));
-        LOG_ABORT(sem_post(p_sem_push));
+    }
+    if (ret) {
+        frame_fail();  // the frame can never be finished now
     }
     /* cleaning up */
-    curl_easy_cleanup(curl_handle);
-    curl_global_cleanup();
-    DETACH(p_sem_get_task)
-    DETACH(p_sem_push);
-    DETACH(p_sem_slots);
-    DETACH(p_sem_exists);
-    DETACH(p_queue);
+    for (i = 0; i < 2 * transfers; i++) {
+        if (trs[i].state == TR_RUNNING) {
+            transfer_stop(multi_handle, &trs[i]);
+        }
+        curl_easy_cleanup(trs[i].curl);
+    }
+    free(trs);
+    curl_multi_cleanup(multi_handle);
+    if (!use_threads) {
+        curl_global_cleanup();  // main does it once for the threads
+    }
+    shm_arena_cache_flush(p_arena, &arena_cache);
     printf("Producer ID[%d]: exit\n", id);
+    return ret;
+}
+
+/* bytes per pixel times 8 for an IHDR color type, 0 if unknown */
+static int color_bits(U8 color_type, U8 bit_depth) {
+    switch (color_type) {
+        case 0:
+        case 3:
+            return bit_depth;      // gray, palette index
+        case 2:
+            return 3 * bit_depth;  // RGB
+        case 4:
+            return 2 * bit_depth;  // gray + alpha
+        case 6:
+            return 4 * bit_depth;  // RGBA
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief set up the Frame from the first decoded fragment's IHDR, or wait
+ *        for whoever is doing it, then check h has the same geometry
+ * @return 0 if fragment h fits the frame, 1 otherwise
+ */
+int frame_setup(const PNG_HEAD *h) {
+    int state = FRAME_EMPTY;
+    U64 strip_len, row_len;
+    U32 off, cap;
+
+    if (__atomic_compare_exchange_n(&p_frame->state, &state, FRAME_INIT, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        row_len = ((U64)h->width * color_bits(h->color_type, h->bit_depth) +
+                   7) / 8 + 1;
+        strip_len = row_len * h->height;
+        off = SHM_ARENA_NIL;
+        if (color_bits(h->color_type, h->bit_depth) && !h->interlace &&
+            strip_len * TOTAL_PART <= SHM_ARENA_MAX) {
+            off = shm_arena_alloc(p_arena, NULL, strip_len * TOTAL_PART,
+                                  &cap);
+        }
+        if (off == SHM_ARENA_NIL) {
+            fprintf(stderr, "frame_setup: cannot hold %d fragments of %ux%u\n",
+                   TOTAL_PART, h->width, h->height);
+            __atomic_store_n(&p_frame->state, FRAME_BAD, __ATOMIC_RELEASE);
+            return 1;
+        }
+        p_frame->width = h->width;
+        p_frame->strip_height = h->height;
+        p_frame->bit_depth = h->bit_depth;
+        p_frame->color_type = h->color_type;
+        p_frame->strip_len = strip_len;
+        p_frame->off = off;
+        p_frame->cap = cap;
+        __atomic_store_n(&p_frame->state, FRAME_READY, __ATOMIC_RELEASE);
+        return 0;
+    }
+    while ((state = __atomic_load_n(&p_frame->state, __ATOMIC_ACQUIRE)) ==
+           FRAME_INIT) {
+        sched_yield();  // one allocation, not worth a futex
+    }
+    return state != FRAME_READY || h->width != p_frame->width ||
+           h->height != p_frame->strip_height ||
+           h->bit_depth != p_frame->bit_depth ||
+           h->color_type != p_frame->color_type || h->interlace;
+}
+
+/**
+ * @brief check every chunk CRC of a downloaded fragment and inflate its
+ *        IDAT stream straight into the fragment's rows of the Frame
+ * @return 0 on success, 1 if the fragment is bad or does not fit
+ */
+int frame_decode(Buffer *p_buf, ZS_STREAM *zs) {
+    U8 *buf = shm_arena_ptr(p_arena, p_buf->off);
+    PNG_HEAD h;
+    PNG_VIEW pv;
+    CHUNK_VIEW bad;
+    U64 len;
+    int ret;
+
+    if (p_buf->seq < 0 || p_buf->seq >= TOTAL_PART ||
+        p_buf->off == SHM_ARENA_NIL ||
+        png_head_parse(&h, buf, p_buf->size) != PNG_OK) {
+        fprintf(stderr, "frame_decode: seq[%d] is not a PNG\n", p_buf->seq);
+        return 1;
+    }
+    ret = png_view_parse(&pv, buf, p_buf->size, 1, &bad);
+    if (ret == PNG_BAD_CRC) {
+        fprintf(stderr, "frame_decode: seq[%d] %.4s chunk CRC mismatch\n",
+                p_buf->seq, bad.type);
+    }
+    if (ret != PNG_OK || pv.n_idat == 0 || frame_setup(&h)) {
+        png_view_cleanup(&pv);
+        fprintf(stderr, "frame_decode: seq[%d] bad fragment\n", p_buf->seq);
+        return 1;
+    }
+    ret = png_view_inflate(&pv, zs,
+                           (U8 *)shm_arena_ptr(p_arena, p_frame->off) +
+                                   (U64)p_buf->seq * p_frame->strip_len,
+                           p_frame->strip_len, &len);
+    png_view_cleanup(&pv);
+    if (ret != Z_OK || len != p_frame->strip_len) {
+        fprintf(stderr,
+                "frame_decode: seq[%d] IDAT does not inflate to %u bytes\n",
+                p_buf->seq, p_frame->strip_len);
+        return 1;
+    }
+    __atomic_store_n(&p_frame->done[p_buf->seq], 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&p_frame->n_done, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &p_frame->n_done, FUTEX_WAKE, 1, NULL, NULL, 0);
     return 0;
 }
 
+/**
+ * @brief tell the writer in the main process no more fragments will come
+ */
+void frame_fail(void) {
+    __atomic_store_n(&p_frame->state, FRAME_BAD, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&p_frame->n_done, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &p_frame->n_done, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* append one chunk to fp, CRC over type and data */
+static int write_chunk(FILE *fp, const char *type, const U8 *data, U32 len) {
+    U32 net_len = htonl(len);
+    U32 net_crc;
+    unsigned long c;
+
+    c = update_crc(0xffffffffL, (unsigned char *)type, 4);
+    c = update_crc(c, (unsigned char *)data, len) ^ 0xffffffffL;
+    net_crc = htonl((U32)c);
+    if (fwrite(&net_len, 4, 1, fp) != 1 || fwrite(type, 4, 1, fp) != 1 ||
+        (len && fwrite(data, len, 1, fp) != 1) ||
+        fwrite(&net_crc, 4, 1, fp) != 1) {
+        return 1;
+    }
+    return 0;
+}
+
+/* deflate src into out, writing an IDAT chunk each time out fills up and
+ * once more at the end of the stream */
+static int idat_feed(ZS_STREAM *zs, FILE *fp, U8 *src, U64 len, int flush,
+                     U8 *out, U64 *out_len) {
+    U64 used, n;
+    int ret;
+
+    do {
+        ret = zs_run(zs, src, len, &used, out + *out_len, IDAT_BUF - *out_len,
+                     &n, flush);
+        src += used;
+        len -= used;
+        *out_len += n;
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            return ret;
+        }
+        if (*out_len == IDAT_BUF || (ret == Z_STREAM_END && *out_len)) {
+            if (write_chunk(fp, "IDAT", out, *out_len)) {
+                return Z_ERRNO;
+            }
+            *out_len = 0;
+        }
+    } while (ret == Z_OK && (len > 0 || flush == Z_FINISH));
+    return Z_OK;
+}
+
+/**
+ * @brief 1 once no consumer is left that could decode another fragment.
+ *        A consumer thread cannot die alone, so only forked consumers are
+ *        checked; they are reaped here and marked with pid 0.
+ */
+int consumers_gone(void) {
+    int i, gone = 1;
+
+    for (i = 0; i < consumers; i++) {
+        if (cons_pids[i] > 0 &&
+            waitpid(cons_pids[i], &cons_states[i], WNOHANG) == 0) {
+            gone = 0;
+        } else if (cons_pids[i] > 0) {
+            cons_pids[i] = 0;
+        }
+    }
+    return !use_threads && gone;
+}
+
+/**
+ * @brief write all.png while the consumers are still decoding: IHDR once
+ *        the first fragment gives the geometry, then every fragment of the
+ *        contiguous prefix is deflated and written as it completes, as a
+ *        series of IDAT chunks of one zlib stream. Nothing is patched
+ *        afterwards; the height is known up front since every strip has
+ *        the same height.
+ * @return 0 on success
+ */
+int frame_stream_png(const char *path) {
+    struct timespec tmo = {0, 100 * 1000 * 1000};
+    U8 ihdr[DATA_IHDR_SIZE];
+    U8 *raw, *out;
+    U64 out_len = 0;
+    ZS_STREAM zs;
+    FILE *fp;
+    int seen, k, ret = 0;
+
+    out = malloc(IDAT_BUF);
+    fp = fopen(path, "wb");
+    if (out == NULL || fp == NULL) {
+        perror("frame_stream_png");
+        free(out);
+        return 1;
+    }
+    if ((ret = zs_def_init(&zs, Z_BEST_COMPRESSION))) {
+        zerr(ret);
+        free(out);
+        fclose(fp);
+        return 1;
+    }
+    for (k = -1; k < TOTAL_PART; k++) {  // k == -1: the header
+        // sleep until fragment k (or any fragment, for the header) is in
+        for (;;) {
+            seen = __atomic_load_n(&p_frame->n_done, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&p_frame->state, __ATOMIC_ACQUIRE) ==
+                FRAME_BAD) {
+                ret = 1;
+                break;
+            }
+            if (k < 0 ? __atomic_load_n(&p_frame->state, __ATOMIC_ACQUIRE) ==
+                                FRAME_READY
+                      : __atomic_load_n(&p_frame->done[k], __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            if (syscall(SYS_futex, &p_frame->n_done, FUTEX_WAIT, seen, &tmo,
+                        NULL, 0) != 0 &&
+                errno == ETIMEDOUT && consumers_gone()) {
+                ret = 1;  // some consumer died without a word
+                break;
+            }
+        }
+        if (ret) {
+            if (__atomic_load_n(&p_frame->state, __ATOMIC_ACQUIRE) ==
+                FRAME_BAD) {
+                printf("frame_stream_png: a fragment is bad, stopped at "
+                       "fragment %d\n", k < 0 ? 0 : k);
+            } else {
+                printf("frame_stream_png: fragment %d never arrived\n",
+                       k < 0 ? 0 : k);
+            }
+            break;
+        }
+        if (k < 0) {
+            U32 width = htonl(p_frame->width);
+            U32 height = htonl(p_frame->strip_height * TOTAL_PART);
+            U8 png_header[8] = {0x89, 0x50, 0x4E, 0x47,
+                                0x0D, 0x0A, 0x1A, 0x0A};
+            memcpy(ihdr, &width, 4);
+            memcpy(ihdr + 4, &height, 4);
+            ihdr[8] = p_frame->bit_depth;
+            ihdr[9] = p_frame->color_type;
+            ihdr[10] = ihdr[11] = ihdr[12] = 0;  // deflate, filter 0, no Adam7
+            if (fwrite(png_header, 8, 1, fp) != 1 ||
+                write_chunk(fp, "IHDR", ihdr, DATA_IHDR_SIZE)) {
+                ret = 1;
+                break;
+            }
+            raw = shm_arena_ptr(p_arena, p_frame->off);
+            continue;
+        }
+        ret = idat_feed(&zs, fp, raw + (U64)k * p_frame->strip_len,
+                        p_frame->strip_len,
+                        k == TOTAL_PART - 1 ? Z_FINISH : Z_NO_FLUSH, out,
+                        &out_len);
+        if (ret) {
+            zerr(ret);
+            break;
+        }
+        p_frame->watermark = k + 1;
+    }
+    if (ret == 0 && write_chunk(fp, "IEND", NULL, 0)) {
+        ret = 1;
+    }
+    zs_end(&zs);
+    free(out);
+    if (fclose(fp) != 0) {
+        ret = 1;
+    }
+    return ret;
+}
+
 int consumer(int id) {
-    CONNECT(p_sem_need_consume, si_sem_need_consume, NULL, 0);
-    CONNECT(p_sem_pop, si_sem_pop, NULL, 0);
-    CONNECT(p_sem_slots, si_sem_slots, NULL, 0);
-    CONNECT(p_sem_exists, si_sem_exists, NULL, 0);
-    CONNECT(p_queue, si_queue, NULL, 0);
-    update_shm_deque(p_queue);
-    CONNECT(p_buf_all, si_buf_all, NULL, 0);
 
-    Buffer *p_buf = (Buffer *)malloc(sizeof(Buffer));
+    Buffer *p_buf;
+    int slot, ret = 0;
+    ZS_STREAM zs;  // one inflate state, reset for every fragment
 
+    LOG_ABORT(zs_inf_init(&zs));
     printf("Consumer ID[%d]: init pid[%d] ppid[%d]\n", id, getpid(), getppid());
-    while (1) { /* get Buffer from queue and concat */
+    while (1) { /* get Buffer from queue and decode it into the frame */
         if (sem_trywait(p_sem_need_consume)) {  // all down
-            return 0;
+            break;
         }
         printf("Consumer ID[%d]: ready to get buffer\n", id);
-        LOG_ABORT(sem_wait(p_sem_pop));
-        LOG_ABORT(sem_wait(p_sem_exists));
-        deque_pop_front(p_queue, p_buf);
-        printf("Consumer ID[%d]: got buffer seq[%d]\n", id, p_buf->seq);
-        LOG_ABORT(sem_post(p_sem_slots));
-        LOG_ABORT(sem_post(p_sem_pop));
-       // usleep(random_wait);
+        mpmc_pop(p_queue, &slot);  // sleeps only while empty
+        p_buf = &p_slots[slot];
+        printf("Consumer ID[%d]: got buffer seq[%d] slot[%d]\n", id,
+               p_buf->seq, slot);
+        usleep(random_wait);
+        if (__atomic_load_n(&p_frame->state, __ATOMIC_ACQUIRE) == FRAME_BAD) {
+            slot_release(slot);  // all.png is lost already
+            ret = 1;
+            break;
+        }
         printf("Consumer ID[%d]: processing buffer seq[%d]\n", id, p_buf->seq);
-        // now have Buffer * p_buf
-        // process downloaded image data and copy the processed data to
-        // a global data structure for generating the concatenated image
-        p_buf_all[p_buf->seq] = *p_buf;
-    }
-    DETACH(p_sem_need_consume);
-    DETACH(p_sem_pop);
-    DETACH(p_sem_slots);
-    DETACH(p_sem_exists);
-    DETACH(p_queue);
-    DETACH(p_buf_all);
+        // now have Buffer * p_buf, in place in shared memory; its rows go
+        // to their final place in the frame and the slot is free again
+        if (frame_decode(p_buf, &zs)) {
+            // main gives up on all.png and reports how far it got
+            frame_fail();
+            fprintf(stderr, "Consumer ID[%d]: bad fragment seq[%d]\n", id,
+                    p_buf->seq);
+            slot_release(slot);
+            ret = 1;
+            break;
+        }
+        slot_release(slot);
+    }
+    zs_end(&zs);
+    shm_arena_cache_flush(p_arena, &arena_cache);
     printf("Consumer ID[%d]: exit\n", id);
-    return 0;
+    return ret;
+}
+
+void *producer_thread(void *arg) {
+    producer((int)(long)arg);
+    return NULL;
+}
+
+void *consumer_thread(void *arg) {
+    consumer((int)(long)arg);
+    return NULL;
+}
+
+/**
+ * @brief --threads mode: run the producers and consumers as threads of
+ *        this process over the same queue, sharing one CURLSH
+ */
+void start_threads(void) {
+    int i;
+
+    tids = malloc(sizeof(pthread_t) * (producers + consumers));
+    LOG_ABORT(tids == NULL);
+    curl_share = curl_share_new();
+    for (i = 0; i < producers; i++) {
+        LOG_ABORT(pthread_create(&tids[i], NULL, producer_thread,
+                                 (void *)(long)i));
+    }
+    for (i = 0; i < consumers; i++) {
+        LOG_ABORT(pthread_create(&tids[producers + i], NULL, consumer_thread,
+                                 (void *)(long)i));
+    }
+}
+
+/**
+ * @brief wait for every thread of start_threads()
+ */
+void join_threads(void) {
+    int i;
+
+    for (i = 0; i < producers + consumers; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    curl_share_cleanup(curl_share);
+    curl_share = NULL;
+    curl_global_cleanup();
+    free(tids);
 }
 
 // make clean && make && ./paster2 10 1 1 3 2
 // make clean && make && ./paster2 10 2 2 3 2
+// make clean && make && ./paster2 --threads 10 2 2 3 2
+// make clean && make && ./paster2 --transfers 8 10 1 2 3 2
 int main(int argc, char **argv) {
+    static struct option long_opts[] = {{"threads", no_argument, NULL, 'T'},
+                                        {"processes", no_argument, NULL, 'P'},
+                                        {"transfers", required_argument, NULL,
+                                         'N'},
+                                        {NULL, 0, NULL, 0}};
+    int c;
     // parse args
+    while ((c = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
+        switch (c) {
+            case 'T':
+                use_threads = 1;
+                break;
+            case 'P':
+                use_threads = 0;
+                break;
+            case 'N':
+                transfers = atoi(optarg);
+                if (transfers < 1) {
+                    printf("invalid parameter\n");
+                    return 0;
+                }
+                break;
+            default:
+                printf("invalid parameter\n");
+                return 0;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
     if (argc == 6) {
         queue_size = atoi(argv[1]);
         producers = atoi(argv[2]);
         consumers = atoi(argv[3]);
         LOG_ABORT(consumers > MAX_CONSUMER);
+        LOG_ABORT(producers > MAX_PRODUCER);
         random_wait = atoi(argv[4]);
         pic_number = atoi(argv[5]);
     } else {
         printf("invalid parameter\n");
         return 0;
     }
+    // a slot for every transfer and hedge in flight, queued fragment and
+    // fragment being decoded; there are never more than the fragments
+    // plus one hedge each
+    n_slots = queue_size + producers * 2 * transfers + consumers;
+    if (n_slots > 2 * TOTAL_PART) {
+        n_slots = 2 * TOTAL_PART;
+    }
     double times[2];
     struct timeval tv;
     if (gettimeofday(&tv, NULL) != 0) {
@@ -367,72 +1176,43 @@ int main(int argc, char **argv) {
         abort();
     }
     times[0] = (tv.tv_sec) + tv.tv_usec / 1000000.;
-    // create shm variables, get shmid
-    NEWSHM(si_now_downloaded, IPC_PRIVATE, sizeof(int),
-           IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    NEWSHM(si_sem_get_task, IPC_PRIVATE, sizeof(sem_t),
-           IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    NEWSHM(si_sem_need_consume, IPC_PRIVATE, sizeof(sem_t),
-           IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    NEWSHM(si_sem_push, IPC_PRIVATE, sizeof(sem_t),
-           IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    NEWSHM(si_sem_pop, IPC_PRIVATE, sizeof(sem_t),
-           IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    NEWSHM(si_sem_exists, IPC_PRIVATE, sizeof(sem_t),
-           IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    NEWSHM(si_sem_slots, IPC_PRIVATE, sizeof(sem_t),
-           IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-
-    NEWSHM(si_queue, IPC_PRIVATE, sizeof_shm_deque(queue_size),
-           IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-
-    NEWSHM(si_buf_all, IPC_PRIVATE, sizeof(Buffer) * TOTAL_PART,
-           IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-
-    // connect shm variables
-    CONNECT(p_now_downloaded, si_now_downloaded, NULL, 0);
-    CONNECT(p_sem_get_task, si_sem_get_task, NULL, 0);
-    CONNECT(p_sem_need_consume, si_sem_need_consume, NULL, 0);
-    CONNECT(p_sem_push, si_sem_push, NULL, 0);
-    CONNECT(p_sem_pop, si_sem_pop, NULL, 0);
-    CONNECT(p_sem_exists, si_sem_exists, NULL, 0);
-    CONNECT(p_sem_slots, si_sem_slots, NULL, 0);
-    CONNECT(p_queue, si_queue, NULL, 0);
-    // CONNECT(p_buf_all, si_buf_all, NULL, 0);
+    // create shm variables, get shmid, connect
+    p_now_downloaded = shared_map(sizeof(int));
+    p_sem_get_task = shared_map(sizeof(sem_t));
+    p_sem_need_consume = shared_map(sizeof(sem_t));
+    p_queue = shared_map(mpmc_ring_size(queue_size, sizeof(int)));
+    p_free = shared_map(mpmc_ring_size(n_slots, sizeof(int)));
+    p_slots = shared_map(sizeof(Buffer) * n_slots);
+    p_frame = shared_map(sizeof(Frame));
+    p_latency = shared_map(sizeof(Latency));
+    p_arena = shared_map(shm_arena_size(ARENA_SIZE));
 
     // init shm variables
     *p_now_downloaded = 0;
     INITSEM(p_sem_get_task, 1);
     INITSEM(p_sem_need_consume, TOTAL_PART);
-    INITSEM(p_sem_push, 1);
-    INITSEM(p_sem_pop, 1);
-    INITSEM(p_sem_exists, 0);
-    INITSEM(p_sem_slots, queue_size);
-    init_shm_deque(p_queue, queue_size);
-
-    // DETACH
-    DETACH(p_now_downloaded);
-    DETACH(p_sem_get_task);
-    DETACH(p_sem_need_consume);
-    DETACH(p_sem_push);
-    DETACH(p_sem_pop);
-    DETACH(p_sem_exists);
-    DETACH(p_sem_slots);
-    DETACH(p_queue);
+    LOG_ABORT(mpmc_ring_init(p_queue, queue_size, sizeof(int)));
+    LOG_ABORT(mpmc_ring_init(p_free, n_slots, sizeof(int)));
+    LOG_ABORT(shm_arena_init(p_arena, ARENA_SIZE));
+    for (int slot = 0; slot < n_slots; slot++) {
+        buffer_init(&p_slots[slot]);
+        slot_release(slot);  // every slot starts free
+    }
 
     // main process
     printf("Main ID[%d]\n", getpid());
     pid_t cpid = 0;
-    // pid_t prod_pids[100];
-    pid_t cons_pids[MAX_CONSUMER];
     // init curl
     curl_global_init(CURL_GLOBAL_ALL);
+    int i, ret;
+    if (use_threads) {
+        start_threads();
+    }
     // fork producers
-    int i;
-    for (i = 0; i < producers; i++) {
+    for (i = 0; i < producers && !use_threads; i++) {
         cpid = fork();
         if (cpid > 0) {
-            // prod_pids[i] = cpid;
+            prod_pids[i] = cpid;
         } else if (cpid == 0) {
             producer(i);
             return 0;
@@ -442,38 +1222,52 @@ int main(int argc, char **argv) {
         }
     }
     // fork consumers
-    for (i = 0; i < consumers; i++) {
+    for (i = 0; i < consumers && !use_threads; i++) {
         cpid = fork();
         if (cpid > 0) {
             cons_pids[i] = cpid;
         } else if (cpid == 0) {
-            consumer(i);
-            return 0;
+            return consumer(i);
         } else {
             perror("fork consumer");
             abort();
         }
     }
-    // now in parent process
-    int state;
-    for (i = 0; i < consumers; i++) {  // wait consumers end
-        waitpid(cons_pids[i], &state, 0);
-        if (WIFEXITED(state)) {
-            printf("Consumer cpid[%d]=%d terminated with state: %d.\n", i,
-                   cons_pids[i], state);
+    // now in parent process: stream all.png out while consumers decode
+    ret = frame_stream_png("all.png");
+    if (ret && use_threads) {
+        // threads waiting for the lost fragment end with the process
+        printf("cannot write all.png, %d of %d fragments written\n",
+               p_frame->watermark, TOTAL_PART);
+        return 1;
+    }
+    for (i = 0; ret && !use_threads && i < producers + consumers; i++) {
+        // a fragment is lost, the rest would wait for it forever
+        cpid = i < producers ? prod_pids[i] : cons_pids[i - producers];
+        if (cpid > 0) {
+            kill(cpid, SIGTERM);
         }
     }
-    // generate the concatenated all.png file
-    CONNECT(p_buf_all, si_buf_all, NULL, 0);
-    char **bufs = (char **)malloc(sizeof(char *) * TOTAL_PART);
-    int *lens = (int *)malloc(sizeof(int) * TOTAL_PART);
-    for (i = 0; i < TOTAL_PART; i++) {
-        bufs[i] = p_buf_all[i].buf;
-        lens[i] = p_buf_all[i].size;
-        printf("%d buf %p size %d\n", i, &bufs[i], lens[i]);
-	usleep(random_wait);
-    }
-    catpng(TOTAL_PART, bufs, lens);
+    if (use_threads) {
+        join_threads();
+    }
+    for (i = 0; i < consumers && !use_threads; i++) {  // wait consumers end
+        if (cons_pids[i] > 0) {
+            waitpid(cons_pids[i], &cons_states[i], 0);
+        }
+        if (WIFEXITED(cons_states[i])) {
+            printf("Consumer cpid[%d] terminated with state: %d.\n", i,
+                   cons_states[i]);
+        }
+    }
+    for (i = 0; i < producers && !use_threads; i++) {  // and producers
+        waitpid(prod_pids[i], NULL, 0);
+    }
+    if (ret) {
+        printf("cannot write all.png, %d of %d fragments written\n",
+               p_frame->watermark, TOTAL_PART);
+        return 1;
+    }
     if (gettimeofday(&tv, NULL) != 0) {
         perror("gettimeofday");
         abort();
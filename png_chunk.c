@@ -0,0 +1,335 @@
+/**
+ * @brief: zero-copy PNG chunk iteration, see png_chunk.h
+ *
+ * Reference: https://www.w3.org/TR/PNG/#5Chunk-layout
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "crc.h"
+#include "png_chunk.h"
+
+static const U8 png_sig[PNG_SIG_LEN] = {0x89, 0x50, 0x4E, 0x47,
+                                        0x0D, 0x0A, 0x1A, 0x0A};
+
+static U32 be32(const U8 *p)
+{
+    return ((U32) p[0] << 24) | ((U32) p[1] << 16) | ((U32) p[2] << 8) | p[3];
+}
+
+/**
+ * @brief: 1 if buf starts with the 8 byte PNG signature
+ */
+int png_has_sig(const U8 *buf, size_t len)
+{
+    return len >= PNG_SIG_LEN && memcmp(buf, png_sig, PNG_SIG_LEN) == 0;
+}
+
+/**
+ * @brief: decode the first PNG_HEAD_LEN bytes of a file: signature plus
+ *         the IHDR chunk, which the spec requires to come first
+ * @return PNG_OK      h is filled in
+ *         PNG_NOT_PNG bad signature, too short, or no IHDR up front
+ *         PNG_BAD_CRC h is filled in but the IHDR CRC does not match
+ */
+int png_head_parse(PNG_HEAD *h, const U8 *buf, size_t len)
+{
+    const U8 *p = buf + PNG_SIG_LEN;
+
+    if (len < PNG_HEAD_LEN || !png_has_sig(buf, len) || be32(p) != 13 ||
+        memcmp(p + 4, "IHDR", 4) != 0) {
+        return PNG_NOT_PNG;
+    }
+    h->width = be32(p + 8);
+    h->height = be32(p + 12);
+    h->bit_depth = p[16];
+    h->color_type = p[17];
+    h->compression = p[18];
+    h->filter = p[19];
+    h->interlace = p[20];
+    h->crc = be32(p + 21);
+    h->crc_calc = crc((unsigned char *) p + 4, 4 + 13);
+    return h->crc == h->crc_calc ? PNG_OK : PNG_BAD_CRC;
+}
+
+/* pread exactly len bytes unless the file ends first */
+static ssize_t pread_full(int fd, U8 *buf, size_t len, off_t off)
+{
+    size_t got = 0;
+    ssize_t n;
+
+    while (got < len) {
+        n = pread(fd, buf + got, len - got, off + got);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        got += n;
+    }
+    return got;
+}
+
+/**
+ * @brief: PNG detection from the header alone, one pread of
+ *         PNG_HEAD_LEN bytes; the rest of the file is never touched
+ * @return as png_head_parse()
+ */
+int png_probe_fd(int fd, PNG_HEAD *h)
+{
+    U8 buf[PNG_HEAD_LEN];
+    ssize_t n = pread_full(fd, buf, PNG_HEAD_LEN, 0);
+
+    if (n < 0) {
+        return PNG_NOT_PNG;
+    }
+    return png_head_parse(h, buf, n);
+}
+
+/**
+ * @brief: walk the chunks after IHDR up to IEND without mapping the file.
+ *         With check_crc every chunk is streamed through a PNG_VERIFY_BUF
+ *         sized buffer for its CRC, so memory use does not depend on the
+ *         file size; without it only the 8 byte chunk headers are read.
+ * @param: fd int file already accepted by png_probe_fd()
+ * @param: check_crc int verify each chunk's CRC
+ * @param: n_chunks int* optional output, chunks seen, IHDR and IEND included
+ * @param: bad_type U8[4] output, on PNG_BAD_CRC: the failing chunk type
+ * @param: bad_crc U32* output, on PNG_BAD_CRC: the stored CRC
+ * @param: bad_calc U32* output, on PNG_BAD_CRC: the computed CRC
+ * @return PNG_OK, PNG_BAD_CRC, PNG_TRUNC or PNG_NO_MEM
+ */
+int png_walk_fd(int fd, int check_crc, int *n_chunks, U8 *bad_type,
+                U32 *bad_crc, U32 *bad_calc)
+{
+    U8 *buf = check_crc ? malloc(PNG_VERIFY_BUF) : NULL;
+    off_t off = PNG_HEAD_LEN;
+    U8 head[8];
+    U8 stored[4];
+    int ret = PNG_TRUNC;
+    int n = 1;  /* IHDR */
+
+    if (check_crc && buf == NULL) {
+        return PNG_NO_MEM;
+    }
+    for (;;) {
+        U32 length, c, left;
+        ssize_t got;
+
+        got = pread_full(fd, head, 8, off);
+        if (got != 8) {
+            break;  /* file ended before IEND */
+        }
+        length = be32(head);
+        if (length > PNG_CHUNK_MAX_LEN) {
+            break;
+        }
+        off += 8;
+        c = update_crc(0xffffffffL, head + 4, 4);
+        for (left = check_crc ? length : 0; left > 0; ) {
+            size_t now = left < PNG_VERIFY_BUF ? left : PNG_VERIFY_BUF;
+            got = pread_full(fd, buf, now, off);
+            if (got != (ssize_t) now) {
+                goto out;
+            }
+            c = update_crc(c, buf, now);
+            off += now;
+            left -= now;
+        }
+        if (!check_crc) {
+            off += length;
+        }
+        c ^= 0xffffffffL;
+        if (pread_full(fd, stored, 4, off) != 4) {
+            break;
+        }
+        off += 4;
+        n++;
+        if (check_crc && be32(stored) != c) {
+            memcpy(bad_type, head + 4, 4);
+            *bad_crc = be32(stored);
+            *bad_calc = c;
+            ret = PNG_BAD_CRC;
+            break;
+        }
+        if (memcmp(head + 4, "IEND", 4) == 0) {
+            ret = PNG_OK;
+            break;
+        }
+    }
+out:
+    if (n_chunks != NULL) {
+        *n_chunks = n;
+    }
+    free(buf);
+    return ret;
+}
+
+/**
+ * @brief: check the CRC of every chunk after IHDR up to IEND, see
+ *         png_walk_fd()
+ * @return PNG_OK, PNG_BAD_CRC, PNG_TRUNC or PNG_NO_MEM
+ */
+int png_verify_fd(int fd, U8 *bad_type, U32 *bad_crc, U32 *bad_calc)
+{
+    return png_walk_fd(fd, 1, NULL, bad_type, bad_crc, bad_calc);
+}
+
+/**
+ * @brief: position an iterator on the first chunk of a PNG file
+ * @return PNG_OK or PNG_NOT_PNG
+ */
+int chunk_iter_init(CHUNK_ITER *it, const U8 *buf, size_t len)
+{
+    it->buf = buf;
+    it->len = len;
+    it->pos = PNG_SIG_LEN;
+    return png_has_sig(buf, len) ? PNG_OK : PNG_NOT_PNG;
+}
+
+/**
+ * @brief: fill ck with a view of the next chunk and step past it
+ * @return PNG_OK    ck is valid
+ *         PNG_END   no bytes left
+ *         PNG_TRUNC the chunk does not fit in the buffer
+ */
+int chunk_iter_next(CHUNK_ITER *it, CHUNK_VIEW *ck)
+{
+    const U8 *p = it->buf + it->pos;
+    size_t left = it->len - it->pos;
+    U32 length;
+
+    if (left == 0) {
+        return PNG_END;
+    }
+    if (left < PNG_CHUNK_OVERHEAD) {
+        return PNG_TRUNC;
+    }
+    length = be32(p);
+    if (length > PNG_CHUNK_MAX_LEN ||
+        (size_t) length > left - PNG_CHUNK_OVERHEAD) {
+        return PNG_TRUNC;
+    }
+    ck->length = length;
+    ck->type = p + 4;
+    ck->p_data = p + 8;
+    ck->crc = be32(p + 8 + length);
+    it->pos += PNG_CHUNK_OVERHEAD + length;
+    return PNG_OK;
+}
+
+/**
+ * @brief: 1 if the chunk has the given 4 letter type
+ */
+int chunk_is(const CHUNK_VIEW *ck, const char *type)
+{
+    return memcmp(ck->type, type, 4) == 0;
+}
+
+/**
+ * @brief: CRC over type and data, type and data are adjacent in the file
+ */
+U32 chunk_calc_crc(const CHUNK_VIEW *ck)
+{
+    return crc((unsigned char *) ck->type, 4 + ck->length);
+}
+
+/**
+ * @brief: walk every chunk of a PNG file, remember IHDR and all IDATs.
+ *         Ancillary chunks (PLTE, gAMA, tEXt, ...) are skipped over.
+ * @param: pv PNG_VIEW* output, release with png_view_cleanup()
+ * @param: buf const U8* whole file
+ * @param: len size_t file length
+ * @param: check_crc int verify every chunk's CRC
+ * @param: bad CHUNK_VIEW* optional, receives the chunk that failed the CRC
+ * @return PNG_OK, PNG_NOT_PNG, PNG_TRUNC, PNG_BAD_CRC or PNG_NO_MEM
+ */
+int png_view_parse(PNG_VIEW *pv, const U8 *buf, size_t len, int check_crc,
+                   CHUNK_VIEW *bad)
+{
+    CHUNK_ITER it;
+    CHUNK_VIEW ck;
+    int ret;
+
+    memset(pv, 0, sizeof(*pv));
+    if (chunk_iter_init(&it, buf, len) != PNG_OK) {
+        return PNG_NOT_PNG;
+    }
+    while ((ret = chunk_iter_next(&it, &ck)) == PNG_OK) {
+        if (pv->n_chunks == 0 &&
+            (!chunk_is(&ck, "IHDR") || ck.length != 13)) {
+            return PNG_NOT_PNG;
+        }
+        pv->n_chunks++;
+        if (check_crc && chunk_calc_crc(&ck) != ck.crc) {
+            if (bad != NULL) {
+                *bad = ck;
+            }
+            return PNG_BAD_CRC;
+        }
+        if (chunk_is(&ck, "IHDR")) {
+            pv->ihdr = ck.p_data;
+        } else if (chunk_is(&ck, "IDAT")) {
+            if (pv->n_idat == pv->max_idat) {
+                int n = pv->max_idat ? pv->max_idat * 2 : 4;
+                CHUNK_VIEW *q = realloc(pv->idat, n * sizeof(CHUNK_VIEW));
+                if (q == NULL) {
+                    return PNG_NO_MEM;
+                }
+                pv->idat = q;
+                pv->max_idat = n;
+            }
+            pv->idat[pv->n_idat++] = ck;
+            pv->idat_len += ck.length;
+        } else if (chunk_is(&ck, "IEND")) {
+            pv->has_iend = 1;
+            break;
+        }
+    }
+    if (ret == PNG_TRUNC) {
+        return PNG_TRUNC;
+    }
+    return pv->n_chunks ? PNG_OK : PNG_NOT_PNG;
+}
+
+void png_view_cleanup(PNG_VIEW *pv)
+{
+    free(pv->idat);
+    pv->idat = NULL;
+    pv->n_idat = 0;
+    pv->max_idat = 0;
+}
+
+/**
+ * @brief: inflate the IDAT spans of pv as the one zlib stream they form
+ * @param: zs ZS_STREAM* inflate state from zs_inf_init(), reset here
+ * @param: dest U8* output buffer, caller supplies
+ * @param: dest_cap U64 size of dest
+ * @param: dest_len U64* output parameter, inflated length
+ * @return Z_OK on a complete stream, a zlib error otherwise
+ */
+int png_view_inflate(PNG_VIEW *pv, ZS_STREAM *zs, U8 *dest, U64 dest_cap,
+                     U64 *dest_len)
+{
+    U64 used, len;
+    int i, ret = Z_OK;
+
+    *dest_len = 0;
+    zs_reset(zs);
+    for (i = 0; i < pv->n_idat && ret == Z_OK; i++) {
+        ret = zs_run(zs, (U8 *) pv->idat[i].p_data, pv->idat[i].length,
+                     &used, dest + *dest_len, dest_cap - *dest_len, &len,
+                     Z_NO_FLUSH);
+        *dest_len += len;
+        if (ret == Z_OK && used != pv->idat[i].length) {
+            ret = Z_BUF_ERROR;  /* dest too small */
+        }
+    }
+    return ret == Z_STREAM_END ? Z_OK : (ret == Z_OK ? Z_DATA_ERROR : ret);
+}
@@ -0,0 +1,84 @@
+/**
+ * @brief: zero-copy PNG chunk iteration over an in-memory file, plus
+ *         header-only probing of files that are not read into memory
+ *
+ * Chunks are returned as views pointing into the caller's buffer (a
+ * malloc'd copy or an mmap of the file), nothing is copied into a
+ * struct chunk. The buffer must outlive the views.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include "zutil.h"
+
+#define PNG_SIG_LEN 8
+#define PNG_CHUNK_OVERHEAD 12     /* length + type + crc */
+#define PNG_CHUNK_MAX_LEN 0x7fffffffU
+#define PNG_HEAD_LEN 33           /* signature + whole IHDR chunk */
+#define PNG_VERIFY_BUF (64 * 1024)
+
+typedef unsigned char U8;
+typedef unsigned int U32;
+
+/* one chunk, all pointers are into the file buffer */
+typedef struct chunk_view {
+    U32 length;          /* data length, host byte order              */
+    const U8 *type;      /* 4 byte chunk type                         */
+    const U8 *p_data;    /* length bytes of chunk data                */
+    U32 crc;             /* CRC stored in the file, host byte order   */
+} CHUNK_VIEW;
+
+typedef struct chunk_iter {
+    const U8 *buf;       /* whole file                                */
+    size_t len;
+    size_t pos;          /* offset of the next chunk                  */
+} CHUNK_ITER;
+
+/* IHDR fields, host byte order */
+typedef struct png_head {
+    U32 width;
+    U32 height;
+    U8 bit_depth;
+    U8 color_type;
+    U8 compression;
+    U8 filter;
+    U8 interlace;
+    U32 crc;             /* stored IHDR CRC                           */
+    U32 crc_calc;        /* IHDR CRC as computed                      */
+} PNG_HEAD;
+
+/* a parsed file: IHDR plus every IDAT span, in file order */
+typedef struct png_view {
+    const U8 *ihdr;      /* 13 bytes of IHDR data                     */
+    CHUNK_VIEW *idat;    /* IDAT chunks, one allocation per file      */
+    int n_idat;
+    int max_idat;
+    U64 idat_len;        /* sum of IDAT lengths = zlib stream length  */
+    int n_chunks;        /* chunks seen, IHDR and IEND included       */
+    int has_iend;
+} PNG_VIEW;
+
+/* chunk_iter_next() / png_view_parse() results */
+#define PNG_OK        0
+#define PNG_END       1   /* chunk_iter_next(): no more chunks          */
+#define PNG_NOT_PNG  -1   /* bad signature or first chunk not IHDR      */
+#define PNG_TRUNC    -2   /* chunk runs past the end of the buffer      */
+#define PNG_BAD_CRC  -3   /* stored CRC does not match                  */
+#define PNG_NO_MEM   -4
+
+int png_has_sig(const U8 *buf, size_t len);
+int png_head_parse(PNG_HEAD *h, const U8 *buf, size_t len);
+int png_probe_fd(int fd, PNG_HEAD *h);
+int png_walk_fd(int fd, int check_crc, int *n_chunks, U8 *bad_type,
+                U32 *bad_crc, U32 *bad_calc);
+int png_verify_fd(int fd, U8 *bad_type, U32 *bad_crc, U32 *bad_calc);
+int chunk_iter_init(CHUNK_ITER *it, const U8 *buf, size_t len);
+int chunk_iter_next(CHUNK_ITER *it, CHUNK_VIEW *ck);
+int chunk_is(const CHUNK_VIEW *ck, const char *type);
+U32 chunk_calc_crc(const CHUNK_VIEW *ck);
+int png_view_parse(PNG_VIEW *pv, const U8 *buf, size_t len, int check_crc,
+                   CHUNK_VIEW *bad);
+void png_view_cleanup(PNG_VIEW *pv);
+int png_view_inflate(PNG_VIEW *pv, ZS_STREAM *zs, U8 *dest, U64 dest_cap,
+                     U64 *dest_len);
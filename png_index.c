@@ -0,0 +1,300 @@
+/**
+ * @brief: persistent index of PNG probe results, see png_index.h
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "png_index.h"
+
+#define PNG_INDEX_SLOTS_INIT 1024
+
+/**
+ * @brief: 64 bit FNV-1a of a path
+ */
+U64 png_index_hash(const char *path)
+{
+    U64 h = 0xcbf29ce484222325UL;
+
+    while (*path) {
+        h ^= (unsigned char) *path++;
+        h *= 0x100000001b3UL;
+    }
+    return h;
+}
+
+/**
+ * @brief: map an index written by png_index_write()
+ * @return 0 on success, 1 if the file is missing or not a valid index;
+ *         ix is then an empty index and png_index_find() finds nothing
+ */
+int png_index_open(PNG_INDEX *ix, const char *path)
+{
+    const PNG_INDEX_HDR *hdr;
+    size_t need;
+
+    memset(ix, 0, sizeof(*ix));
+    if (fmap_open(&ix->map, path) != 0) {
+        memset(&ix->map, 0, sizeof(ix->map));
+        return 1;
+    }
+    hdr = (const PNG_INDEX_HDR *) ix->map.buf;
+    if (ix->map.len < sizeof(*hdr) ||
+        memcmp(hdr->magic, PNG_INDEX_MAGIC, PNG_INDEX_MAGIC_LEN) != 0) {
+        png_index_close(ix);
+        return 1;
+    }
+    need = sizeof(*hdr) + (size_t) hdr->n_recs * sizeof(PNG_INDEX_REC) +
+           hdr->pool_len;
+    if (ix->map.len != need ||
+        (hdr->pool_len > 0 && ix->map.buf[need - 1] != '\0')) {
+        png_index_close(ix);
+        return 1;
+    }
+    ix->recs = (const PNG_INDEX_REC *) (ix->map.buf + sizeof(*hdr));
+    ix->n_recs = hdr->n_recs;
+    ix->pool = (const char *) (ix->recs + ix->n_recs);
+    ix->pool_len = hdr->pool_len;
+    return 0;
+}
+
+void png_index_close(PNG_INDEX *ix)
+{
+    if (ix->map.buf != NULL) {
+        fmap_close(&ix->map);
+    }
+    memset(ix, 0, sizeof(*ix));
+}
+
+/**
+ * @brief: record for path, NULL if it is not in the index
+ */
+const PNG_INDEX_REC *png_index_find(const PNG_INDEX *ix, const char *path)
+{
+    U64 h = png_index_hash(path);
+    U32 lo = 0, hi = ix->n_recs;
+
+    while (lo < hi) {
+        U32 mid = lo + (hi - lo) / 2;
+        if (ix->recs[mid].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; lo < ix->n_recs && ix->recs[lo].hash == h; lo++) {
+        U32 off = ix->recs[lo].path_off;
+        if (off < ix->pool_len && strcmp(ix->pool + off, path) == 0) {
+            return &ix->recs[lo];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @return 0 on success, 1 if out of memory
+ */
+int png_index_build_init(PNG_INDEX_BUILD *b)
+{
+    memset(b, 0, sizeof(*b));
+    b->slots = calloc(PNG_INDEX_SLOTS_INIT, sizeof(U32));
+    if (b->slots == NULL) {
+        return 1;
+    }
+    b->n_slots = PNG_INDEX_SLOTS_INIT;
+    pthread_mutex_init(&b->lock, NULL);
+    return 0;
+}
+
+void png_index_build_cleanup(PNG_INDEX_BUILD *b)
+{
+    pthread_mutex_destroy(&b->lock);
+    free(b->recs);
+    free(b->pool);
+    free(b->slots);
+    memset(b, 0, sizeof(*b));
+}
+
+/* slot holding path, or the empty slot where it would go */
+static U32 build_slot(PNG_INDEX_BUILD *b, U64 h, const char *path)
+{
+    U32 mask = b->n_slots - 1;
+    U32 i = (U32) h & mask;
+
+    while (b->slots[i] != 0) {
+        PNG_INDEX_REC *r = &b->recs[b->slots[i] - 1];
+        if (r->hash == h && strcmp(b->pool + r->path_off, path) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static int build_grow_slots(PNG_INDEX_BUILD *b)
+{
+    U32 n = b->n_slots * 2;
+    U32 *slots = calloc(n, sizeof(U32));
+    U32 i, j;
+
+    if (slots == NULL) {
+        return 1;
+    }
+    for (i = 0; i < b->n_recs; i++) {
+        for (j = (U32) b->recs[i].hash & (n - 1); slots[j] != 0;
+             j = (j + 1) & (n - 1)) {
+        }
+        slots[j] = i + 1;
+    }
+    free(b->slots);
+    b->slots = slots;
+    b->n_slots = n;
+    return 0;
+}
+
+/**
+ * @brief: add or replace the record for path, thread safe. hash and
+ *         path_off of rec are filled in here.
+ * @return 0 on success, 1 if out of memory
+ */
+int png_index_put(PNG_INDEX_BUILD *b, const char *path,
+                  const PNG_INDEX_REC *rec)
+{
+    U64 h = png_index_hash(path);
+    size_t len = strlen(path) + 1;
+    U32 i;
+    int ret = 1;
+
+    pthread_mutex_lock(&b->lock);
+    if ((b->n_recs + 1) * 2 > b->n_slots && build_grow_slots(b) != 0) {
+        goto out;
+    }
+    i = build_slot(b, h, path);
+    if (b->slots[i] != 0) {
+        PNG_INDEX_REC *r = &b->recs[b->slots[i] - 1];
+        U32 off = r->path_off;
+        *r = *rec;
+        r->hash = h;
+        r->path_off = off;
+        ret = 0;
+        goto out;
+    }
+    if (b->n_recs == b->max_recs) {
+        U32 n = b->max_recs ? b->max_recs * 2 : 1024;
+        PNG_INDEX_REC *q = realloc(b->recs, n * sizeof(PNG_INDEX_REC));
+        if (q == NULL) {
+            goto out;
+        }
+        b->recs = q;
+        b->max_recs = n;
+    }
+    while (b->pool_len + len > b->pool_max) {
+        U32 n = b->pool_max ? b->pool_max * 2 : 64 * 1024;
+        char *q = realloc(b->pool, n);
+        if (q == NULL) {
+            goto out;
+        }
+        b->pool = q;
+        b->pool_max = n;
+    }
+    memcpy(b->pool + b->pool_len, path, len);
+    b->recs[b->n_recs] = *rec;
+    b->recs[b->n_recs].hash = h;
+    b->recs[b->n_recs].path_off = b->pool_len;
+    b->pool_len += len;
+    b->slots[i] = ++b->n_recs;
+    ret = 0;
+out:
+    pthread_mutex_unlock(&b->lock);
+    return ret;
+}
+
+/**
+ * @brief: drop path from the index being built, thread safe
+ */
+void png_index_del(PNG_INDEX_BUILD *b, const char *path)
+{
+    U32 i;
+
+    pthread_mutex_lock(&b->lock);
+    i = build_slot(b, png_index_hash(path), path);
+    if (b->slots[i] != 0) {
+        b->recs[b->slots[i] - 1].flags |= PNG_INDEX_DELETED;
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+static int cmp_rec(const void *a, const void *b)
+{
+    const PNG_INDEX_REC *x = a, *y = b;
+    return x->hash < y->hash ? -1 : (x->hash > y->hash);
+}
+
+/**
+ * @brief: write the records to path, replacing it atomically. Deleted
+ *         records and their paths are left out.
+ * @return 0 on success, 1 on error (the old file is left in place)
+ */
+int png_index_write(PNG_INDEX_BUILD *b, const char *path)
+{
+    PNG_INDEX_HDR hdr;
+    PNG_INDEX_REC *recs;
+    U32 *src;            /* builder pool offset of recs[i]'s path      */
+    char *tmp;
+    FILE *fp;
+    U32 i, n = 0, pool_len = 0;
+    int ret = 1;
+
+    pthread_mutex_lock(&b->lock);
+    recs = malloc((b->n_recs ? b->n_recs : 1) * sizeof(PNG_INDEX_REC));
+    src = malloc((b->n_recs ? b->n_recs : 1) * sizeof(U32));
+    tmp = malloc(strlen(path) + 5);
+    if (recs == NULL || src == NULL || tmp == NULL) {
+        goto out;
+    }
+    for (i = 0; i < b->n_recs; i++) {
+        if (!(b->recs[i].flags & PNG_INDEX_DELETED)) {
+            recs[n++] = b->recs[i];
+        }
+    }
+    qsort(recs, n, sizeof(PNG_INDEX_REC), cmp_rec);
+    for (i = 0; i < n; i++) {
+        src[i] = recs[i].path_off;
+        recs[i].path_off = pool_len;
+        pool_len += strlen(b->pool + src[i]) + 1;
+    }
+
+    sprintf(tmp, "%s.tmp", path);
+    fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        perror("fopen");
+        goto out;
+    }
+    memcpy(hdr.magic, PNG_INDEX_MAGIC, PNG_INDEX_MAGIC_LEN);
+    hdr.n_recs = n;
+    hdr.pool_len = pool_len;
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    fwrite(recs, sizeof(PNG_INDEX_REC), n, fp);
+    for (i = 0; i < n; i++) {
+        fwrite(b->pool + src[i], strlen(b->pool + src[i]) + 1, 1, fp);
+    }
+    if (ferror(fp) | fclose(fp)) {
+        perror("fwrite");
+        unlink(tmp);
+        goto out;
+    }
+    if (rename(tmp, path) != 0) {
+        perror("rename");
+        unlink(tmp);
+        goto out;
+    }
+    ret = 0;
+out:
+    pthread_mutex_unlock(&b->lock);
+    free(recs);
+    free(src);
+    free(tmp);
+    return ret;
+}
@@ -0,0 +1,78 @@
+/**
+ * @brief: persistent index of PNG probe results for repeated findpng scans
+ *
+ * On disk the index is a PNG_INDEX_HDR, n_recs PNG_INDEX_REC sorted by
+ * path hash, then a pool of NUL terminated paths. It is mmap'd as is by
+ * the next run (png_index_open), and a lookup is a binary search on the
+ * hash, so loading the index costs nothing per entry. A file whose inode,
+ * size and mtime still match its record is not opened again.
+ *
+ * New results are collected in a PNG_INDEX_BUILD, which can be filled from
+ * several threads and rewrites the file atomically (temp file + rename).
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include "fmap.h"
+
+#define PNG_INDEX_MAGIC "PNGIDX01"
+#define PNG_INDEX_MAGIC_LEN 8
+
+#define PNG_INDEX_IS_PNG  0x1   /* header probe accepted the file      */
+#define PNG_INDEX_DELETED 0x2   /* builder only, never written         */
+
+typedef unsigned int U32;
+typedef unsigned long int U64;
+
+typedef struct png_index_hdr {
+    char magic[PNG_INDEX_MAGIC_LEN];
+    U32 n_recs;
+    U32 pool_len;
+} PNG_INDEX_HDR;
+
+/* one file, 48 bytes on disk */
+typedef struct png_index_rec {
+    U64 hash;            /* FNV-1a of the path, sort key               */
+    U64 ino;
+    U64 size;
+    U64 mtime_ns;
+    U32 width;           /* from IHDR, 0 if not a PNG                  */
+    U32 height;
+    U32 path_off;        /* offset of the path in the pool             */
+    U32 flags;           /* PNG_INDEX_*                                */
+} PNG_INDEX_REC;
+
+/* an index written by an earlier run, read-only */
+typedef struct png_index {
+    FILE_MAP map;
+    const PNG_INDEX_REC *recs;
+    U32 n_recs;
+    const char *pool;
+    U32 pool_len;
+} PNG_INDEX;
+
+/* the index being built by this run */
+typedef struct png_index_build {
+    pthread_mutex_t lock;
+    PNG_INDEX_REC *recs;
+    U32 n_recs;
+    U32 max_recs;
+    char *pool;
+    U32 pool_len;
+    U32 pool_max;
+    U32 *slots;          /* open addressing on hash, rec index + 1     */
+    U32 n_slots;         /* power of 2, at most half full              */
+} PNG_INDEX_BUILD;
+
+U64 png_index_hash(const char *path);
+int png_index_open(PNG_INDEX *ix, const char *path);
+void png_index_close(PNG_INDEX *ix);
+const PNG_INDEX_REC *png_index_find(const PNG_INDEX *ix, const char *path);
+int png_index_build_init(PNG_INDEX_BUILD *b);
+void png_index_build_cleanup(PNG_INDEX_BUILD *b);
+int png_index_put(PNG_INDEX_BUILD *b, const char *path,
+                  const PNG_INDEX_REC *rec);
+void png_index_del(PNG_INDEX_BUILD *b, const char *path);
+int png_index_write(PNG_INDEX_BUILD *b, const char *path);
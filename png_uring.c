@@ -0,0 +1,287 @@
+/**
+ * @brief: batched PNG header probing on io_uring, see png_uring.h
+ *
+ * Reference: io_uring(7), io_uring_setup(2), io_uring_enter(2)
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "png_uring.h"
+
+/* SQEs per file: openat, read, close */
+#define URING_OPS 3
+#define URING_ENTRIES (PNG_URING_BATCH * URING_OPS)
+
+/* user_data: item index * URING_OPS + op */
+#define URING_OP_OPEN  0
+#define URING_OP_READ  1
+#define URING_OP_CLOSE 2
+
+static int sys_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                           unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                         flags, NULL, 0);
+}
+
+static int sys_uring_register(int fd, unsigned opcode, void *arg,
+                              unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* the ring must support every opcode a batch uses */
+static int uring_has_ops(int fd)
+{
+    size_t len = sizeof(struct io_uring_probe) +
+                 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    static const int ops[] = {IORING_OP_OPENAT, IORING_OP_READ,
+                              IORING_OP_CLOSE};
+    int i, ok = 0;
+
+    if (probe == NULL) {
+        return 0;
+    }
+    if (sys_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        ok = 1;
+        for (i = 0; i < 3; i++) {
+            if (ops[i] > probe->last_op ||
+                !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+                ok = 0;
+            }
+        }
+    }
+    free(probe);
+    return ok;
+}
+
+/**
+ * @brief: set up a ring and PNG_URING_BATCH empty fixed file slots
+ * @return 0 on success, 1 if io_uring is unavailable; ur is then unusable
+ *         and needs no cleanup
+ */
+int png_uring_init(PNG_URING *ur)
+{
+    struct io_uring_params p;
+    int files[PNG_URING_BATCH];
+    int i;
+
+    memset(ur, 0, sizeof(*ur));
+    memset(&p, 0, sizeof(p));
+    ur->ring_fd = sys_uring_setup(URING_ENTRIES, &p);
+    if (ur->ring_fd < 0) {
+        return 1;
+    }
+    if (!(p.features & IORING_FEAT_NODROP) || !uring_has_ops(ur->ring_fd)) {
+        close(ur->ring_fd);
+        ur->ring_fd = -1;
+        return 1;
+    }
+
+    ur->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ur->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ur->cq_size > ur->sq_size) {
+            ur->sq_size = ur->cq_size;
+        }
+        ur->cq_size = ur->sq_size;
+    }
+    ur->sq_ptr = mmap(NULL, ur->sq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ur->ring_fd,
+                      IORING_OFF_SQ_RING);
+    if (ur->sq_ptr == MAP_FAILED) {
+        close(ur->ring_fd);
+        ur->ring_fd = -1;
+        return 1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ur->cq_ptr = ur->sq_ptr;
+    } else {
+        ur->cq_ptr = mmap(NULL, ur->cq_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ur->ring_fd,
+                          IORING_OFF_CQ_RING);
+        if (ur->cq_ptr == MAP_FAILED) {
+            munmap(ur->sq_ptr, ur->sq_size);
+            close(ur->ring_fd);
+            ur->ring_fd = -1;
+            return 1;
+        }
+    }
+    ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQES);
+    if (ur->sqes == MAP_FAILED) {
+        if (ur->cq_ptr != ur->sq_ptr) {
+            munmap(ur->cq_ptr, ur->cq_size);
+        }
+        munmap(ur->sq_ptr, ur->sq_size);
+        close(ur->ring_fd);
+        ur->ring_fd = -1;
+        return 1;
+    }
+
+    ur->sq_head = (unsigned *) ((char *) ur->sq_ptr + p.sq_off.head);
+    ur->sq_tail = (unsigned *) ((char *) ur->sq_ptr + p.sq_off.tail);
+    ur->sq_mask = (unsigned *) ((char *) ur->sq_ptr + p.sq_off.ring_mask);
+    ur->sq_array = (unsigned *) ((char *) ur->sq_ptr + p.sq_off.array);
+    ur->cq_head = (unsigned *) ((char *) ur->cq_ptr + p.cq_off.head);
+    ur->cq_tail = (unsigned *) ((char *) ur->cq_ptr + p.cq_off.tail);
+    ur->cq_mask = (unsigned *) ((char *) ur->cq_ptr + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe *) ((char *) ur->cq_ptr + p.cq_off.cqes);
+
+    /* sparse table: slot i belongs to items[i] */
+    for (i = 0; i < PNG_URING_BATCH; i++) {
+        files[i] = -1;
+    }
+    if (sys_uring_register(ur->ring_fd, IORING_REGISTER_FILES, files,
+                           PNG_URING_BATCH) != 0) {
+        png_uring_cleanup(ur);
+        return 1;
+    }
+    return 0;
+}
+
+void png_uring_cleanup(PNG_URING *ur)
+{
+    if (ur->ring_fd < 0) {
+        return;
+    }
+    munmap(ur->sqes, ur->sqes_size);
+    if (ur->cq_ptr != ur->sq_ptr) {
+        munmap(ur->cq_ptr, ur->cq_size);
+    }
+    munmap(ur->sq_ptr, ur->sq_size);
+    close(ur->ring_fd);
+    ur->ring_fd = -1;
+}
+
+/**
+ * @brief: queue a file for the next png_uring_flush()
+ * @param: dirfd int directory fd, must stay open until the flush
+ * @param: name const char* file name relative to dirfd, copied
+ * @param: user void* caller's data, returned in the item
+ * @return the queued item, NULL if the batch is full (flush first) or the
+ *         name is too long
+ */
+PNG_URING_ITEM *png_uring_add(PNG_URING *ur, int dirfd, const char *name,
+                              void *user)
+{
+    PNG_URING_ITEM *it;
+    size_t len = strlen(name);
+
+    if (ur->n_items == PNG_URING_BATCH || len > NAME_MAX) {
+        return NULL;
+    }
+    it = &ur->items[ur->n_items++];
+    it->dirfd = dirfd;
+    memcpy(it->name, name, len + 1);
+    it->user = user;
+    it->len = -EINPROGRESS;
+    return it;
+}
+
+static struct io_uring_sqe *uring_get_sqe(PNG_URING *ur, unsigned *tail)
+{
+    unsigned idx = *tail & *ur->sq_mask;
+    struct io_uring_sqe *sqe = &ur->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ur->sq_array[idx] = idx;
+    (*tail)++;
+    return sqe;
+}
+
+/**
+ * @brief: run every queued item through openat + read + close, wait for
+ *         all of them, and fill in items[i].len / items[i].head. The
+ *         items stay valid until the next png_uring_add().
+ * @return number of items processed, -1 if io_uring_enter() failed (the
+ *         items then have len < 0 and should be probed synchronously)
+ */
+int png_uring_flush(PNG_URING *ur)
+{
+    unsigned tail = *ur->sq_tail;
+    unsigned to_submit, pending, head;
+    int i, n = ur->n_items, ret;
+
+    if (n == 0) {
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        PNG_URING_ITEM *it = &ur->items[i];
+        struct io_uring_sqe *sqe;
+
+        /* openat() straight into fixed slot i (file_index is 1 based) */
+        sqe = uring_get_sqe(ur, &tail);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = it->dirfd;
+        sqe->addr = (unsigned long) it->name;
+        sqe->open_flags = O_RDONLY | O_NOFOLLOW;
+        sqe->file_index = i + 1;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = i * URING_OPS + URING_OP_OPEN;
+
+        /* hard link: a file shorter than the header is a short read,
+           which must not cancel the close behind it */
+        sqe = uring_get_sqe(ur, &tail);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = i;
+        sqe->addr = (unsigned long) it->head;
+        sqe->len = PNG_HEAD_LEN;
+        sqe->off = 0;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+        sqe->user_data = i * URING_OPS + URING_OP_READ;
+
+        sqe = uring_get_sqe(ur, &tail);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = i + 1;
+        sqe->user_data = i * URING_OPS + URING_OP_CLOSE;
+    }
+    __atomic_store_n(ur->sq_tail, tail, __ATOMIC_RELEASE);
+
+    to_submit = n * URING_OPS;
+    pending = to_submit;
+    while (pending > 0) {
+        ret = sys_uring_enter(ur->ring_fd, to_submit, 1,
+                              IORING_ENTER_GETEVENTS);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            ur->n_items = 0;
+            return -1;
+        }
+        to_submit -= ret < (int) to_submit ? ret : to_submit;
+
+        head = *ur->cq_head;
+        while (head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ur->cqes[head & *ur->cq_mask];
+            PNG_URING_ITEM *it = &ur->items[cqe->user_data / URING_OPS];
+            int op = cqe->user_data % URING_OPS;
+
+            if (op == URING_OP_OPEN && cqe->res < 0) {
+                it->len = cqe->res;
+            } else if (op == URING_OP_READ && it->len == -EINPROGRESS) {
+                it->len = cqe->res;
+            }
+            head++;
+            pending--;
+        }
+        __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+    }
+    ur->n_items = 0;
+    return n;
+}
@@ -0,0 +1,56 @@
+/**
+ * @brief: batched PNG header probing on io_uring
+ *
+ * Each queued file becomes three linked SQEs: openat() into a fixed
+ * (direct) descriptor slot, read() of the first PNG_HEAD_LEN bytes from
+ * that slot, and close() of the slot. A batch of PNG_URING_BATCH files is
+ * handed to the kernel with a single io_uring_enter(), instead of three
+ * system calls per file. The ring is driven with the raw system calls
+ * from <linux/io_uring.h>, liburing is not needed.
+ *
+ * A PNG_URING is owned by one thread. png_uring_init() fails when the
+ * kernel has no io_uring (or it is disabled); callers then keep using
+ * open() + png_probe_fd().
+ */
+
+#pragma once
+
+#include <limits.h>
+#include "png_chunk.h"
+
+#define PNG_URING_BATCH 256   /* files per io_uring_enter()             */
+
+/* one queued file */
+typedef struct png_uring_item {
+    int dirfd;                /* directory the name is relative to       */
+    char name[NAME_MAX + 1];
+    void *user;               /* caller's data, untouched               */
+    int len;                  /* after flush: bytes read, or -errno      */
+    U8 head[PNG_HEAD_LEN];    /* after flush: first len bytes of file    */
+} PNG_URING_ITEM;
+
+typedef struct png_uring {
+    int ring_fd;
+    void *sq_ptr;             /* SQ ring mapping                        */
+    void *cq_ptr;             /* CQ ring mapping, == sq_ptr if single    */
+    size_t sq_size;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    PNG_URING_ITEM items[PNG_URING_BATCH];
+    int n_items;
+} PNG_URING;
+
+int png_uring_init(PNG_URING *ur);
+void png_uring_cleanup(PNG_URING *ur);
+PNG_URING_ITEM *png_uring_add(PNG_URING *ur, int dirfd, const char *name,
+                              void *user);
+int png_uring_flush(PNG_URING *ur);
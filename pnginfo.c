@@ -9,8 +9,14 @@
 #include <stdio.h>    /* for printf(), perror()...   */
 #include <stdlib.h>   /* for malloc()                */
 #include <errno.h>    /* for errno                   */
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
 #include "crc.h"      /* for crc()                   */
 #include "lab_png.h"  /* simple PNG data structures  */
+#include "fmap.h"     /* mmap'd input files          */
 
 /******************************************************************************
  * DEFINED MACROS
@@ -18,17 +24,52 @@
 #define BUF_LEN  (256*16)
 #define BUF_LEN2 (256*32)
 
+/* batch output formats */
+#define FMT_TEXT 0   /* "path: w x h", as for a single file  */
+#define FMT_CSV  1   /* header line, then one row per file   */
+#define FMT_JSON 2   /* one JSON object per line             */
+
+/* PNG_INFO.status */
+#define INFO_OK      0
+#define INFO_BAD_CRC 1
+#define INFO_TRUNC   2
+#define INFO_NOT_PNG 3
+#define INFO_NO_FILE 4
+
 /******************************************************************************
  * GLOBALS
  *****************************************************************************/
 U8 gp_buf_def[BUF_LEN2]; /* output buffer for mem_def() */
 U8 gp_buf_inf[BUF_LEN2]; /* output buffer for mem_inf() */
 
+static const char *g_status_name[] = {"ok", "bad_crc", "truncated",
+                                      "not_png", "no_file"};
+
+/* result for one file of a batch */
+typedef struct png_info {
+    int status;          /* INFO_*                                     */
+    PNG_HEAD head;       /* valid unless not_png / no_file             */
+    int n_chunks;        /* IHDR to IEND                               */
+    char bad_type[5];    /* with bad_crc: the chunk that failed        */
+} PNG_INFO;
+
+/* work shared by the batch threads */
+typedef struct info_job {
+    char **paths;
+    PNG_INFO *rows;      /* rows[i] belongs to paths[i]                */
+    int n;
+    int next;            /* next path to take, atomically              */
+    int check_crc;       /* -c: CRC every chunk, not just IHDR         */
+} INFO_JOB;
+
 /******************************************************************************
  * FUNCTION PROTOTYPES
  *****************************************************************************/
 
 void init_data(U8 *buf, int len);
+void png_info_fd(PNG_INFO *row, int fd, int check_crc);
+int pnginfo_batch(char **paths, int n, int n_threads, int fmt,
+                  int check_crc);
 
 /******************************************************************************
  * FUNCTIONS
@@ -45,49 +86,296 @@ void init_data(U8 *buf, int len)
     }
 }
 
-int main (int argc, char **argv)
+/**
+ * @brief header-only inspection of one open file: one pread for the
+ *        signature and IHDR, then one 8 byte pread per chunk header to
+ *        count chunks. Chunk data is only read with check_crc.
+ */
+void png_info_fd(PNG_INFO *row, int fd, int check_crc)
+{
+    U32 bad_crc, bad_calc;
+    int k;
+
+    memset(row, 0, sizeof(*row));
+    k = png_probe_fd(fd, &row->head);
+    if (k == PNG_NOT_PNG) {
+        row->status = INFO_NOT_PNG;
+        return;
+    }
+    if (k == PNG_BAD_CRC) {
+        row->status = INFO_BAD_CRC;
+        memcpy(row->bad_type, "IHDR", 4);
+        return;
+    }
+    k = png_walk_fd(fd, check_crc, &row->n_chunks, (U8 *) row->bad_type,
+                    &bad_crc, &bad_calc);
+    row->status = k == PNG_OK ? INFO_OK
+                : (k == PNG_BAD_CRC ? INFO_BAD_CRC : INFO_TRUNC);
+}
+
+static void *info_worker(void *arg)
+{
+    INFO_JOB *job = arg;
+    int i, fd;
+
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->n) {
+        fd = open(job->paths[i], O_RDONLY);
+        if (fd < 0) {
+            memset(&job->rows[i], 0, sizeof(PNG_INFO));
+            job->rows[i].status = INFO_NO_FILE;
+            continue;
+        }
+        png_info_fd(&job->rows[i], fd, job->check_crc);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* CSV field, quoted only when it has to be */
+static void print_csv_str(const char *str)
+{
+    if (strpbrk(str, ",\"\r\n") == NULL) {
+        fputs(str, stdout);
+        return;
+    }
+    putchar('"');
+    for (; *str; str++) {
+        if (*str == '"') {
+            putchar('"');
+        }
+        putchar(*str);
+    }
+    putchar('"');
+}
+
+static void print_json_str(const char *str)
 {
-    if (argc != 2) {
+    putchar('"');
+    for (; *str; str++) {
+        unsigned char ch = *str;
+        if (ch == '"' || ch == '\\') {
+            printf("\\%c", ch);
+        } else if (ch < 0x20) {
+            printf("\\u%04x", ch);
+        } else {
+            putchar(ch);
+        }
+    }
+    putchar('"');
+}
+
+static void print_row(const char *path, const PNG_INFO *row, int fmt,
+                      int check_crc)
+{
+    const PNG_HEAD *h = &row->head;
+    int has_head = row->status <= INFO_TRUNC;
+    const char *checked = check_crc ? "all" : "ihdr";
+
+    if (fmt == FMT_TEXT) {
+        if (row->status == INFO_NO_FILE) {
+            printf("%s: File not found \n", path);
+        } else if (row->status == INFO_BAD_CRC) {
+            printf("%s: %.4s chunk CRC error \n", path, row->bad_type);
+        } else if (row->status != INFO_OK) {
+            printf("%s: Not a PNG file \n", path);
+        } else {
+            printf("%s: %u x %u \n", path, h->width, h->height);
+        }
+    } else if (fmt == FMT_CSV) {
+        print_csv_str(path);
+        if (has_head) {
+            printf(",%s,%u,%u,%u,%u,%u,%d,%s,%s\n",
+                   g_status_name[row->status], h->width, h->height,
+                   h->bit_depth, h->color_type, h->interlace, row->n_chunks,
+                   checked, row->bad_type);
+        } else {
+            printf(",%s,,,,,,,%s,\n", g_status_name[row->status], checked);
+        }
+    } else {
+        printf("{\"path\":");
+        print_json_str(path);
+        printf(",\"status\":\"%s\"", g_status_name[row->status]);
+        if (has_head) {
+            printf(",\"width\":%u,\"height\":%u,\"bit_depth\":%u,"
+                   "\"color_type\":%u,\"interlace\":%u,\"chunks\":%d",
+                   h->width, h->height, h->bit_depth, h->color_type,
+                   h->interlace, row->n_chunks);
+        }
+        printf(",\"crc_checked\":\"%s\"", checked);
+        if (row->status == INFO_BAD_CRC) {
+            printf(",\"bad_chunk\":\"%.4s\"", row->bad_type);
+        }
+        printf("}\n");
+    }
+}
+
+/**
+ * @brief inspect many files across n_threads threads, print one row per
+ *        file in input order
+ * @return 0 if every file is a PNG without CRC errors, 1 otherwise
+ */
+int pnginfo_batch(char **paths, int n, int n_threads, int fmt,
+                  int check_crc)
+{
+    INFO_JOB job;
+    pthread_t *tids;
+    int i, t = 0, ret = 0;
+
+    job.paths = paths;
+    job.n = n;
+    job.next = 0;
+    job.check_crc = check_crc;
+    job.rows = malloc((n ? n : 1) * sizeof(PNG_INFO));
+    if (n_threads > n) {
+        n_threads = n;
+    }
+    tids = malloc((n_threads ? n_threads : 1) * sizeof(pthread_t));
+    if (job.rows == NULL || tids == NULL) {
+        perror("malloc");
+        free(job.rows);
+        free(tids);
         return 1;
     }
-    U8 *p_buffer = NULL;  /* a buffer that contains some data to play with */
+    for (t = 0; t < n_threads - 1; t++) {
+        if (pthread_create(&tids[t], NULL, info_worker, &job) != 0) {
+            break;
+        }
+    }
+    info_worker(&job);  /* the main thread takes a share too */
+    for (i = 0; i < t; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    if (fmt == FMT_CSV) {
+        printf("path,status,width,height,bit_depth,color_type,interlace,"
+               "chunks,crc_checked,bad_chunk\n");
+    }
+    for (i = 0; i < n; i++) {
+        print_row(paths[i], &job.rows[i], fmt, check_crc);
+        if (job.rows[i].status != INFO_OK) {
+            ret = 1;
+        }
+    }
+    free(job.rows);
+    free(tids);
+    return ret;
+}
+
+/**
+ * @brief newline separated paths from fp, empty lines skipped
+ * @return number of paths, -1 if out of memory
+ */
+static int read_path_list(FILE *fp, char ***p_paths)
+{
+    char **paths = NULL;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int n = 0, max = 0;
+
+    while ((len = getline(&line, &cap, fp)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (n == max) {
+            int m = max ? max * 2 : 1024;
+            char **q = realloc(paths, m * sizeof(char *));
+            if (q == NULL) {
+                break;
+            }
+            paths = q;
+            max = m;
+        }
+        if ((paths[n] = strdup(line)) == NULL) {
+            break;
+        }
+        n++;
+    }
+    free(line);
+    *p_paths = paths;
+    return n;
+}
+
+// ./pnginfo FILE
+// ./pnginfo [-f text|csv|json] [-t threads] [-c] FILE... | - (list on stdin)
+int main (int argc, char **argv)
+{
+    int fmt = FMT_TEXT;
+    int n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int check_crc = 0;
+    int batch = 0;
+    int c, i, n, ret;
+    char **paths;
+
+    while ((c = getopt(argc, argv, "f:t:c")) != -1) {
+        batch = 1;
+        switch (c) {
+        case 'f':
+            if (strcmp(optarg, "csv") == 0) {
+                fmt = FMT_CSV;
+            } else if (strcmp(optarg, "json") == 0) {
+                fmt = FMT_JSON;
+            } else if (strcmp(optarg, "text") == 0) {
+                fmt = FMT_TEXT;
+            } else {
+                fprintf(stderr, "pnginfo: unknown format %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 't':
+            n_threads = atoi(optarg);
+            break;
+        case 'c':
+            check_crc = 1;
+            break;
+        default:
+            return 1;
+        }
+    }
+    if (n_threads < 1) {
+        n_threads = 1;
+    }
+    if (argc - optind == 0 ||
+        (argc - optind == 1 && strcmp(argv[optind], "-") == 0)) {
+        n = read_path_list(stdin, &paths);
+        ret = pnginfo_batch(paths, n, n_threads, fmt, check_crc);
+        for (i = 0; i < n; i++) {
+            free(paths[i]);
+        }
+        free(paths);
+        return ret;
+    }
+    if (batch || argc - optind > 1) {
+        return pnginfo_batch(argv + optind, argc - optind, n_threads, fmt,
+                             check_crc);
+    }
+
+    /* a single file: the whole file is checked, as before */
+    FILE_MAP fm;          /* the file, mapped read-only  */
     char *file_path = argv[1];
-    FILE *f = fopen(file_path, "rb");
-    if (f == NULL) {
+    if (fmap_open(&fm, file_path) != 0) {
         printf("File not found \n");
         return 1;
     }
-    fseek(f, 0, SEEK_END);
-    long fln = ftell(f); //length
-    
-    /* Step 1: Initialize some data in a buffer */
-    /* Step 1.1: Allocate a dynamic buffer */
-    p_buffer =(U8 *) malloc(fln+1);
-    if (p_buffer == NULL) {
-        perror("malloc");
-        return errno;
-    }
-    
-    /* Step 1.2: Fill the buffer with some data */
-    //init_data(p_buffer, fln);
-    rewind(f);
-    fread(p_buffer, fln, 1, f);
-    //printf("crc_val = %c\n", p_buffer[1]);
-    //printf("crc_val = %c\n", p_buffer[2]);
-    //printf("crc_val = %c\n", p_buffer[3]);
+
     // is png
-    int k = is_png(p_buffer, fln);
+    int k = is_png(fm.buf, fm.len);
     if (k == 1) {
         printf("%s: Not a PNG file \n", argv[1]);
+        fmap_close(&fm);
         return 1;
     }
-    
-    //get IHDR
-    struct data_IHDR *out = malloc(sizeof(U8)*13);
-    int result = get_png_data_IHDR( out, f, 16, SEEK_SET);
+
+    //get IHDR, parsed in place right after the IHDR length and type
+    struct data_IHDR out;
+    int result = get_png_IHDR_data(&out, fm.buf + PNG_SIG_SIZE +
+                                   CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE);
     if ( result == 0 ) {
-        printf("%s: %d x %d \n",argv[1], ntohl(out->width), ntohl(out->height));
+        printf("%s: %d x %d \n", argv[1], out.width, out.height);
     }
-    fclose(f);
+    fmap_close(&fm);
     return 0;
 }
@@ -0,0 +1,100 @@
+#!/bin/bash
+############################################################################
+# File Name  : run_findpng.sh
+# Usage      : Build findpng (make findpng) and put this script in the
+#              same directory.
+#              ./run_findpng.sh [-d DIRS] [-f FILES] [-r RUNS] [-c] [TREE]
+#              DIRS x FILES files are created under TREE (default
+#              /tmp/findpng_tree) the first time, every 10th one is not a
+#              PNG. -c drops the page cache before every run (root only)
+#              to time cold reads.
+#
+# Course Name: ECE252 Systems Programming and Concurrency
+# Description: findpng utility - compares the directory walkers.
+#              Every mode is run RUNS times over the same tree:
+#  -------------------------------------------
+#  serial   findpng TREE            (ls_fname, opendir + open per file)
+#  -j 1     findpng -j 1 TREE       (fd-relative walker, openat + pread)
+#  --uring  findpng --uring TREE    (the -j 1 walker, io_uring batches)
+#  -------------------------------------------
+#  For each mode the script prints the average real, user and sys
+#  seconds and the number of PNGs found, which must be the same for
+#  every mode.
+#############################################################################
+PROG="./findpng"
+DIRS=1000
+FILES=100
+RUNS=3
+COLD=0
+
+while getopts "d:f:r:c" opt; do
+    case ${opt} in
+        d) DIRS=${OPTARG} ;;
+        f) FILES=${OPTARG} ;;
+        r) RUNS=${OPTARG} ;;
+        c) COLD=1 ;;
+        *) echo "Usage: $0 [-d DIRS] [-f FILES] [-r RUNS] [-c] [TREE]"
+           exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+TREE=${1:-/tmp/findpng_tree}
+
+if [ ! -x ${PROG} ]; then
+    echo "${PROG} not found, run make findpng first"
+    exit 1
+fi
+if [ ${COLD} = 1 ] && [ ! -w /proc/sys/vm/drop_caches ]; then
+    echo "-c needs write access to /proc/sys/vm/drop_caches"
+    exit 1
+fi
+
+# a 1x1 RGBA PNG, 68 bytes
+PNG='\211\120\116\107\015\012\032\012\000\000\000\015\111\110\104\122'
+PNG+='\000\000\000\001\000\000\000\001\010\006\000\000\000\037\025\304'
+PNG+='\211\000\000\000\013\111\104\101\124\170\234\143\140\000\002\000'
+PNG+='\000\005\000\001\172\136\253\077\000\000\000\000\111\105\116\104'
+PNG+='\256\102\140\202'
+
+if [ ! -d ${TREE} ]; then
+    echo "creating ${DIRS} x ${FILES} files in ${TREE}"
+    d=0
+    while [ ${d} -lt ${DIRS} ]
+    do
+        mkdir -p ${TREE}/d${d} || exit 1
+        f=0
+        while [ ${f} -lt ${FILES} ]
+        do
+            if [ $((f % 10)) = 9 ]; then
+                echo "not a png" > ${TREE}/d${d}/f${f}.txt
+            else
+                printf "${PNG}" > ${TREE}/d${d}/f${f}.png
+            fi
+            f=$((f + 1))
+        done
+        d=$((d + 1))
+    done
+fi
+
+TIMEFORMAT="%R %U %S"
+printf "%-8s %10s %10s %10s %10s\n" "mode" "real" "user" "sys" "PNGs"
+for mode in "" "-j 1" "--uring"
+do
+    tot="0 0 0"
+    found=
+    xx=1
+    while [ ${xx} -le ${RUNS} ]
+    do
+        if [ ${COLD} = 1 ]; then
+            sync
+            echo 3 > /proc/sys/vm/drop_caches
+        fi
+        t=`{ time ${PROG} ${mode} ${TREE} > findpng_$$.out ; } 2>&1`
+        found=`wc -l < findpng_$$.out`
+        tot=`echo "${tot} ${t}" | awk '{print $1 + $4, $2 + $5, $3 + $6}'`
+        xx=$((xx + 1))
+    done
+    echo "${tot}" | awk -v m="${mode:-serial}" -v n=${RUNS} -v f=${found} \
+        '{printf "%-8s %10.2f %10.2f %10.2f %10d\n", m, $1 / n, $2 / n, $3 / n, f}'
+done
+rm -f findpng_$$.out
@@ -25,13 +25,16 @@
 #  -------------------------------------------
 #  The script reads the last line where the timing info is and
 #  then extract the S and output to a file. 
-#  The outputfile naming convention is: B*_P*_C*_X*_N*.dat.
+#  Every configuration is run once per execution mode in M, forked
+#  processes (proc) and pthreads (thread, paster2 --threads).
+#  The outputfile naming convention is: M*_B*_P*_C*_X*_N*.dat.
 #  The script then compute for tables.
 #  tb1_N*_$$.txt: average system execution time
 #  tb2_N*_$$.txt: standard deviation of system execution time
 #  where N is the user input $$ is the pid of process that executing this shell script.
 #############################################################################
 PROG="./paster2"
+M="proc thread"
 B="5 10"
 P="1 5 10"
 C="1 5 10"
@@ -41,9 +44,10 @@ NN=5
 exec_producer () 
 {
 
-    if [ $# != 7 ]; then
-        echo "Usage: $0 <exec_name> <B> <P> <C> <X> <N> <NN>" 
+    if [ $# != 8 ]; then
+        echo "Usage: $0 <exec_name> <M> <B> <P> <C> <X> <N> <NN>" 
         echo "  exec_name: executible's name"
+        echo "  M: execution mode, proc or thread"
         echo "  B: buffer size"
         echo "  P: number of producers"
         echo "  C: number of consumers"
@@ -53,15 +57,19 @@ exec_producer ()
         exit 1
     else
         PROGRAM=$1
-        BUFFER_SIZE=$2
-        NUM_P=$3
-        NUM_C=$4
-        NUM2SLEEP=$5
-        IMG=$6
-        X_TIMES=$7
+        MODE=$2
+        BUFFER_SIZE=$3
+        NUM_P=$4
+        NUM_C=$5
+        NUM2SLEEP=$6
+        IMG=$7
+        X_TIMES=$8
+    fi
+    if [ ${MODE} = "thread" ]; then
+        PROGRAM="${PROGRAM} --threads"
     fi
 
-    O_FILE='B'${BUFFER_SIZE}'_P'${NUM_P}'_C'${NUM_C}'_X'${NUM2SLEEP}'_N'${IMG}'.dat'
+    O_FILE='M'${MODE}'_B'${BUFFER_SIZE}'_P'${NUM_P}'_C'${NUM_C}'_X'${NUM2SLEEP}'_N'${IMG}'.dat'
     touch ${O_FILE}
     xx=1
     while [ ${xx} -le ${X_TIMES} ]
@@ -90,7 +98,10 @@ gen_data ()
                     if [ $c -gt $(($b+1)) ]; then
                         break
                     fi
-                    exec_producer $PROG $b $p $c $x $1 $NN
+                    for m in $M
+                    do
+                        exec_producer "$PROG" $m $b $p $c $x $1 $NN
+                    done
                 done
             done
         done
@@ -118,8 +129,8 @@ gen_stat_per_pair ()
     }
     END{
         for(i = 1; i <= num_files/2; i++) {
-            printf("%.6lf\n", sum[i]/NR) >> fname_tb[2*i-1] 
-            printf("%.6lf\n", sqrt(NR/(NR-1) * (sumsq[i]/NR - (sum[i]/NR)**2))) >> fname_tb[2*i]
+            printf("%.6f\n", sum[i]/NR) >> fname_tb[2*i-1] 
+            printf("%.6f\n", sqrt(NR/(NR-1) * (sumsq[i]/NR - (sum[i]/NR)^2))) >> fname_tb[2*i]
         }
     } ' "${FNAME_DATA}"
 
@@ -137,7 +148,7 @@ gen_table ()
     i=1
     while [ ${i} -le ${NUM_TBS} ]
     do
-        printf 'B,P,C,X,N,Time\n' >> ${FNAME_TB[${i}]} 
+        printf 'M,B,P,C,X,N,Time\n' >> ${FNAME_TB[${i}]} 
         i=`expr $i + 1`
     done
 
@@ -155,15 +166,18 @@ gen_table ()
                     if [ $c -gt $(($b+1)) ]; then
                         break
                     fi
-                    i=1
-                    while [ ${i} -le ${NUM_TBS} ]
+                    for m in $M
                     do
-                        printf '%d,%d,%d,%d,%d,' "$b" "$p" "$c" "$x" "$1" >> ${FNAME_TB[${i}]}
-                        i=`expr $i + 1`
+                        i=1
+                        while [ ${i} -le ${NUM_TBS} ]
+                        do
+                            printf '%s,%d,%d,%d,%d,%d,' "$m" "$b" "$p" "$c" "$x" "$1" >> ${FNAME_TB[${i}]}
+                            i=`expr $i + 1`
+                        done
+                        FNAME_DATA="M${m}_B${b}_P${p}_C${c}_X${x}_N$1.dat"
+                        echo $FNAME_DATA
+                        gen_stat_per_pair $FNAME_DATA
                     done
-                    FNAME_DATA="B${b}_P${p}_C${c}_X${x}_N$1.dat"
-                    echo $FNAME_DATA
-                    gen_stat_per_pair $FNAME_DATA
                 done
             done
         done
@@ -0,0 +1,194 @@
+/**
+ * @brief: size-class allocator for shared memory, see shm_arena.h
+ */
+
+#include <string.h>
+#include "shm_arena.h"
+
+#define ARENA_TAG(head) ((head) >> 32)
+#define ARENA_OFF(head) ((U32) (head))
+
+/* class of the smallest block holding len bytes, -1 if none does */
+static int class_of(U32 len)
+{
+    U32 e, q;
+
+    if (len <= SHM_ARENA_MIN) {
+        return 0;
+    }
+    if (len > SHM_ARENA_MAX) {
+        return -1;
+    }
+    e = 31 - __builtin_clz(len - 1);   /* 2^e < len <= 2^(e+1) */
+    q = (len - (1U << e) + (1U << (e - 2)) - 1) >> (e - 2);  /* 1..4 */
+    return (e - SHM_ARENA_MIN_SHIFT) * 4 + q;
+}
+
+static U32 class_size(int k)
+{
+    U32 e = SHM_ARENA_MIN_SHIFT + k / 4;
+
+    return (1U << e) + (k % 4) * (1U << (e - 2));
+}
+
+static U32 *next_of(SHM_ARENA *a, U32 off)
+{
+    return (U32 *) shm_arena_ptr(a, off);
+}
+
+/* push a free block on the shared list of its class */
+static void list_push(SHM_ARENA *a, int k, U32 off)
+{
+    U64 head = __atomic_load_n(&a->free_head[k], __ATOMIC_RELAXED);
+    U64 next;
+
+    do {
+        *next_of(a, off) = ARENA_OFF(head);
+        next = (ARENA_TAG(head) + 1) << 32 | off;
+    } while (!__atomic_compare_exchange_n(&a->free_head[k], &head, next, 1,
+                                          __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+/* pop a free block of class k, SHM_ARENA_NIL if the list is empty */
+static U32 list_pop(SHM_ARENA *a, int k)
+{
+    U64 head = __atomic_load_n(&a->free_head[k], __ATOMIC_ACQUIRE);
+    U64 next;
+
+    do {
+        if (ARENA_OFF(head) == SHM_ARENA_NIL) {
+            return SHM_ARENA_NIL;
+        }
+        /* may read a block somebody else just popped and is writing to;
+         * the tag makes the CAS fail in that case */
+        next = (ARENA_TAG(head) + 1) << 32 |
+               __atomic_load_n(next_of(a, ARENA_OFF(head)), __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&a->free_head[k], &head, next, 1,
+                                          __ATOMIC_ACQUIRE,
+                                          __ATOMIC_ACQUIRE));
+    return ARENA_OFF(head);
+}
+
+/* cut a fresh block of len bytes from the top of the arena */
+static U32 top_take(SHM_ARENA *a, U32 len)
+{
+    U64 top = __atomic_load_n(&a->top, __ATOMIC_RELAXED);
+
+    do {
+        if (top + len > a->size) {
+            return SHM_ARENA_NIL;
+        }
+    } while (!__atomic_compare_exchange_n(&a->top, &top, top + len, 1,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    return (U32) top;
+}
+
+/**
+ * @brief: bytes of (shared) memory an arena with data_size bytes of block
+ *         space needs
+ */
+size_t shm_arena_size(U64 data_size)
+{
+    return sizeof(SHM_ARENA) + data_size;
+}
+
+/**
+ * @brief: set up an empty arena in memory of shm_arena_size() bytes
+ * @return 0 on success, 1 if data_size does not fit 32 bit offsets
+ */
+int shm_arena_init(SHM_ARENA *a, U64 data_size)
+{
+    int k;
+
+    if (a == NULL || data_size >= SHM_ARENA_NIL) {
+        return 1;
+    }
+    memset(a, 0, sizeof(*a));
+    a->size = data_size;
+    for (k = 0; k < SHM_ARENA_N_CLASS; k++) {
+        a->free_head[k] = SHM_ARENA_NIL;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return 0;
+}
+
+/**
+ * @brief: size of the block shm_arena_alloc() hands out for len bytes,
+ *         0 if len is larger than SHM_ARENA_MAX
+ */
+U32 shm_arena_class_size(U32 len)
+{
+    int k = class_of(len);
+
+    return k < 0 ? 0 : class_size(k);
+}
+
+/**
+ * @brief: allocate a block of at least len bytes
+ * @param: c SHM_ARENA_CACHE* the caller's private cache, zeroed before use
+ * @param: cap U32* output, usable size of the block, pass it to
+ *         shm_arena_free()
+ * @return offset of the block, SHM_ARENA_NIL when the arena is full
+ */
+U32 shm_arena_alloc(SHM_ARENA *a, SHM_ARENA_CACHE *c, U32 len, U32 *cap)
+{
+    int k = class_of(len);
+    U32 off;
+
+    if (k < 0) {
+        return SHM_ARENA_NIL;
+    }
+    if (c != NULL && c->n[k] > 0) {
+        off = c->off[k][--c->n[k]];
+    } else if ((off = list_pop(a, k)) == SHM_ARENA_NIL) {
+        off = top_take(a, class_size(k));
+    }
+    if (off != SHM_ARENA_NIL) {
+        *cap = class_size(k);
+    }
+    return off;
+}
+
+/**
+ * @brief: give a block back; it stays in the caller's cache until the
+ *         cache for its class is full, then goes to the shared list
+ * @param: cap U32 as returned by shm_arena_alloc()
+ */
+void shm_arena_free(SHM_ARENA *a, SHM_ARENA_CACHE *c, U32 off, U32 cap)
+{
+    int k = class_of(cap);
+
+    if (off == SHM_ARENA_NIL || k < 0) {
+        return;
+    }
+    if (c != NULL && c->n[k] < SHM_ARENA_CACHE_LEN) {
+        c->off[k][c->n[k]++] = off;
+    } else {
+        list_push(a, k, off);
+    }
+}
+
+/**
+ * @brief: move every cached block to the shared lists, call before the
+ *         owner of the cache exits so other processes can reuse them
+ */
+void shm_arena_cache_flush(SHM_ARENA *a, SHM_ARENA_CACHE *c)
+{
+    int k;
+
+    for (k = 0; k < SHM_ARENA_N_CLASS; k++) {
+        while (c->n[k] > 0) {
+            list_push(a, k, c->off[k][--c->n[k]]);
+        }
+    }
+}
+
+/**
+ * @brief: address of a block in the caller's mapping of the arena
+ */
+void *shm_arena_ptr(SHM_ARENA *a, U32 off)
+{
+    return (char *) (a + 1) + off;
+}
@@ -0,0 +1,56 @@
+/**
+ * @brief: size-class allocator for one block of (shared) memory
+ *
+ * Blocks are named by their byte offset from the start of the arena data,
+ * never by pointer, so the arena can sit in a System V segment that every
+ * process attaches at a different address. Block sizes come in four
+ * classes per power of two, from SHM_ARENA_MIN (1 KiB) to SHM_ARENA_MAX,
+ * so a block wastes at most a quarter of its size.
+ *
+ * Every class has a lock-free free list in the arena (a tagged Treiber
+ * stack threaded through the free blocks themselves) plus a small cache
+ * that is private to the caller, SHM_ARENA_CACHE, so a process that frees
+ * and allocates the same class again touches no shared cache line. Fresh
+ * blocks are cut from the top of the arena; memory is never returned to
+ * it, and a free block of one class is not split to serve another.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+typedef unsigned int U32;
+typedef unsigned long int U64;
+
+#define SHM_ARENA_MIN_SHIFT 10                      /* 1 KiB              */
+#define SHM_ARENA_MAX_SHIFT 28                      /* 256 MiB            */
+#define SHM_ARENA_MIN (1U << SHM_ARENA_MIN_SHIFT)
+#define SHM_ARENA_MAX (1U << SHM_ARENA_MAX_SHIFT)
+#define SHM_ARENA_N_CLASS \
+    ((SHM_ARENA_MAX_SHIFT - SHM_ARENA_MIN_SHIFT) * 4 + 1)
+#define SHM_ARENA_NIL 0xffffffffU                   /* no block           */
+#define SHM_ARENA_CACHE_LEN 4                       /* per class          */
+#define SHM_ARENA_CACHE_LINE 64
+
+typedef struct shm_arena {
+    U64 size;            /* bytes of block space after this header     */
+    char pad0[SHM_ARENA_CACHE_LINE - sizeof(U64)];
+    U64 top;             /* first never allocated byte                 */
+    char pad1[SHM_ARENA_CACHE_LINE - sizeof(U64)];
+    U64 free_head[SHM_ARENA_N_CLASS];  /* tag << 32 | offset           */
+    /* block space follows, cache line aligned */
+} __attribute__((aligned(SHM_ARENA_CACHE_LINE))) SHM_ARENA;
+
+/* blocks freed by this process (or thread) and not yet shared */
+typedef struct shm_arena_cache {
+    U32 n[SHM_ARENA_N_CLASS];
+    U32 off[SHM_ARENA_N_CLASS][SHM_ARENA_CACHE_LEN];
+} SHM_ARENA_CACHE;
+
+size_t shm_arena_size(U64 data_size);
+int shm_arena_init(SHM_ARENA *a, U64 data_size);
+U32 shm_arena_class_size(U32 len);
+U32 shm_arena_alloc(SHM_ARENA *a, SHM_ARENA_CACHE *c, U32 len, U32 *cap);
+void shm_arena_free(SHM_ARENA *a, SHM_ARENA_CACHE *c, U32 off, U32 cap);
+void shm_arena_cache_flush(SHM_ARENA *a, SHM_ARENA_CACHE *c);
+void *shm_arena_ptr(SHM_ARENA *a, U32 off);
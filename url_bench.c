@@ -0,0 +1,127 @@
+/**
+ * @brief: insert/lookup throughput of the findpng3 URL set
+ *
+ * Inserts n distinct crawler-like URLs (about 70 bytes each, spread over
+ * three hosts), then looks each of them up again and looks up n URLs that
+ * are not in the set. The time to format the URLs is measured on its own
+ * and taken out of every rate.
+ *
+ * With -b the set gets a heap budget of that many MiB: the Bloom filter
+ * is sized for n URLs and inserted URLs count as crawled, so they spill
+ * to disk whenever the budget is crossed.
+ *
+ * ./url_bench [-n urls] [-b budget MiB]
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "url_set.h"
+
+#define COMPACT_EVERY 4096
+#define URL_FMT "http://ece252-%ld.uwaterloo.ca/~yqhuang/lab4/Disguise/%s_%lx.html"
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+/* i-th URL of a sequence; scrambled so neighbours share no hash bits */
+static int url_of(char *buf, size_t len, long i, const char *page)
+{
+    unsigned long k = (unsigned long) i * 0x9e3779b97f4a7c15UL;
+
+    return snprintf(buf, len, URL_FMT, i % 3 + 1, page, k);
+}
+
+/**
+ * @brief: one pass over n URLs
+ * @param: op int 0 format only, 1 insert, 2 look up
+ * @return seconds taken, -1 if the set did not behave
+ */
+static double pass(URL_SET *s, long n, int op, const char *page)
+{
+    char buf[256];
+    double t0 = now();
+    long i, bad = 0;
+
+    for (i = 0; i < n; i++) {
+        url_of(buf, sizeof(buf), i, page);
+        if (op == 1) {
+            bad += url_set_add(s, buf, NULL) != 1;
+            if (i % COMPACT_EVERY == 0) {
+                U32 next = url_set_count(s);
+                bad += url_set_compact(s, &next) < 0;
+            }
+        } else if (op == 2) {
+            bad += url_set_seen(s, buf) != (page[0] != 'm');
+        } else {
+            bad += buf[0] != 'h';
+        }
+    }
+    return bad ? -1 : now() - t0;
+}
+
+int main(int argc, char **argv)
+{
+    long n = 10000000;
+    long budget = 0;
+    double t_fmt, t_add, t_hit, t_miss;
+    URL_SET s;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:b:")) != -1) {
+        switch (c) {
+        case 'n':
+            n = atol(optarg);
+            break;
+        case 'b':
+            budget = atol(optarg);
+            break;
+        default:
+            printf("usage: %s [-n urls] [-b budget MiB]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n <= 0 || n >= URL_SET_NIL || budget < 0) {
+        printf("bad parameter\n");
+        return 1;
+    }
+    if (url_set_init(&s, 0) != 0 ||
+        (budget > 0 && url_set_budget(&s, budget << 20, n) != 0)) {
+        perror("url_set_init");
+        return 1;
+    }
+
+    t_fmt = pass(&s, n, 0, "page");
+    t_add = pass(&s, n, 1, "page");
+    t_hit = pass(&s, n, 2, "page");
+    s.n_bloom_neg = s.n_bloom_fp = 0;
+    t_miss = pass(&s, n, 2, "miss");
+    if (t_add < 0 || t_hit < 0 || t_miss < 0 || url_set_sync(&s) != 0) {
+        printf("URL set lost or invented URLs\n");
+        return 1;
+    }
+
+    printf("%ld URLs, %u in memory, %.1f bytes/URL of heap\n", n,
+           url_set_count(&s), (double) url_set_mem(&s) / n);
+    if (budget > 0) {
+        printf("budget %ld MiB, per million URLs: %.1f MiB heap, "
+               "%.1f MiB Bloom filter, %.1f MiB spill file\n", budget,
+               url_set_mem(&s) / (n / 1e6) / (1 << 20),
+               bloom_size(&s.bloom) / (n / 1e6) / (1 << 20),
+               s.n_spill * sizeof(U64) / (n / 1e6) / (1 << 20));
+        printf("Bloom false positive rate %.3f%% (%lu of %ld misses)\n",
+               100. * s.n_bloom_fp / (s.n_bloom_fp + s.n_bloom_neg),
+               s.n_bloom_fp, n);
+    }
+    printf("%-8s %14s\n", "op", "ops/s");
+    printf("%-8s %14.0f\n", "insert", n / (t_add - t_fmt));
+    printf("%-8s %14.0f\n", "hit", n / (t_hit - t_fmt));
+    printf("%-8s %14.0f\n", "miss", n / (t_miss - t_fmt));
+    url_set_cleanup(&s);
+    return 0;
+}
@@ -0,0 +1,664 @@
+/**
+ * @brief: URL set / crawl frontier, see url_set.h
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "url_set.h"
+
+#define HASH_M 0xc6a4a7935bd1e995UL
+#define HASH_R 47
+
+/**
+ * @brief: 64-bit hash of len bytes (MurmurHash64A), never 0 so 0 can mark
+ *         an empty slot
+ */
+U64 url_hash(const char *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) buf;
+    const unsigned char *end = p + (len & ~(size_t) 7);
+    U64 h = 0x9e3779b97f4a7c15UL ^ (len * HASH_M);
+    U64 k;
+
+    for (; p != end; p += 8) {
+        memcpy(&k, p, 8);
+        k *= HASH_M;
+        k ^= k >> HASH_R;
+        k *= HASH_M;
+        h ^= k;
+        h *= HASH_M;
+    }
+    switch (len & 7) {
+    case 7: h ^= (U64) p[6] << 48;  /* fall through */
+    case 6: h ^= (U64) p[5] << 40;  /* fall through */
+    case 5: h ^= (U64) p[4] << 32;  /* fall through */
+    case 4: h ^= (U64) p[3] << 24;  /* fall through */
+    case 3: h ^= (U64) p[2] << 16;  /* fall through */
+    case 2: h ^= (U64) p[1] << 8;   /* fall through */
+    case 1: h ^= (U64) p[0];
+            h *= HASH_M;
+    }
+    h ^= h >> HASH_R;
+    h *= HASH_M;
+    h ^= h >> HASH_R;
+    return h ? h : 1;
+}
+
+/* copy n bytes of src to dst in lower case */
+static char *copy_lower(char *dst, const char *src, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        dst[i] = tolower((unsigned char) src[i]);
+    }
+    return dst + n;
+}
+
+/**
+ * @brief: normalize url into s->norm: scheme and host in lower case, the
+ *         default port of http/https and any #fragment dropped, an empty
+ *         path written as "/"
+ * @return length of the normalized URL, -1 if out of memory
+ */
+static long url_normalize(URL_SET *s, const char *url)
+{
+    size_t len = strlen(url);
+    const char *p = url;
+    const char *end = url + strcspn(url, "#");
+    const char *auth, *host, *port, *q;
+    char *out;
+
+    if (s->norm_cap < len + 2) {
+        char *n = realloc(s->norm, len + 2);
+        if (n == NULL) {
+            return -1;
+        }
+        s->norm = n;
+        s->norm_cap = len + 2;
+    }
+    out = s->norm;
+
+    while (p < end && (isalnum((unsigned char) *p) || *p == '+' ||
+                       *p == '-' || *p == '.')) {
+        p++;
+    }
+    if (p == url || end - p < 3 || memcmp(p, "://", 3) != 0) {
+        memcpy(out, url, end - url);   /* no scheme, keep as is */
+        out[end - url] = 0;
+        return end - url;
+    }
+    out = copy_lower(out, url, p - url);
+    memcpy(out, "://", 3);
+    out += 3;
+
+    auth = p + 3;
+    q = auth + strcspn(auth, "/?#");
+    if (q > end) {
+        q = end;
+    }
+    host = memchr(auth, '@', q - auth);   /* user info is case sensitive */
+    host = host ? host + 1 : auth;
+    memcpy(out, auth, host - auth);
+    out += host - auth;
+    for (port = q; port > host && isdigit((unsigned char) port[-1]); port--) {
+    }
+    if (port > host && port[-1] == ':' &&
+        ((p - url == 4 && strncasecmp(url, "http", 4) == 0 &&
+          q - port == 2 && memcmp(port, "80", 2) == 0) ||
+         (p - url == 5 && strncasecmp(url, "https", 5) == 0 &&
+          q - port == 3 && memcmp(port, "443", 3) == 0))) {
+        out = copy_lower(out, host, port - 1 - host);
+    } else {
+        out = copy_lower(out, host, q - host);
+    }
+    if (q == end || *q != '/') {
+        *out++ = '/';
+    }
+    memcpy(out, q, end - q);
+    out += end - q;
+    *out = 0;
+    return out - s->norm;
+}
+
+/* slot holding (h, str) or the empty slot where it would go */
+static U64 probe(const URL_SET *s, U64 h, const char *str, size_t len)
+{
+    U64 mask = s->n_slot - 1;
+    U64 i = h & mask;
+
+    /* equal 64-bit hashes are compared in full, so a collision costs a
+     * memcmp, never a lost URL */
+    while (s->hash[i] != 0 &&
+           (s->hash[i] != h || strncmp(s->url[s->id[i]], str, len) != 0 ||
+            s->url[s->id[i]][len] != 0)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static int bsearch_u64(const U64 *a, U64 n, U64 key)
+{
+    U64 lo = 0, hi = n;
+
+    while (lo < hi) {
+        U64 mid = lo + (hi - lo) / 2;
+        if (a[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < n && a[lo] == key;
+}
+
+/* 1 if h is in the frozen array or the spill file */
+static int spilled(URL_SET *s, U64 h)
+{
+    int found;
+
+    if (s->budget == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&s->lock);
+    found = bsearch_u64(s->frozen, s->n_frozen, h) ||
+            bsearch_u64(s->spill, s->n_spill, h);
+    pthread_mutex_unlock(&s->lock);
+    return found;
+}
+
+/**
+ * @brief: where a URL with hash h and normalized form s->norm is
+ * @param: slot U64* output, its table slot or the empty slot to put it in
+ * @return 1 in the table, 2 spilled, 0 not in the set
+ */
+static int locate(URL_SET *s, U64 h, size_t len, U64 *slot)
+{
+    int maybe = s->budget == 0 || bloom_maybe(&s->bloom, h);
+
+    *slot = probe(s, h, s->norm, len);
+    if (s->hash[*slot] != 0) {
+        return 1;
+    }
+    if (!maybe) {
+        s->n_bloom_neg++;
+        return 0;
+    }
+    if (spilled(s, h)) {
+        return 2;
+    }
+    if (s->budget != 0) {
+        s->n_bloom_fp++;
+    }
+    return 0;
+}
+
+/* double the hash table, stored hashes need no recomputing */
+static int grow_table(URL_SET *s)
+{
+    U64 n_slot = s->n_slot * 2;
+    U64 *hash = calloc(n_slot, sizeof(U64));
+    U32 *id = malloc(n_slot * sizeof(U32));
+    U64 i, j;
+
+    if (hash == NULL || id == NULL) {
+        free(hash);
+        free(id);
+        return 1;
+    }
+    for (i = 0; i < s->n_slot; i++) {
+        if (s->hash[i] == 0) {
+            continue;
+        }
+        for (j = s->hash[i] & (n_slot - 1); hash[j] != 0;
+             j = (j + 1) & (n_slot - 1)) {
+        }
+        hash[j] = s->hash[i];
+        id[j] = s->id[i];
+    }
+    free(s->hash);
+    free(s->id);
+    s->hash = hash;
+    s->id = id;
+    s->n_slot = n_slot;
+    return 0;
+}
+
+/* copy len bytes plus a terminating 0 into the arena */
+static char *intern(URL_SET *s, const char *str, size_t len)
+{
+    char *p;
+
+    if (s->left < len + 1) {
+        size_t size = len + 1 > URL_SET_CHUNK ? len + 1 : URL_SET_CHUNK;
+        if (s->n_chunk == s->max_chunk) {
+            int max = s->max_chunk ? s->max_chunk * 2 : 16;
+            char **c = realloc(s->chunk, max * sizeof(char *));
+            if (c == NULL) {
+                return NULL;
+            }
+            s->chunk = c;
+            s->max_chunk = max;
+        }
+        if ((p = malloc(size)) == NULL) {
+            return NULL;
+        }
+        s->chunk[s->n_chunk++] = p;
+        s->arena += size;
+        s->top = p;
+        s->left = size;
+    }
+    p = s->top;
+    memcpy(p, str, len);
+    p[len] = 0;
+    s->top += len + 1;
+    s->left -= len + 1;
+    return p;
+}
+
+/**
+ * @brief: set up an empty set
+ * @param: expect U32 URLs expected, the set grows past it as needed
+ * @return 0 on success, 1 if out of memory
+ */
+int url_set_init(URL_SET *s, U32 expect)
+{
+    memset(s, 0, sizeof(*s));
+    s->n_slot = URL_SET_MIN_SLOTS;
+    while (s->n_slot / 4 * 3 < expect) {
+        s->n_slot *= 2;
+    }
+    s->min_slot = s->n_slot;
+    s->spill_fd = -1;
+    s->hash = calloc(s->n_slot, sizeof(U64));
+    s->id = malloc(s->n_slot * sizeof(U32));
+    if (s->hash == NULL || s->id == NULL) {
+        url_set_cleanup(s);
+        return 1;
+    }
+    return 0;
+}
+
+void url_set_cleanup(URL_SET *s)
+{
+    int i;
+
+    url_set_sync(s);
+    if (s->budget != 0) {
+        bloom_cleanup(&s->bloom);
+        pthread_mutex_destroy(&s->lock);
+    }
+    if (s->spill != NULL) {
+        munmap(s->spill, s->n_spill * sizeof(U64));
+    }
+    if (s->spill_fd >= 0) {
+        close(s->spill_fd);
+    }
+    free(s->frozen);
+    for (i = 0; i < s->n_chunk; i++) {
+        free(s->chunk[i]);
+    }
+    free(s->chunk);
+    free(s->hash);
+    free(s->id);
+    free(s->url);
+    free(s->norm);
+    memset(s, 0, sizeof(*s));
+}
+
+/**
+ * @brief: add a URL unless its normalized form is already in the set
+ * @param: id U32* optional output, id of the URL, new or old;
+ *         URL_SET_NIL for an old URL that was spilled
+ * @return 1 if the URL was added, 0 if it was there already,
+ *         -1 if out of memory or the set holds URL_SET_NIL URLs
+ */
+int url_set_add(URL_SET *s, const char *url, U32 *id)
+{
+    long len = url_normalize(s, url);
+    U64 h, i;
+    char *p;
+
+    if (len < 0) {
+        return -1;
+    }
+    h = url_hash(s->norm, len);
+    switch (locate(s, h, len, &i)) {
+    case 1:
+        if (id != NULL) {
+            *id = s->id[i];
+        }
+        return 0;
+    case 2:
+        if (id != NULL) {
+            *id = URL_SET_NIL;
+        }
+        return 0;
+    }
+    if (s->n == URL_SET_NIL) {
+        return -1;
+    }
+    if (s->n == s->max) {
+        U32 max = s->max ? (s->max > URL_SET_NIL / 2 ? URL_SET_NIL :
+                            s->max * 2) : URL_SET_MIN_SLOTS;
+        char **u = realloc(s->url, (size_t) max * sizeof(char *));
+        if (u == NULL) {
+            return -1;
+        }
+        s->url = u;
+        s->max = max;
+    }
+    if ((p = intern(s, s->norm, len)) == NULL) {
+        return -1;
+    }
+    if (s->n_table + 1 > s->n_slot / 4 * 3) {
+        if (grow_table(s) != 0) {
+            return -1;   /* p stays in the arena, unused */
+        }
+        i = probe(s, h, s->norm, len);
+    }
+    if (s->budget != 0) {
+        bloom_add(&s->bloom, h);
+    }
+    s->url[s->n] = p;
+    s->hash[i] = h;
+    s->id[i] = s->n;
+    s->n_table++;
+    if (id != NULL) {
+        *id = s->n;
+    }
+    s->n++;
+    return 1;
+}
+
+/**
+ * @brief: 1 if the URL is in the set, in memory or spilled, 0 if it is
+ *         not (or if out of memory)
+ */
+int url_set_seen(URL_SET *s, const char *url)
+{
+    long len = url_normalize(s, url);
+    U64 i;
+
+    if (len < 0) {
+        return 0;
+    }
+    return locate(s, url_hash(s->norm, len), len, &i) != 0;
+}
+
+/**
+ * @brief: turn on the Bloom filter and the spill file
+ * @param: budget size_t heap bytes (see url_set_mem()) above which
+ *         url_set_compact() spills
+ * @param: expect U64 URLs the whole crawl may add, sizes the filter at
+ *         BLOOM_BITS_PER_KEY bits each; past that its false positive
+ *         rate climbs but answers stay right
+ * @return 0 on success, 1 if out of memory or already on
+ */
+int url_set_budget(URL_SET *s, size_t budget, U64 expect)
+{
+    U64 i;
+
+    if (budget == 0 || s->budget != 0 ||
+        bloom_init(&s->bloom, expect, BLOOM_BITS_PER_KEY) != 0) {
+        return 1;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    for (i = 0; i < s->n_slot; i++) {
+        if (s->hash[i] != 0) {
+            bloom_add(&s->bloom, s->hash[i]);
+        }
+    }
+    s->budget = budget;
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    U64 x = *(const U64 *) a, y = *(const U64 *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* merge frozen and the spill file into a new spill file, then swap */
+static void *merge_main(void *arg)
+{
+    URL_SET *s = arg;
+    U64 *buf = malloc(URL_SET_MERGE_BUF * sizeof(U64));
+    U64 *a = s->frozen, *b = s->spill, *map = NULL;
+    U64 na = s->n_frozen, nb = s->n_spill, n = 0, k = 0;
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/url_set.XXXXXX", dir ? dir : "/tmp");
+    fd = mkstemp(path);
+    if (fd < 0 || buf == NULL) {
+        goto fail;
+    }
+    unlink(path);
+    while (na > 0 || nb > 0) {
+        U64 v;
+        if (nb == 0 || (na > 0 && *a <= *b)) {
+            v = *a++;
+            na--;
+            if (nb > 0 && *b == v) {
+                b++;
+                nb--;
+            }
+        } else {
+            v = *b++;
+            nb--;
+        }
+        buf[k++] = v;
+        n++;
+        if (k == URL_SET_MERGE_BUF) {
+            if (write_full(fd, buf, k * sizeof(U64)) != 0) {
+                goto fail;
+            }
+            k = 0;
+        }
+    }
+    if (write_full(fd, buf, k * sizeof(U64)) != 0) {
+        goto fail;
+    }
+    map = mmap(NULL, n * sizeof(U64), PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        goto fail;
+    }
+    madvise(map, n * sizeof(U64), MADV_RANDOM);
+    free(buf);
+
+    pthread_mutex_lock(&s->lock);
+    a = s->frozen;
+    b = s->spill;
+    nb = s->n_spill;
+    k = s->spill_fd;
+    s->frozen = NULL;
+    __atomic_store_n(&s->n_frozen, 0, __ATOMIC_RELAXED);
+    s->spill = map;
+    s->n_spill = n;
+    s->spill_fd = fd;
+    pthread_mutex_unlock(&s->lock);
+
+    free(a);
+    if (b != NULL) {
+        munmap(b, nb * sizeof(U64));
+    }
+    if ((int) k >= 0) {
+        close(k);
+    }
+    return NULL;
+
+fail:
+    perror("url_set spill");
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buf);
+    pthread_mutex_lock(&s->lock);
+    s->spill_err = 1;
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/**
+ * @brief: when over budget, spill the table to disk and keep only the
+ *         frontier in memory. Does nothing while the frontier is more
+ *         than half of the URLs, dropping the rest would free too little.
+ * @param: next U32* in/out, first URL id not crawled yet; the frontier
+ *         [*next, url_set_count()) is renumbered from 0 and *next set to 0
+ * @return 1 if it spilled, 0 if not, -1 if out of memory or the last
+ *         merge failed
+ */
+int url_set_compact(URL_SET *s, U32 *next)
+{
+    U32 n_keep = s->n - *next;
+    size_t need = 0, size;
+    char **chunk, **url, *p;
+    U64 *frozen, *hash;
+    U32 *id, i;
+    U64 j, k = 0;
+
+    if (s->budget == 0 || url_set_mem(s) <= s->budget ||
+        n_keep > s->n / 2 ||
+        (s->arena - s->left) +
+        (s->n_slot - s->min_slot) * (sizeof(U64) + sizeof(U32)) <
+        s->budget / 2) {
+        return 0;   /* nothing worth a merge to free */
+    }
+    if (url_set_sync(s) != 0) {
+        return -1;
+    }
+    for (i = *next; i < s->n; i++) {
+        need += strlen(s->url[i]) + 1;
+    }
+    size = need > URL_SET_CHUNK ? need : URL_SET_CHUNK;
+    frozen = malloc(s->n_table * sizeof(U64) + 1);
+    chunk = malloc(16 * sizeof(char *));
+    p = malloc(size);
+    hash = calloc(s->min_slot, sizeof(U64));
+    id = malloc(s->min_slot * sizeof(U32));
+    if (frozen == NULL || chunk == NULL || p == NULL || hash == NULL ||
+        id == NULL) {
+        free(frozen);
+        free(chunk);
+        free(p);
+        free(hash);
+        free(id);
+        return -1;
+    }
+
+    for (j = 0; j < s->n_slot; j++) {
+        if (s->hash[j] != 0) {
+            frozen[k++] = s->hash[j];
+        }
+    }
+    qsort(frozen, k, sizeof(U64), cmp_u64);
+
+    /* the frontier moves to one fresh chunk, the old ones go */
+    for (i = 0; i < n_keep; i++) {
+        size_t len = strlen(s->url[*next + i]) + 1;
+        memcpy(p, s->url[*next + i], len);
+        s->url[i] = p;
+        p += len;
+    }
+    i = n_keep > URL_SET_MIN_SLOTS ? n_keep : URL_SET_MIN_SLOTS;
+    if (i < s->max && (url = realloc(s->url, (size_t) i * sizeof(char *)))) {
+        s->url = url;   /* shrink, keeps the old array if that fails */
+        s->max = i;
+    }
+    for (i = 0; i < (U32) s->n_chunk; i++) {
+        free(s->chunk[i]);
+    }
+    free(s->chunk);
+    s->chunk = chunk;
+    s->chunk[0] = p - need;
+    s->n_chunk = 1;
+    s->max_chunk = 16;
+    s->arena = size;
+    s->top = p;
+    s->left = size - need;
+
+    free(s->hash);
+    free(s->id);
+    s->hash = hash;
+    s->id = id;
+    s->n_slot = s->min_slot;
+    s->n_table = 0;
+    s->n = n_keep;
+    *next = 0;
+
+    pthread_mutex_lock(&s->lock);
+    s->frozen = frozen;
+    s->n_frozen = k;
+    pthread_mutex_unlock(&s->lock);
+    if (pthread_create(&s->merger, NULL, merge_main, s) != 0) {
+        s->spill_err = 1;   /* frozen stays, searched in memory */
+        return -1;
+    }
+    s->merging = 1;
+    return 1;
+}
+
+/**
+ * @brief: wait for a background merge to finish
+ * @return 0, -1 if a merge failed
+ */
+int url_set_sync(URL_SET *s)
+{
+    if (s->merging) {
+        pthread_join(s->merger, NULL);
+        s->merging = 0;
+    }
+    return s->spill_err ? -1 : 0;
+}
+
+/**
+ * @brief: the normalized URL with the given id, NULL if there is none
+ */
+const char *url_set_get(const URL_SET *s, U32 id)
+{
+    return id < s->n ? s->url[id] : NULL;
+}
+
+U32 url_set_count(const URL_SET *s)
+{
+    return s->n;
+}
+
+/**
+ * @brief: bytes of heap the set holds
+ */
+size_t url_set_mem(const URL_SET *s)
+{
+    return s->n_slot * (sizeof(U64) + sizeof(U32)) +
+           (size_t) s->max * sizeof(char *) +
+           s->arena + s->norm_cap + bloom_size(&s->bloom) +
+           __atomic_load_n(&s->n_frozen, __ATOMIC_RELAXED) * sizeof(U64);
+}
@@ -0,0 +1,85 @@
+/**
+ * @brief: growable, string-interned URL set for the findpng3 crawler
+ *
+ * Every URL is normalized (lower case scheme and host, default port and
+ * fragment dropped) and copied once into an arena of large chunks, then
+ * indexed by an open-addressing hash table keyed by a 64-bit hash of the
+ * normalized string. URLs get dense ids in insertion order, so the ids
+ * [next, url_set_count()) are the crawl frontier and everything below
+ * next has been visited.
+ *
+ * Memory per URL is its length + 1 in the arena, one or two pointers in
+ * the id table (it doubles) and 16 .. 32 bytes of hash slots (12 byte
+ * slots at a load factor of 3/8 .. 3/4): strlen + 25 .. strlen + 49.
+ *
+ * For crawls that outgrow memory, url_set_budget() adds two tiers behind
+ * the table. A blocked Bloom filter holds every URL ever added. Once the
+ * heap use passes the budget, url_set_compact() moves the 64-bit hashes
+ * of the table into a sorted, mmap'd spill file, merged with the previous
+ * one by a background thread. The strings of the visited URLs are
+ * dropped and only the frontier is kept. A URL the filter has never seen
+ * is new without touching the table or the file. Otherwise the table is
+ * probed and then the spill file is binary searched. Spilled URLs are
+ * matched by hash alone: at n URLs the chance that a new one is taken
+ * for a spilled one is about n / 2^64.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include "bloom.h"
+
+typedef unsigned int U32;
+typedef unsigned long int U64;
+
+#define URL_SET_NIL 0xffffffffU           /* no such URL               */
+#define URL_SET_CHUNK (1024 * 1024)       /* arena chunk, bytes        */
+#define URL_SET_MIN_SLOTS 1024
+#define URL_SET_MERGE_BUF (64 * 1024)     /* hashes per spill write    */
+
+typedef struct url_set {
+    U64 *hash;           /* n_slot hashes, 0 marks an empty slot        */
+    U32 *id;             /* n_slot ids, valid where hash != 0           */
+    U64 n_slot;          /* power of two                                */
+    U64 n_table;         /* URLs in the table                           */
+    U64 min_slot;        /* n_slot after url_set_init()                 */
+    char **url;          /* id -> interned, normalized URL              */
+    U32 n;               /* URLs in the set                             */
+    U32 max;             /* capacity of url                             */
+    char **chunk;        /* arena chunks, freed by url_set_cleanup()    */
+    int n_chunk;
+    int max_chunk;
+    size_t arena;        /* bytes in all chunks                         */
+    char *top;           /* free space in the current chunk             */
+    size_t left;
+    char *norm;          /* scratch for url_normalize()                 */
+    size_t norm_cap;
+
+    /* tiers past the table, off until url_set_budget() */
+    size_t budget;       /* heap bytes that trigger a spill, 0: never   */
+    BLOOM bloom;         /* every URL ever added                        */
+    pthread_mutex_t lock;   /* guards frozen and spill                  */
+    U64 *frozen;         /* sorted hashes being merged into the spill   */
+    U64 n_frozen;
+    U64 *spill;          /* sorted hashes in the spill file, read only  */
+    U64 n_spill;
+    int spill_fd;
+    pthread_t merger;
+    int merging;         /* merger needs joining                        */
+    int spill_err;       /* a merge failed, frozen stays in memory      */
+    U64 n_bloom_neg;     /* new URLs the filter caught                  */
+    U64 n_bloom_fp;      /* new URLs the filter let through             */
+} URL_SET;
+
+int url_set_init(URL_SET *s, U32 expect);
+void url_set_cleanup(URL_SET *s);
+int url_set_add(URL_SET *s, const char *url, U32 *id);
+int url_set_seen(URL_SET *s, const char *url);
+int url_set_budget(URL_SET *s, size_t budget, U64 expect);
+int url_set_compact(URL_SET *s, U32 *next);
+int url_set_sync(URL_SET *s);
+const char *url_set_get(const URL_SET *s, U32 id);
+U32 url_set_count(const URL_SET *s);
+size_t url_set_mem(const URL_SET *s);
+U64 url_hash(const char *buf, size_t len);
@@ -10,8 +10,30 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
 #include "zutil.h"
 
+/* one independently compressed slice of the input, see mem_def_mt() */
+typedef struct def_block {
+    U8 *in;          /* first input byte of this block            */
+    U64 in_len;      /* input bytes in this block                 */
+    U8 *dict;        /* up to DEF_MT_DICT bytes preceding in      */
+    U64 dict_len;
+    U8 *out;         /* raw deflate output, malloc'd by worker    */
+    U64 out_len;
+    uLong adler;     /* adler32 of in[0..in_len-1]                */
+    int last;        /* last block ends the deflate stream        */
+    int ret;         /* zlib return code                          */
+} DEF_BLOCK;
+
+typedef struct def_job {
+    DEF_BLOCK *blocks;
+    int nblocks;
+    int next;        /* next block to hand out, atomic            */
+    int level;
+} DEF_JOB;
+
 /**
  * @brief: deflate in memory data from source to dest.
  *         The memory areas must not overlap.
@@ -30,7 +52,6 @@
 int mem_def(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len, int level)
 {
     z_stream strm;    /* pass info. to and from zlib routines   */
-    U8 out[CHUNK];    /* output buffer for deflate()            */
     int ret = 0;      /* zlib return code                       */
     int have = 0;     /* amount of data returned from deflate() */
     int def_len = 0;  /* accumulated deflated data length       */
@@ -50,16 +71,15 @@ int mem_def(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len, int level)
     strm.avail_in = source_len;
     strm.next_in = source;
 
-    /* call deflate repetitively since the out buffer size is fixed
-     and the deflated output data length is not known ahead of time */
+    /* call deflate repetitively, CHUNK bytes at a time straight into
+     dest, since the deflated output data length is not known ahead of time */
 
     do {
         strm.avail_out = CHUNK;
-        strm.next_out = out;
+        strm.next_out = p_dest;
         ret = deflate(&strm, Z_FINISH); /* source contains the whole data */
         assert(ret != Z_STREAM_ERROR);
         have = CHUNK - strm.avail_out;
-        memcpy(p_dest, out, have);
         p_dest += have;  /* advance to the next free byte to write */
         def_len += have; /* increment deflated data length         */
     } while (strm.avail_out == 0);
@@ -87,7 +107,6 @@ int mem_def(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len, int level)
 int mem_inf(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len)
 {
     z_stream strm;    /* pass info. to and from zlib routines   */
-    U8 out[CHUNK];    /* output buffer for inflate()            */
     int ret = 0;      /* zlib return code                       */
     int have = 0;     /* amount of data returned from inflate() */
     int inf_len = 0;  /* accumulated inflated data length       */
@@ -108,10 +127,11 @@ int mem_inf(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len)
     strm.avail_in = source_len;
     strm.next_in = source;
 
-    /* run inflate() on input until output buffer not full */
+    /* run inflate() on input, CHUNK bytes at a time straight into dest,
+       until output window not full */
     do {
         strm.avail_out = CHUNK;
-        strm.next_out = out;
+        strm.next_out = p_dest;
 
         /* zlib format is self-terminating, no need to flush */
         ret = inflate(&strm, Z_NO_FLUSH);
@@ -125,7 +145,6 @@ int mem_inf(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len)
                 return ret;
         }
         have = CHUNK - strm.avail_out;
-        memcpy(p_dest, out, have);
         p_dest += have;  /* advance to the next free byte to write */
         inf_len += have; /* increment inflated data length         */
     } while (strm.avail_out == 0 );
@@ -137,6 +156,542 @@ int mem_inf(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len)
     return (ret == Z_STREAM_END) ? Z_OK : Z_DATA_ERROR;
 }
 
+/**
+ * @brief: worker for mem_def_mt(). Claims blocks until none are left and
+ *         deflates each one into a raw (headerless) deflate fragment.
+ *         Non-last blocks end with Z_SYNC_FLUSH so they finish on a byte
+ *         boundary and can be concatenated; the window is primed with
+ *         the previous 32K of input so matches may reach back across
+ *         the block boundary just like in a single stream.
+ */
+static void *def_worker(void *arg)
+{
+    DEF_JOB *job = arg;
+    z_stream strm;
+    int i;
+
+    strm.zalloc = Z_NULL;
+    strm.zfree  = Z_NULL;
+    strm.opaque = Z_NULL;
+    if (deflateInit2(&strm, job->level, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        /* mark everything unclaimed as failed */
+        while ((i = __sync_fetch_and_add(&job->next, 1)) < job->nblocks) {
+            job->blocks[i].ret = Z_MEM_ERROR;
+        }
+        return NULL;
+    }
+
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->nblocks) {
+        DEF_BLOCK *b = &job->blocks[i];
+        U64 cap = deflateBound(&strm, b->in_len) + 16;
+
+        b->adler = adler32(1L, b->in, b->in_len);
+        b->out = malloc(cap);
+        if (b->out == NULL) {
+            b->ret = Z_MEM_ERROR;
+            continue;
+        }
+        deflateReset(&strm);
+        if (b->dict_len) {
+            deflateSetDictionary(&strm, b->dict, b->dict_len);
+        }
+        strm.next_in   = b->in;
+        strm.avail_in  = b->in_len;
+        strm.next_out  = b->out;
+        strm.avail_out = cap;
+        b->ret = deflate(&strm, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+        if (b->ret == Z_STREAM_END || (b->ret == Z_OK && !b->last)) {
+            b->ret = Z_OK;
+        } else if (b->ret == Z_OK) {
+            b->ret = Z_BUF_ERROR;  /* cap was too small, should not happen */
+        }
+        assert(strm.avail_in == 0);
+        b->out_len = cap - strm.avail_out;
+    }
+    (void) deflateEnd(&strm);
+    return NULL;
+}
+
+/**
+ * @brief: upper bound of the output of mem_def_mt() for source_len bytes
+ */
+U64 mem_def_mt_bound(U64 source_len)
+{
+    U64 nblocks = source_len / DEF_MT_BLOCK + 1;
+    return compressBound(source_len) + nblocks * 16 + 6;
+}
+
+/**
+ * @brief: deflate in memory data from source to dest using several threads
+ *         (pigz style). The source is cut into DEF_MT_BLOCK sized blocks,
+ *         each block is deflated on its own with the preceding 32K as a
+ *         preset dictionary, and the fragments are stitched into a single
+ *         zlib stream whose Adler-32 is combined from the per block sums.
+ * @param: dest U8* output buffer, caller supplies, at least
+ *         mem_def_mt_bound(source_len) bytes
+ * @param: dest_len, U64* output parameter, points to length of deflated data
+ * @param: source U8* source buffer, contains data to be deflated
+ * @param: source_len U64 length of source data
+ * @param: level int compression level, as for mem_def()
+ * @param: nthreads int number of worker threads, <= 1 falls back to mem_def()
+ * @return =0  on success
+ *         <>0 on error
+ * NOTE: the output is slightly larger than mem_def() at the same level
+ *       because of the 5 byte sync marker per block.
+ */
+int mem_def_mt(U8 *dest, U64 *dest_len, U8 *source, U64 source_len,
+               int level, int nthreads)
+{
+    DEF_JOB job;
+    pthread_t *tids;
+    U8 *p_dest = dest;
+    uLong adler = 1L;
+    int flevel, i, n;
+    unsigned int header;
+    int ret = Z_OK;
+
+    if (nthreads <= 1 || source_len <= DEF_MT_BLOCK) {
+        return mem_def(dest, dest_len, source, source_len, level);
+    }
+
+    job.nblocks = (source_len + DEF_MT_BLOCK - 1) / DEF_MT_BLOCK;
+    job.next = 0;
+    job.level = level;
+    job.blocks = calloc(job.nblocks, sizeof(DEF_BLOCK));
+    if (job.blocks == NULL) {
+        return Z_MEM_ERROR;
+    }
+    for (i = 0; i < job.nblocks; i++) {
+        DEF_BLOCK *b = &job.blocks[i];
+        U64 off = (U64) i * DEF_MT_BLOCK;
+
+        b->in = source + off;
+        b->in_len = source_len - off < DEF_MT_BLOCK ? source_len - off
+                                                    : DEF_MT_BLOCK;
+        b->dict_len = off < DEF_MT_DICT ? off : DEF_MT_DICT;
+        b->dict = b->in - b->dict_len;
+        b->last = (i == job.nblocks - 1);
+    }
+
+    n = nthreads < job.nblocks ? nthreads : job.nblocks;
+    tids = malloc(n * sizeof(pthread_t));
+    if (tids == NULL) {
+        free(job.blocks);
+        return Z_MEM_ERROR;
+    }
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&tids[i], NULL, def_worker, &job) != 0) {
+            break;
+        }
+    }
+    n = i;
+    if (n == 0) {
+        def_worker(&job);  /* no thread could be started, do it here */
+    }
+    for (i = 0; i < n; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+
+    /* zlib header: deflate, 32K window, FLEVEL from level, FCHECK */
+    if (level == Z_DEFAULT_COMPRESSION || level == 6) {
+        flevel = 2;
+    } else {
+        flevel = level < 2 ? 0 : (level < 6 ? 1 : 3);
+    }
+    header = (0x78 << 8) | (flevel << 6);
+    header += 31 - header % 31;
+    *p_dest++ = header >> 8;
+    *p_dest++ = header & 0xff;
+
+    for (i = 0; i < job.nblocks; i++) {
+        DEF_BLOCK *b = &job.blocks[i];
+
+        if (ret == Z_OK && b->ret != Z_OK) {
+            ret = b->ret;
+        }
+        if (ret == Z_OK) {
+            memcpy(p_dest, b->out, b->out_len);
+            p_dest += b->out_len;
+            adler = adler32_combine(adler, b->adler, b->in_len);
+        }
+        free(b->out);
+    }
+    free(job.blocks);
+    if (ret != Z_OK) {
+        return ret;
+    }
+
+    /* zlib trailer: Adler-32 of the whole input, big endian */
+    *p_dest++ = (adler >> 24) & 0xff;
+    *p_dest++ = (adler >> 16) & 0xff;
+    *p_dest++ = (adler >> 8) & 0xff;
+    *p_dest++ = adler & 0xff;
+
+    *dest_len = p_dest - dest;
+    return Z_OK;
+}
+
+/**
+ * @brief: copy the raw deflate data of one zlib stream to dest so that
+ *         another deflate stream can follow it (the trick of zlib's
+ *         examples/gzjoin.c). Block boundaries are only found by decoding,
+ *         so the stream is inflated into a scratch buffer and thrown away;
+ *         the compressed bytes themselves are copied untouched except for
+ *         the last-block bit and the final partial byte.
+ * @param: dest U8* output, at least source_len + 4 bytes
+ * @param: dest_len U64* output parameter, bytes written to dest
+ * @param: source U8* zlib stream (2 byte header, deflate data, adler32)
+ * @param: source_len U64 length of the zlib stream
+ * @param: not_last int when set the last-block bit is cleared and empty
+ *         blocks are appended to reach a byte boundary
+ * @param: adler uLong* output parameter, Adler-32 from the stream trailer
+ * @param: raw_len U64* output parameter, inflated length
+ * @return =0  on success
+ *         <>0 on error
+ */
+static int mem_join_one(U8 *dest, U64 *dest_len, U8 *source, U64 source_len,
+                        int not_last, uLong *adler, U64 *raw_len)
+{
+    z_stream strm;
+    U8 junk[CHUNK];    /* inflated data, only needed to walk the blocks */
+    U8 *raw;           /* first byte of deflate data                    */
+    U64 raw_size;      /* deflate data plus anything up to the trailer  */
+    U64 used;          /* deflate bytes consumed, last one maybe partial*/
+    int last, pos, ret;
+
+    if (source_len < 2 + 1 + 4 ||
+        (source[0] & 0x0f) != Z_DEFLATED || (source[1] & 0x20) ||
+        ((source[0] << 8) | source[1]) % 31 != 0) {
+        return Z_DATA_ERROR;  /* not zlib, or needs a preset dictionary */
+    }
+    raw = source + 2;
+    raw_size = source_len - 2 - 4;
+
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    ret = inflateInit2(&strm, -MAX_WBITS);
+    if (ret != Z_OK) {
+        return ret;
+    }
+    strm.next_in = raw;
+    strm.avail_in = raw_size;
+    memcpy(dest, raw, raw_size);
+
+    /* first block header starts at bit 0 of byte 0 */
+    last = raw[0] & 1;
+    if (last && not_last) {
+        dest[0] &= ~1;
+    }
+    for (;;) {
+        strm.next_out = junk;
+        strm.avail_out = CHUNK;
+        ret = inflate(&strm, Z_BLOCK);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            (void) inflateEnd(&strm);
+            return ret == Z_BUF_ERROR ? Z_DATA_ERROR : ret;
+        }
+        if (!(strm.data_type & 128)) {  /* not at a block boundary yet */
+            if (ret == Z_STREAM_END ||
+                (strm.avail_in == 0 && strm.avail_out != 0)) {
+                (void) inflateEnd(&strm);
+                return Z_DATA_ERROR;    /* ran out of input mid block  */
+            }
+            continue;
+        }
+        if (last) {
+            break;
+        }
+        /* locate the next block's last-block bit */
+        pos = strm.data_type & 7;       /* unused bits in last byte    */
+        if (pos != 0) {
+            pos = 0x100 >> pos;
+            last = strm.next_in[-1] & pos;
+            if (last && not_last) {
+                dest[strm.next_in - raw - 1] &= ~pos;
+            }
+        } else {
+            if (strm.avail_in == 0) {
+                (void) inflateEnd(&strm);
+                return Z_DATA_ERROR;
+            }
+            last = strm.next_in[0] & 1;
+            if (last && not_last) {
+                dest[strm.next_in - raw] &= ~1;
+            }
+        }
+    }
+    pos = strm.data_type & 7;
+    used = strm.next_in - raw;
+    *raw_len = strm.total_out;
+    (void) inflateEnd(&strm);
+    *adler = ((uLong) source[source_len - 4] << 24) |
+             ((uLong) source[source_len - 3] << 16) |
+             ((uLong) source[source_len - 2] << 8) |
+             (uLong) source[source_len - 1];
+
+    *dest_len = used;
+    if (pos == 0 || !not_last) {
+        return Z_OK;
+    }
+    /* pad to a byte boundary with empty blocks */
+    dest[used - 1] &= (0x100 >> pos) - 1;
+    if (pos & 1) {
+        /* odd: one empty stored block */
+        if (pos == 1) {
+            dest[(*dest_len)++] = 0;  /* block header spills over */
+        }
+        memcpy(dest + *dest_len, "\0\0\xff\xff", 4);
+        *dest_len += 4;
+    } else {
+        /* even: 1, 2 or 3 empty fixed blocks */
+        U8 *p = dest + used - 1;
+        switch (pos) {
+            case 6:
+                *p++ |= 8;
+                *p = 0;
+                /* fall through */
+            case 4:
+                *p++ |= 0x20;
+                *p = 0;
+                /* fall through */
+            case 2:
+                *p++ |= 0x80;
+                *p++ = 0;
+        }
+        *dest_len = p - dest;
+    }
+    return Z_OK;
+}
+
+/**
+ * @brief: join n zlib streams into one zlib stream whose inflated data is
+ *         the concatenation of the n inflated inputs, without recompressing.
+ *         The Adler-32 of the result is combined from the input trailers.
+ * @param: dest U8* output buffer, caller supplies, at least the sum of
+ *         source_lens plus 8 bytes per source
+ * @param: dest_len, U64* output parameter, length of the joined stream
+ * @param: sources U8** n zlib streams
+ * @param: source_lens U64* their lengths
+ * @param: n int number of streams, > 0
+ * @return =0  on success
+ *         <>0 on error
+ */
+int mem_join(U8 *dest, U64 *dest_len, U8 **sources, U64 *source_lens, int n)
+{
+    U8 *p_dest = dest;
+    uLong adler = 1L, adler_now;
+    U64 len_now, raw_len;
+    int i, ret;
+
+    if (n <= 0) {
+        return Z_STREAM_ERROR;
+    }
+    /* reuse the first stream's header, it carries a valid FLEVEL */
+    *p_dest++ = sources[0][0];
+    *p_dest++ = sources[0][1];
+    for (i = 0; i < n; i++) {
+        ret = mem_join_one(p_dest, &len_now, sources[i], source_lens[i],
+                           i < n - 1, &adler_now, &raw_len);
+        if (ret != Z_OK) {
+            return ret;
+        }
+        p_dest += len_now;
+        adler = adler32_combine(adler, adler_now, raw_len);
+    }
+    *p_dest++ = (adler >> 24) & 0xff;
+    *p_dest++ = (adler >> 16) & 0xff;
+    *p_dest++ = (adler >> 8) & 0xff;
+    *p_dest++ = adler & 0xff;
+    *dest_len = p_dest - dest;
+    return Z_OK;
+}
+
+/**
+ * @brief: set up a reusable deflate state producing a zlib stream.
+ *         Unlike mem_def() the state lives across calls: feed input with
+ *         zs_run() as it becomes available, zs_reset() to start the next
+ *         stream with the same allocation, zs_end() to free it.
+ * @param: zs ZS_STREAM* state, caller supplies
+ * @param: level int compression level, as for mem_def()
+ * @return =0  on success
+ *         <>0 on error
+ */
+int zs_def_init(ZS_STREAM *zs, int level)
+{
+    zs->strm.zalloc = Z_NULL;
+    zs->strm.zfree  = Z_NULL;
+    zs->strm.opaque = Z_NULL;
+    zs->mode = ZS_DEFLATE;
+    zs->ended = 0;
+    return deflateInit(&zs->strm, level);
+}
+
+/**
+ * @brief: set up a reusable inflate state for zlib streams, see
+ *         zs_def_init()
+ */
+int zs_inf_init(ZS_STREAM *zs)
+{
+    zs->strm.zalloc = Z_NULL;
+    zs->strm.zfree  = Z_NULL;
+    zs->strm.opaque = Z_NULL;
+    zs->strm.avail_in = 0;
+    zs->strm.next_in = Z_NULL;
+    zs->mode = ZS_INFLATE;
+    zs->ended = 0;
+    return inflateInit(&zs->strm);
+}
+
+/**
+ * @brief: start a new stream on an existing state, keeping its memory
+ */
+int zs_reset(ZS_STREAM *zs)
+{
+    zs->ended = 0;
+    return zs->mode == ZS_DEFLATE ? deflateReset(&zs->strm)
+                                  : inflateReset(&zs->strm);
+}
+
+/**
+ * @brief: free the zlib state of zs
+ */
+void zs_end(ZS_STREAM *zs)
+{
+    if (zs->mode == ZS_DEFLATE) {
+        (void) deflateEnd(&zs->strm);
+    } else {
+        (void) inflateEnd(&zs->strm);
+    }
+}
+
+/**
+ * @brief: push a piece of input through zs, writing output straight into
+ *         the caller's buffer. Stops when the input is used up (and, for
+ *         a deflate flush, everything is flushed), when dest is full or
+ *         at the end of the stream; the caller continues with the rest.
+ * @param: zs ZS_STREAM* state from zs_def_init() or zs_inf_init()
+ * @param: src U8* input bytes, may be a fragment of the whole stream
+ * @param: src_len U64 length of src
+ * @param: src_used U64* output parameter, input bytes consumed
+ * @param: dest U8* output buffer, caller supplies
+ * @param: dest_cap U64 free space in dest
+ * @param: dest_len U64* output parameter, bytes written to dest
+ * @param: flush int deflate only: Z_NO_FLUSH, Z_SYNC_FLUSH or Z_FINISH
+ *         applied once the last byte of src is consumed
+ * @return Z_OK          progress made, call again with more input/output
+ *         Z_STREAM_END  stream complete
+ *         other         zlib error
+ */
+int zs_run(ZS_STREAM *zs, U8 *src, U64 src_len, U64 *src_used,
+           U8 *dest, U64 dest_cap, U64 *dest_len, int flush)
+{
+    z_stream *strm = &zs->strm;
+    U64 in_left = src_len;
+    U64 out_left = dest_cap;
+    uInt in_now, out_now;
+    int ret = Z_OK;
+
+    *src_used = 0;
+    *dest_len = 0;
+    if (zs->ended) {
+        return Z_STREAM_END;
+    }
+    strm->next_in = src;
+    strm->next_out = dest;
+    for (;;) {
+        /* avail_in/avail_out are 32 bit, hand over at most ZS_STEP */
+        in_now = in_left > ZS_STEP ? ZS_STEP : in_left;
+        out_now = out_left > ZS_STEP ? ZS_STEP : out_left;
+        strm->avail_in = in_now;
+        strm->avail_out = out_now;
+        if (zs->mode == ZS_DEFLATE) {
+            ret = deflate(strm, in_now == in_left ? flush : Z_NO_FLUSH);
+        } else {
+            ret = inflate(strm, Z_NO_FLUSH);
+        }
+        in_left -= in_now - strm->avail_in;
+        out_left -= out_now - strm->avail_out;
+        if (ret == Z_STREAM_END) {
+            zs->ended = 1;
+            break;
+        }
+        if (ret == Z_NEED_DICT) {
+            ret = Z_DATA_ERROR;
+        }
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            break;
+        }
+        ret = Z_OK;  /* Z_BUF_ERROR only means no progress was possible */
+        if (out_left == 0 || (in_left == 0 && strm->avail_out != 0)) {
+            break;
+        }
+    }
+    *src_used = src_len - in_left;
+    *dest_len = dest_cap - out_left;
+    return ret;
+}
+
+/**
+ * @brief: like zs_run() but consumes all of src, appending the output to
+ *         a growable sink
+ * @return Z_OK, Z_STREAM_END or a zlib error, as zs_run()
+ */
+int zs_run_sink(ZS_STREAM *zs, U8 *src, U64 src_len, int flush,
+                ZS_SINK *sink)
+{
+    U64 used, len;
+    int ret;
+
+    do {
+        if (sink->max_size - sink->size < CHUNK) {
+            U64 new_size = sink->max_size * 2 + CHUNK;
+            U8 *q = realloc(sink->buf, new_size);
+            if (q == NULL) {
+                return Z_MEM_ERROR;
+            }
+            sink->buf = q;
+            sink->max_size = new_size;
+        }
+        ret = zs_run(zs, src, src_len, &used, sink->buf + sink->size,
+                     sink->max_size - sink->size, &len, flush);
+        src += used;
+        src_len -= used;
+        sink->size += len;
+    } while (ret == Z_OK && (src_len > 0 || sink->size == sink->max_size));
+    return ret;
+}
+
+int zs_sink_init(ZS_SINK *sink, U64 max_size)
+{
+    if (sink == NULL) {
+        return 1;
+    }
+    sink->buf = malloc(max_size ? max_size : CHUNK);
+    if (sink->buf == NULL) {
+        return 2;
+    }
+    sink->size = 0;
+    sink->max_size = max_size ? max_size : CHUNK;
+    return 0;
+}
+
+int zs_sink_cleanup(ZS_SINK *sink)
+{
+    if (sink == NULL) {
+        return 1;
+    }
+    free(sink->buf);
+    sink->buf = NULL;
+    sink->size = 0;
+    sink->max_size = 0;
+    return 0;
+}
+
 /* report a zlib or i/o error */
 void zerr(int ret)
 {
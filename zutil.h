@@ -27,12 +27,45 @@
 #endif
 
 #define CHUNK 16384  /* =256*64 on the order of 128K or 256K should be used */
+#define DEF_MT_BLOCK (128 * 1024) /* input bytes per parallel deflate job */
+#define DEF_MT_DICT  32768        /* deflate window, primed from prev block */
+#define ZS_DEFLATE 1
+#define ZS_INFLATE 0
+#define ZS_STEP (1U << 30)        /* max bytes handed to zlib per call */
 
 /* TYPEDEFS */
 typedef unsigned char U8;
 typedef unsigned long int U64;
 
+/* a reusable deflate or inflate state, see zs_run() */
+typedef struct zs_stream {
+    z_stream strm;
+    int mode;        /* ZS_DEFLATE or ZS_INFLATE                  */
+    int ended;       /* Z_STREAM_END seen, zs_reset() to reuse    */
+} ZS_STREAM;
+
+/* growable output buffer for zs_run_sink() */
+typedef struct zs_sink {
+    U8 *buf;         /* output data                               */
+    U64 size;        /* valid bytes in buf                        */
+    U64 max_size;    /* capacity of buf                           */
+} ZS_SINK;
+
 /* FUNCTION PROTOTYPES */
 int mem_def(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len, int level);
 int mem_inf(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len);
+int mem_def_mt(U8 *dest, U64 *dest_len, U8 *source, U64 source_len,
+               int level, int nthreads);
+U64 mem_def_mt_bound(U64 source_len);
+int mem_join(U8 *dest, U64 *dest_len, U8 **sources, U64 *source_lens, int n);
+int zs_def_init(ZS_STREAM *zs, int level);
+int zs_inf_init(ZS_STREAM *zs);
+int zs_reset(ZS_STREAM *zs);
+void zs_end(ZS_STREAM *zs);
+int zs_run(ZS_STREAM *zs, U8 *src, U64 src_len, U64 *src_used,
+           U8 *dest, U64 dest_cap, U64 *dest_len, int flush);
+int zs_run_sink(ZS_STREAM *zs, U8 *src, U64 src_len, int flush,
+                ZS_SINK *sink);
+int zs_sink_init(ZS_SINK *sink, U64 max_size);
+int zs_sink_cleanup(ZS_SINK *sink);
 void zerr(int ret);